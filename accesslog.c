@@ -0,0 +1,224 @@
+/*
+ * accesslog.c - Asynchronous, batched access log
+ *
+ * Request threads never touch the log file. Each one appends a small
+ * binary record (time, host, URL and size) to a ring buffer of its own
+ * and goes on; a writer thread collects the records of all the rings,
+ * formats them into lines and appends them to the file with one large
+ * write() per batch. Formatting the time is the costly part of a line,
+ * so the writer does it once per second and reuses the string.
+ *
+ * Each ring has one producer, its thread, and one consumer, the writer,
+ * so it needs no lock: the producer publishes a record by advancing
+ * head with a release store and the writer frees the space by advancing
+ * tail. When a ring is full because the disk cannot keep up, the record
+ * is dropped and counted instead of blocking the request or growing
+ * memory. Rings are never freed: a thread that exits hands its ring
+ * back and the next thread to log takes it over, so there are only as
+ * many rings as threads that ever logged at the same time.
+ */
+#include "csapp.h"
+#include "accesslog.h"
+#include <stdint.h>
+
+#define LOG_BATCH (256 * 1024)      /* Formatted bytes per write() */
+#define LOG_IDLE_MS 20              /* Writer's nap when every ring is empty */
+#define REC_SKIP UINT32_MAX         /* host_len of the filler up to a ring's end */
+
+/* Record header, followed by the host and URL bytes; 8-byte aligned */
+typedef struct {
+    uint32_t len;                   /* Whole record, padding included */
+    uint32_t host_len;
+    uint32_t url_len;
+    uint32_t pad;
+    int64_t time;
+    uint64_t size;
+} log_rec_t;
+
+typedef struct log_ring {
+    uint64_t head __attribute__((aligned(64)));  /* Advanced by the owner */
+    uint64_t tail __attribute__((aligned(64)));  /* Advanced by the writer */
+    int owned;                      /* A live thread logs into it */
+    struct log_ring *next;          /* All rings, newest first */
+    char buf[ACCESSLOG_RING];
+} log_ring_t;
+
+static log_ring_t *rings;
+static int log_fd = -1;
+static unsigned long dropped;
+static pthread_key_t ring_key;
+static __thread log_ring_t *my_ring;
+
+static void *writer_thread(void *vargp);
+
+static void release_ring(void *vp) {
+    /* Hands an exiting thread's ring to the next thread that logs */
+    log_ring_t *rp = vp;
+
+    __atomic_store_n(&rp->owned, 0, __ATOMIC_RELEASE);
+}
+
+void accesslog_init(const char *path) {
+    /* Opens the log for appending and starts the writer */
+    pthread_t tid;
+
+    if ((log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "access log: cannot open %s: %s\n", path, strerror(errno));
+        return;
+    }
+    pthread_key_create(&ring_key, release_ring);
+    Pthread_create(&tid, NULL, writer_thread, NULL);
+}
+
+unsigned long accesslog_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+static log_ring_t *claim_ring(void) {
+    /* Takes over a ring that no live thread owns, or adds a new one */
+    log_ring_t *rp;
+    int unowned;
+
+    for (rp = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); rp; rp = rp->next) {
+        unowned = 0;
+        if (__atomic_compare_exchange_n(&rp->owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (rp == NULL) {
+        rp = Calloc(1, sizeof(log_ring_t));
+        rp->owned = 1;
+        rp->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &rp->next, rp, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(ring_key, rp);
+    return rp;
+}
+
+void accesslog_record(const char *host, const char *url, size_t size) {
+    /* Queues one log line for the writer; drops it if this thread's ring is full */
+    log_ring_t *rp = my_ring;
+    size_t host_len = strlen(host), url_len = strlen(url);
+    uint64_t head, off, skip, len;
+    log_rec_t *rec;
+
+    if (log_fd < 0)
+        return;
+    if (rp == NULL)
+        rp = my_ring = claim_ring();
+
+    // A record must not fill more than half the ring; cut very long URLs short
+    if (sizeof(log_rec_t) + host_len + url_len > ACCESSLOG_RING / 2) {
+        if (sizeof(log_rec_t) + host_len > ACCESSLOG_RING / 2)
+            host_len = 0;
+        url_len = ACCESSLOG_RING / 2 - sizeof(log_rec_t) - host_len;
+    }
+    len = (sizeof(log_rec_t) + host_len + url_len + 7) & ~(uint64_t)7;
+
+    // Records do not wrap: one that does not fit before the end starts over at 0
+    head = rp->head;
+    off = head % ACCESSLOG_RING;
+    skip = ACCESSLOG_RING - off < len ? ACCESSLOG_RING - off : 0;
+    if (head + skip + len - __atomic_load_n(&rp->tail, __ATOMIC_ACQUIRE) > ACCESSLOG_RING) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (skip >= sizeof(log_rec_t)) {
+        rec = (log_rec_t *)(rp->buf + off);
+        rec->len = skip;
+        rec->host_len = REC_SKIP;
+    }
+    head += skip;
+
+    rec = (log_rec_t *)(rp->buf + head % ACCESSLOG_RING);
+    rec->len = len;
+    rec->host_len = host_len;
+    rec->url_len = url_len;
+    rec->time = time(NULL);
+    rec->size = size;
+    memcpy((char *)(rec + 1), host, host_len);
+    memcpy((char *)(rec + 1) + host_len, url, url_len);
+    __atomic_store_n(&rp->head, head + len, __ATOMIC_RELEASE);
+}
+
+static void flush(const char *p, size_t n) {
+    /* Appends a batch of lines to the log file */
+    ssize_t m;
+
+    while (n > 0) {
+        if ((m = write(log_fd, p, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "access log: write failed: %s\n", strerror(errno));
+            return;
+        }
+        p += m;
+        n -= m;
+    }
+}
+
+static void *writer_thread(void *vargp) {
+    /* Drains every ring into batches of lines, forever */
+    char *out = Malloc(LOG_BATCH), stamp[MAXLINE];
+    size_t n = 0, stamp_len = 0;
+    time_t stamp_time = -1;
+    struct tm tm;
+    log_ring_t *rp;
+    const log_rec_t *rec;
+    uint64_t head, tail, off;
+    int busy;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        busy = 0;
+        for (rp = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); rp; rp = rp->next) {
+            head = __atomic_load_n(&rp->head, __ATOMIC_ACQUIRE);
+            for (tail = rp->tail; tail < head; tail += rec->len) {
+                // Too little room for even a filler record: the producer skipped it
+                off = tail % ACCESSLOG_RING;
+                if (ACCESSLOG_RING - off < sizeof(log_rec_t)) {
+                    tail += ACCESSLOG_RING - off;
+                    if (tail == head)
+                        break;
+                }
+                rec = (const log_rec_t *)(rp->buf + tail % ACCESSLOG_RING);
+                if (rec->host_len == REC_SKIP)
+                    continue;
+
+                if (n + rec->host_len + rec->url_len + MAXLINE > LOG_BATCH) {
+                    flush(out, n);
+                    n = 0;
+                }
+                // The same format as ever, with the time formatted once a second
+                if (rec->time != stamp_time) {
+                    stamp_time = rec->time;
+                    localtime_r(&stamp_time, &tm);
+                    stamp_len = strftime(stamp, sizeof(stamp), "%a %d %b %Y %H:%M:%S %Z", &tm);
+                }
+                memcpy(out + n, stamp, stamp_len);
+                n += stamp_len;
+                out[n++] = ':';
+                out[n++] = ' ';
+                memcpy(out + n, (const char *)(rec + 1), rec->host_len);
+                n += rec->host_len;
+                out[n++] = ' ';
+                memcpy(out + n, (const char *)(rec + 1) + rec->host_len, rec->url_len);
+                n += rec->url_len;
+                n += sprintf(out + n, " %llu\n", (unsigned long long)rec->size);
+            }
+            if (tail != rp->tail) {
+                __atomic_store_n(&rp->tail, tail, __ATOMIC_RELEASE);
+                busy = 1;
+            }
+        }
+        if (n > 0) {
+            flush(out, n);
+            n = 0;
+        }
+        if (!busy)
+            usleep(LOG_IDLE_MS * 1000);
+    }
+    return NULL;
+}
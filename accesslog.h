@@ -0,0 +1,16 @@
+/*
+ * accesslog.h - Asynchronous, batched access log
+ */
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stddef.h>
+
+#define ACCESSLOG_PATH "proxy.log"
+#define ACCESSLOG_RING (32 * 1024)  /* Bytes of pending records per thread */
+
+void accesslog_init(const char *path);
+void accesslog_record(const char *host, const char *url, size_t size);
+unsigned long accesslog_dropped(void);
+
+#endif /* __ACCESSLOG_H__ */
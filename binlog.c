@@ -0,0 +1,288 @@
+/*
+ * binlog.c - Fixed-layout binary access log in a preallocated mmap'd file
+ *
+ * With `-L <file>` the access log is written as binary records instead
+ * of text lines: 64 bytes per request with the time in ns, the client
+ * address, an id for the URL, the status, the response bytes, what
+ * the cache did and when each phase of the request ended. Nothing is
+ * formatted and a request thread makes no system call to log; it
+ * claims the next slot with one atomic add and fills it in the shared
+ * mapping, and the kernel writes the pages back. The file
+ * is allocated at its full size up front and used as a ring: once it
+ * is full, new records overwrite the oldest. A record's seq is stored
+ * last, so a reader can tell a slot that is still being written, or
+ * that has been overwritten, from the record it expects. binlogdump
+ * turns the file back into text or CSV and summarizes it.
+ *
+ * URLs are interned: the first time a URL is logged it becomes a line
+ * of <file>.urls, and its line number is its id from then on. The
+ * table from URL to id is sharded by hash like the caches. New lines
+ * are queued in memory and appended by a background thread, so a
+ * record may name a URL that reaches the file a moment later; when
+ * the queue is full, the URL is logged without an id and interned on
+ * a later request. Restarting
+ * the proxy on a log of the same size carries on where it stopped, with
+ * the URL ids read back from the .urls file; any other file is started
+ * afresh.
+ */
+#include "csapp.h"
+#include "binlog.h"
+
+#define URL_SHARDS 16
+#define URL_BUCKETS 4096            /* Hash chains per shard */
+#define URLS_PENDING (64 * 1024)    /* URL lines queued for the file at most */
+
+typedef struct url_entry {
+    unsigned long hash;
+    uint32_t id;
+    struct url_entry *next;
+    char url[];
+} url_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    url_entry_t *buckets[URL_BUCKETS];
+} __attribute__((aligned(64))) url_shard_t;
+
+static binlog_hdr_t *hdr;           /* The mapping; NULL when the log is off */
+static binlog_rec_t *slots;
+static int urls_fd = -1;
+static uint32_t nurls;              /* Ids handed out */
+static pthread_mutex_t urls_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t urls_ready = PTHREAD_COND_INITIALIZER;
+static char pending[URLS_PENDING];  /* Lines of new ids not yet appended; under urls_lock */
+static size_t pending_len;
+static url_shard_t shards[URL_SHARDS];
+
+static void *urls_thread(void *vargp);
+
+static unsigned long url_hash(const char *url, size_t len) {
+    /* FNV-1a over the URL */
+    unsigned long h = 14695981039346656037UL;
+
+    while (len--)
+        h = (h ^ (unsigned char)*url++) * 1099511628211UL;
+    return h;
+}
+
+static url_entry_t **chain_of(unsigned long h) {
+    return &shards[h % URL_SHARDS].buckets[(h / URL_SHARDS) % URL_BUCKETS];
+}
+
+static void add_url(unsigned long h, const char *url, size_t len, uint32_t id) {
+    /* Links a new entry into its chain; the caller holds the shard lock */
+    url_entry_t *e = Malloc(sizeof(url_entry_t) + len + 1), **bp = chain_of(h);
+
+    e->hash = h;
+    e->id = id;
+    memcpy(e->url, url, len);
+    e->url[len] = '\0';
+    e->next = *bp;
+    *bp = e;
+}
+
+static void load_urls(void) {
+    /* Reads back the ids of a log that is carried on */
+    FILE *fp = fdopen(dup(urls_fd), "r");
+    char line[MAXLINE];
+    size_t len;
+
+    if (fp == NULL)
+        return;
+    while (nurls < BINLOG_MAX_URLS && fgets(line, sizeof(line), fp) != NULL) {
+        len = strcspn(line, "\n");
+        nurls++;
+        add_url(url_hash(line, len), line, len, nurls);
+    }
+    fclose(fp);
+}
+
+static uint32_t intern(const char *url) {
+    /* Returns url's id, queueing it for the .urls file if it is new; 0 if the queue is full */
+    size_t len = strlen(url);
+    unsigned long h = url_hash(url, len);
+    url_shard_t *sp = &shards[h % URL_SHARDS];
+    url_entry_t *e;
+    uint32_t id = 0;
+
+    pthread_mutex_lock(&sp->lock);
+    for (e = *chain_of(h); e; e = e->next)
+        if (e->hash == h && !strcmp(e->url, url))
+            break;
+    if (e != NULL) {
+        id = e->id;
+    } else if (len < MAXLINE - 1) {
+        // Ids follow the lines of the file, so numbering and queueing go together
+        pthread_mutex_lock(&urls_lock);
+        if (nurls < BINLOG_MAX_URLS && pending_len + len + 1 <= sizeof(pending)) {
+            memcpy(pending + pending_len, url, len);
+            pending[pending_len + len] = '\n';
+            if (pending_len == 0)
+                pthread_cond_signal(&urls_ready);
+            pending_len += len + 1;
+            id = ++nurls;
+        }
+        pthread_mutex_unlock(&urls_lock);
+        if (id != 0)
+            add_url(h, url, len, id);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return id;
+}
+
+static void *urls_thread(void *vargp) {
+    /* Background thread: appends the queued URL lines to the .urls file */
+    static char batch[URLS_PENDING];
+    size_t len;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&urls_lock);
+        while (pending_len == 0)
+            pthread_cond_wait(&urls_ready, &urls_lock);
+        len = pending_len;
+        memcpy(batch, pending, len);
+        pending_len = 0;
+        pthread_mutex_unlock(&urls_lock);
+        if (rio_writen(urls_fd, batch, len) < 0)
+            fprintf(stderr, "binary log: cannot append URLs: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+int binlog_init(const char *path, size_t size) {
+    /*
+     * Maps the log file at path, size bytes, creating or resetting it
+     * unless it is a log of that size already. Returns -1 if the log
+     * cannot be used.
+     */
+    char urls[MAXLINE];
+    struct stat st;
+    binlog_hdr_t *h, old;
+    pthread_t tid;
+    uint64_t nslots = (size - sizeof(binlog_hdr_t)) / sizeof(binlog_rec_t);
+    int fd, i, fresh;
+
+    if (size < sizeof(binlog_hdr_t) + sizeof(binlog_rec_t) ||
+        strlen(path) + strlen(BINLOG_URLS_SUFFIX) >= sizeof(urls)) {
+        fprintf(stderr, "binary log: bad size or path\n");
+        return -1;
+    }
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "binary log: cannot open %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    // Anything but a log of this size is started afresh, every block allocated
+    // now so that a full disk fails here and not in a page fault later
+    fresh = (size_t)st.st_size != size || pread(fd, &old, sizeof(old), 0) != sizeof(old) ||
+            memcmp(old.magic, BINLOG_MAGIC, 4) || old.rec_size != sizeof(binlog_rec_t) ||
+            old.nslots != nslots;
+    if (fresh && (ftruncate(fd, 0) < 0 || (errno = posix_fallocate(fd, 0, size)) != 0)) {
+        fprintf(stderr, "binary log: cannot allocate %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        fprintf(stderr, "binary log: cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    sprintf(urls, "%s%s", path, BINLOG_URLS_SUFFIX);
+    if ((urls_fd = open(urls, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC | (fresh ? O_TRUNC : 0),
+                        0644)) < 0) {
+        fprintf(stderr, "binary log: cannot open %s: %s\n", urls, strerror(errno));
+        munmap(h, size);
+        return -1;
+    }
+    for (i = 0; i < URL_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+    if (fresh) {
+        memcpy(h->magic, BINLOG_MAGIC, 4);
+        h->rec_size = sizeof(binlog_rec_t);
+        h->nslots = nslots;
+    } else {
+        load_urls();
+    }
+    slots = (binlog_rec_t *)(h + 1);
+    hdr = h;
+    Pthread_create(&tid, NULL, urls_thread, NULL);
+    return 0;
+}
+
+int binlog_enabled(void) {
+    return hdr != NULL;
+}
+
+void binlog_peer(binlog_trace_t *t, const struct sockaddr *sa) {
+    /* Records the address a client connected from */
+    memset(t->addr, 0, sizeof(t->addr));
+    t->port = 0;
+    if (sa->sa_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+
+        t->addr[10] = t->addr[11] = 0xff;
+        memcpy(t->addr + 12, &sin->sin_addr, 4);
+        t->port = ntohs(sin->sin_port);
+    } else if (sa->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+        memcpy(t->addr, &sin6->sin6_addr, 16);
+        t->port = ntohs(sin6->sin6_port);
+    }
+}
+
+void binlog_start(binlog_trace_t *t) {
+    /* Starts the clock for a request that has just been read */
+    struct timespec ts;
+
+    t->status = 0;
+    t->cache = BINLOG_BYPASS;
+    memset(t->phase_us, 0, sizeof(t->phase_us));
+    if (hdr == NULL)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    t->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t->start = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void binlog_mark(binlog_trace_t *t, int phase) {
+    /* Records that a phase of the request ended now */
+    struct timespec ts;
+    uint64_t us;
+
+    if (hdr == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    us = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - t->start) / 1000;
+    t->phase_us[phase] = us == 0 ? 1 : us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+void binlog_write(binlog_trace_t *t, const char *url, size_t bytes) {
+    /* Appends the record of a finished request, overwriting the oldest once full */
+    uint64_t n;
+    binlog_rec_t *rec;
+
+    if (hdr == NULL)
+        return;
+    if (t->phase_us[BINLOG_DONE] == 0)
+        binlog_mark(t, BINLOG_DONE);
+    n = __atomic_fetch_add(&hdr->next, 1, __ATOMIC_RELAXED);
+    rec = &slots[n % hdr->nslots];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->time_ns = t->time_ns;
+    rec->bytes = bytes;
+    memcpy(rec->addr, t->addr, sizeof(rec->addr));
+    rec->port = t->port;
+    rec->status = t->status;
+    rec->url_id = intern(url);
+    rec->cache = t->cache;
+    memcpy(rec->phase_us, t->phase_us, sizeof(rec->phase_us));
+    __atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,77 @@
+/*
+ * binlog.h - Fixed-layout binary access log in a preallocated mmap'd file
+ */
+#ifndef __BINLOG_H__
+#define __BINLOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sockaddr;
+
+#define BINLOG_MAGIC "PXB1"
+#define BINLOG_SIZE (64L * 1024 * 1024)  /* Default log file size */
+#define BINLOG_MAX_URLS (1 << 20)       /* URLs interned; later ones get id 0 */
+#define BINLOG_URLS_SUFFIX ".urls"      /* Interned URLs, one per line, line n is id n */
+
+/* How the cache took part in a request */
+typedef enum {
+    BINLOG_BYPASS,                  /* Not cacheable, or the cache is off */
+    BINLOG_MISS,
+    BINLOG_HIT,
+    BINLOG_STALE,                   /* Stale copy served: refreshing, or the server failed */
+    BINLOG_REVALIDATED,             /* Stale copy confirmed by a 304 */
+    BINLOG_COLLAPSED,               /* Streamed from another request's fetch */
+    BINLOG_NCACHE
+} binlog_cache_t;
+
+/* Phase ends, in microseconds since the request was read; 0 if not reached */
+enum {
+    BINLOG_CONNECTED,               /* Connection to the end server ready */
+    BINLOG_HEADER,                  /* Response header in from the end server */
+    BINLOG_DONE,                    /* Last response byte written */
+    BINLOG_PHASES
+};
+
+/* One request, 64 bytes */
+typedef struct {
+    uint64_t seq;                   /* Record number + 1, stored last; 0 while written */
+    uint64_t time_ns;               /* Wall clock when the request was read */
+    uint64_t bytes;                 /* Response bytes written to the client */
+    uint8_t addr[16];               /* Client address; IPv4 as ::ffff:a.b.c.d */
+    uint16_t port;                  /* Client port */
+    uint16_t status;                /* Response status; 0 if there was none */
+    uint32_t url_id;
+    uint8_t cache;                  /* binlog_cache_t */
+    uint8_t pad[3];
+    uint32_t phase_us[BINLOG_PHASES];
+} binlog_rec_t;
+
+/* File header; slots follow, record n in slot n % nslots */
+typedef struct {
+    char magic[4];
+    uint32_t rec_size;
+    uint64_t nslots;
+    uint64_t next;                  /* Records ever claimed */
+    char pad[40];
+} binlog_hdr_t;
+
+/* A request being traced, for its record */
+typedef struct {
+    uint64_t time_ns;
+    uint64_t start;                 /* Monotonic ns, for the phases */
+    uint8_t addr[16];
+    uint16_t port;
+    int status;
+    binlog_cache_t cache;
+    uint32_t phase_us[BINLOG_PHASES];
+} binlog_trace_t;
+
+int binlog_init(const char *path, size_t size);
+int binlog_enabled(void);
+void binlog_peer(binlog_trace_t *t, const struct sockaddr *sa);
+void binlog_start(binlog_trace_t *t);
+void binlog_mark(binlog_trace_t *t, int phase);
+void binlog_write(binlog_trace_t *t, const char *url, size_t bytes);
+
+#endif /* __BINLOG_H__ */
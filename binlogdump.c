@@ -0,0 +1,306 @@
+/*
+ * binlogdump.c - Decodes and summarizes the proxy's binary access log
+ *
+ * usage: binlogdump [-f text|csv] [-s] [-t n] <file>
+ *
+ * Reads a log written with `proxy -L <file>`, and the URLs interned in
+ * <file>.urls, without disturbing a proxy that is still writing it.
+ * Records come out oldest first, one per line, as text or as CSV with a
+ * header row. -s prints a summary instead: the time span, requests and
+ * bytes, the status classes, what the cache did, and percentiles of the
+ * phase timings. -t n adds the n most requested URLs to it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "binlog.h"
+
+static const char *cache_names[BINLOG_NCACHE] = {
+    "BYPASS", "MISS", "HIT", "STALE", "REVALIDATED", "COLLAPSED"
+};
+
+/* The URL table read from <file>.urls; urls[id - 1] is URL id */
+static char **urls;
+static uint32_t nurls;
+
+/* Per-URL totals for -t */
+typedef struct {
+    uint32_t id;
+    unsigned long count, hits;
+    uint64_t bytes;
+} url_total_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-f text|csv] [-s] [-t n] <file>\n", prog);
+    fprintf(stderr, "  -f  record format (default: text)\n");
+    fprintf(stderr, "  -s  print a summary instead of the records\n");
+    fprintf(stderr, "  -t  with the summary, the n most requested URLs\n");
+    exit(1);
+}
+
+static void load_urls(const char *path) {
+    /* Reads the interned URLs that belong to the log at path */
+    char name[4096], line[65536];
+    size_t cap = 0, len;
+    FILE *fp;
+
+    snprintf(name, sizeof(name), "%s%s", path, BINLOG_URLS_SUFFIX);
+    if ((fp = fopen(name, "r")) == NULL) {
+        fprintf(stderr, "binlogdump: no URLs in %s, printing ids\n", name);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        len = strcspn(line, "\n");
+        line[len] = '\0';
+        if (nurls == cap) {
+            cap = cap ? 2 * cap : 1024;
+            urls = realloc(urls, cap * sizeof(char *));
+        }
+        urls[nurls++] = strdup(line);
+    }
+    fclose(fp);
+}
+
+static const char *url_of(uint32_t id, char *buf) {
+    /* Returns URL id, or a placeholder for one that was not interned */
+    if (id > 0 && id <= nurls)
+        return urls[id - 1];
+    sprintf(buf, "#%u", id);
+    return buf;
+}
+
+static int read_rec(const binlog_rec_t *slots, uint64_t nslots, uint64_t n, binlog_rec_t *rec) {
+    /*
+     * Copies record n into rec; returns 0 if its slot holds another record
+     * or was rewritten while it was copied
+     */
+    const binlog_rec_t *slot = &slots[n % nslots];
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != n + 1)
+        return 0;
+    memcpy(rec, slot, sizeof(*rec));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == n + 1;
+}
+
+static void format_addr(const binlog_rec_t *rec, char *buf) {
+    /* Writes the client address, IPv4-mapped ones in dotted form */
+    static const uint8_t v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    if (!memcmp(rec->addr, v4mapped, 12))
+        inet_ntop(AF_INET, rec->addr + 12, buf, INET6_ADDRSTRLEN);
+    else
+        inet_ntop(AF_INET6, rec->addr, buf, INET6_ADDRSTRLEN);
+}
+
+static void format_phase(uint32_t us, char *buf) {
+    if (us == 0)
+        strcpy(buf, "-");
+    else
+        sprintf(buf, "%u", us);
+}
+
+static void print_text(const binlog_rec_t *rec) {
+    /* One record as a line: time, client, status, cache, bytes, phases, URL */
+    char addr[INET6_ADDRSTRLEN], stamp[64], idbuf[32], ph[BINLOG_PHASES][16];
+    time_t secs = rec->time_ns / 1000000000;
+    struct tm tm;
+    int i;
+
+    gmtime_r(&secs, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    format_addr(rec, addr);
+    for (i = 0; i < BINLOG_PHASES; i++)
+        format_phase(rec->phase_us[i], ph[i]);
+    printf("%s.%06u %s:%u %u %s %llu connect=%s header=%s done=%s %s\n",
+           stamp, (unsigned)(rec->time_ns % 1000000000 / 1000), addr, rec->port,
+           rec->status, rec->cache < BINLOG_NCACHE ? cache_names[rec->cache] : "?",
+           (unsigned long long)rec->bytes, ph[BINLOG_CONNECTED], ph[BINLOG_HEADER],
+           ph[BINLOG_DONE], url_of(rec->url_id, idbuf));
+}
+
+static void print_csv(const binlog_rec_t *rec) {
+    /* One record as a CSV row; the URL is quoted, with its quotes doubled */
+    char addr[INET6_ADDRSTRLEN], idbuf[32];
+    const char *url = url_of(rec->url_id, idbuf);
+
+    format_addr(rec, addr);
+    printf("%llu,%s,%u,%u,%s,%llu,%u,%u,%u,\"", (unsigned long long)rec->time_ns, addr,
+           rec->port, rec->status, rec->cache < BINLOG_NCACHE ? cache_names[rec->cache] : "?",
+           (unsigned long long)rec->bytes, rec->phase_us[BINLOG_CONNECTED],
+           rec->phase_us[BINLOG_HEADER], rec->phase_us[BINLOG_DONE]);
+    for (; *url; url++) {
+        if (*url == '"')
+            putchar('"');
+        putchar(*url);
+    }
+    printf("\"\n");
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_count(const void *a, const void *b) {
+    const url_total_t *x = a, *y = b;
+
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static void print_percentiles(const char *name, uint32_t *v, size_t n) {
+    /* Prints p50/p90/p99/max of n timings, sorting them in place */
+    if (n == 0) {
+        printf("%-8s -\n", name);
+        return;
+    }
+    qsort(v, n, sizeof(uint32_t), cmp_u32);
+    printf("%-8s p50 %u us  p90 %u us  p99 %u us  max %u us  (%zu requests)\n", name,
+           v[n / 2], v[n * 9 / 10], v[n * 99 / 100], v[n - 1], n);
+}
+
+static void summarize(const binlog_hdr_t *hdr, const binlog_rec_t *slots, uint64_t first,
+                      uint64_t last, int top) {
+    /* Aggregates records first to last - 1 and prints the summary */
+    unsigned long count = 0, status[6] = { 0 }, cache[BINLOG_NCACHE] = { 0 }, cached;
+    uint64_t bytes = 0, t_min = 0, t_max = 0, n;
+    uint32_t *phases[BINLOG_PHASES];
+    size_t nphase[BINLOG_PHASES] = { 0 };
+    url_total_t *totals = calloc(nurls + 1, sizeof(url_total_t));
+    binlog_rec_t rec;
+    char from[64], to[64], idbuf[32];
+    time_t secs;
+    int i;
+
+    for (i = 0; i < BINLOG_PHASES; i++)
+        phases[i] = malloc((last - first) * sizeof(uint32_t) + 1);
+    for (n = first; n < last; n++) {
+        if (!read_rec(slots, hdr->nslots, n, &rec))
+            continue;
+        if (count++ == 0 || rec.time_ns < t_min)
+            t_min = rec.time_ns;
+        if (rec.time_ns > t_max)
+            t_max = rec.time_ns;
+        bytes += rec.bytes;
+        status[rec.status >= 100 && rec.status < 600 ? rec.status / 100 : 0]++;
+        if (rec.cache < BINLOG_NCACHE)
+            cache[rec.cache]++;
+        for (i = 0; i < BINLOG_PHASES; i++)
+            if (rec.phase_us[i] != 0)
+                phases[i][nphase[i]++] = rec.phase_us[i];
+        if (rec.url_id <= nurls) {
+            totals[rec.url_id].id = rec.url_id;
+            totals[rec.url_id].count++;
+            totals[rec.url_id].bytes += rec.bytes;
+            totals[rec.url_id].hits += rec.cache >= BINLOG_HIT;
+        }
+    }
+
+    printf("records  %lu\n", count);
+    if (count == 0)
+        return;
+    secs = t_min / 1000000000;
+    strftime(from, sizeof(from), "%Y-%m-%d %H:%M:%S", gmtime(&secs));
+    secs = t_max / 1000000000;
+    strftime(to, sizeof(to), "%Y-%m-%d %H:%M:%S", gmtime(&secs));
+    printf("span     %s - %s UTC (%.1f s, %.1f requests/s)\n", from, to,
+           (t_max - t_min) / 1e9, t_max > t_min ? count / ((t_max - t_min) / 1e9) : 0);
+    printf("bytes    %llu (%.0f per request)\n", (unsigned long long)bytes, (double)bytes / count);
+    printf("status   1xx %lu  2xx %lu  3xx %lu  4xx %lu  5xx %lu  none %lu\n",
+           status[1], status[2], status[3], status[4], status[5], status[0]);
+    printf("cache   ");
+    for (i = 0; i < BINLOG_NCACHE; i++)
+        printf(" %s %lu", cache_names[i], cache[i]);
+    cached = count - cache[BINLOG_BYPASS];
+    printf("\n");
+    if (cached > 0)
+        printf("hits     %.1f%% of cacheable requests answered without a fetch of their own\n",
+               100.0 * (cached - cache[BINLOG_MISS]) / cached);
+    print_percentiles("connect", phases[BINLOG_CONNECTED], nphase[BINLOG_CONNECTED]);
+    print_percentiles("header", phases[BINLOG_HEADER], nphase[BINLOG_HEADER]);
+    print_percentiles("done", phases[BINLOG_DONE], nphase[BINLOG_DONE]);
+
+    if (top > 0) {
+        qsort(totals, nurls + 1, sizeof(url_total_t), cmp_count);
+        printf("top URLs (requests, hits, bytes):\n");
+        for (i = 0; i < top && i <= (int)nurls && totals[i].count > 0; i++)
+            printf("%8lu %8lu %12llu  %s\n", totals[i].count, totals[i].hits,
+                   (unsigned long long)totals[i].bytes, url_of(totals[i].id, idbuf));
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt, csv = 0, summary = 0, top = 0, fd;
+    struct stat st;
+    const binlog_hdr_t *hdr;
+    const binlog_rec_t *slots;
+    binlog_rec_t rec;
+    uint64_t first, last, n;
+
+    while ((opt = getopt(argc, argv, "f:st:")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (!strcmp(optarg, "csv"))
+                csv = 1;
+            else if (strcmp(optarg, "text"))
+                usage(argv[0]);
+            break;
+        case 's':
+            summary = 1;
+            break;
+        case 't':
+            if ((top = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            summary = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(binlog_hdr_t) ||
+        (hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        memcmp(hdr->magic, BINLOG_MAGIC, 4) || hdr->rec_size != sizeof(binlog_rec_t) ||
+        hdr->nslots == 0 ||
+        hdr->nslots > (st.st_size - sizeof(binlog_hdr_t)) / sizeof(binlog_rec_t)) {
+        fprintf(stderr, "%s: not a binary access log\n", argv[optind]);
+        return 1;
+    }
+    close(fd);
+    slots = (const binlog_rec_t *)(hdr + 1);
+    load_urls(argv[optind]);
+
+    // Once the ring has wrapped, only the last nslots records are left; a proxy
+    // still writing may have overwritten some of those by the time they are read
+    last = __atomic_load_n(&hdr->next, __ATOMIC_ACQUIRE);
+    first = last > hdr->nslots ? last - hdr->nslots : 0;
+    if (summary) {
+        summarize(hdr, slots, first, last, top);
+        return 0;
+    }
+    if (csv)
+        printf("time_ns,client,port,status,cache,bytes,connect_us,header_us,done_us,url\n");
+    for (n = first; n < last; n++) {
+        // A slot being written, or overwritten since, has another seq
+        if (!read_rec(slots, hdr->nslots, n, &rec))
+            continue;
+        if (csv)
+            print_csv(&rec);
+        else
+            print_text(&rec);
+    }
+    return 0;
+}
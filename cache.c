@@ -0,0 +1,844 @@
+/*
+ * cache.c - Thread-safe in-memory cache of proxied GET responses
+ *
+ * Objects are keyed by the normalized request URI and hold the complete
+ * response as it was relayed to the client, so a hit can be written
+ * back without contacting the end server. The total size of cached
+ * bodies is bounded by max_cache and each object by max_object.
+ *
+ * The index is split into a power-of-two number of shards selected by
+ * the key hash, each with its own reader-writer lock on its own cache
+ * line. A hit only takes its shard's lock for reading and writes
+ * nothing but the object it found (its reference count, and its
+ * "referenced" bit if that was still clear) and its shard's counters.
+ * Recency is approximated with second-chance FIFOs: the eviction hand
+ * moves referenced objects to the back of the queue instead of evicting
+ * them, so promotion happens in batches under the write lock taken for
+ * insertions rather than on every hit.
+ *
+ * With the default W-TinyLFU policy, new objects first enter a small
+ * admission window (1% of the budget, but at least one object). When
+ * the window overflows, its oldest object becomes a candidate for the
+ * main area and is only let in if it has been accessed more often than
+ * each object it would evict, according to the frequency sketch in
+ * sketch.c. One-hit wonders therefore pass through the window without
+ * flushing the popular objects. The plain LRU policy (-P lru) inserts
+ * straight into the main area and always evicts.
+ *
+ * Objects are reference counted: a reader keeps using its object after
+ * it has been evicted, and the last release frees it.
+ *
+ * With -D, objects evicted from the main area are handed to the disk
+ * tier in disk.c instead of being dropped. A memory miss then looks on
+ * disk; a disk hit is returned as an unindexed object that points into
+ * the segment mapping, and a copy is promoted back into memory.
+ *
+ * Freshness follows RFC 9111. When an object is stored, its lifetime
+ * is taken from Cache-Control (s-maxage, then max-age), else Expires
+ * minus Date, else a tenth of its Last-Modified age, and its birth time
+ * from Date and Age; no-cache and must-revalidate forbid serving it
+ * stale, and stale-while-revalidate and stale-if-error (RFC 5861) give
+ * windows past the lifetime in which it still may be. Callers judge a
+ * hit with cache_freshness(). A 304 answer to a revalidation is merged
+ * into the stale object by cache_refresh(), which stores the result as
+ * a new object with the body unchanged.
+ */
+#include "cache.h"
+#include "disk.h"
+#include "flight.h"
+#include "http.h"
+#include "sketch.h"
+#include "sysdep.h"
+
+#define SHARD_BUCKETS 256       /* Hash chains per shard */
+#define MAX_SHARDS 256
+#define WINDOW_PERCENT 1        /* Admission window share of the budget */
+
+typedef struct {
+    pthread_rwlock_t lock;
+    cache_obj_t *buckets[SHARD_BUCKETS];
+    cache_obj_t *win_head, *win_tail;    /* Window FIFO, oldest first */
+    cache_obj_t *main_head, *main_tail;  /* Main second-chance FIFO */
+    unsigned long hits, misses;
+} __attribute__((aligned(64))) shard_t;
+
+static cache_policy_t policy;
+static size_t max_cache, max_object;
+static size_t window_budget, main_budget;
+static size_t window_size, main_size;   /* Updated on insert and evict only */
+static shard_t *shards;
+static unsigned nshards;                /* Power of two */
+static unsigned evict_hand;             /* Next shard to evict from */
+static unsigned long admitted, rejected, evictions, disk_hits;
+
+/* The Cache-Control directives this cache acts on; -1 where absent */
+typedef struct {
+    long max_age, s_maxage, swr, sie;
+    int no_store, no_cache, must_revalidate;
+} cache_control_t;
+
+static cache_obj_t *insert_owned(const char *key, char *data, size_t size, int from_disk,
+                                 time_t born);
+static void set_freshness(cache_obj_t *obj, time_t now);
+
+static unsigned long hash(const char *key) {
+    /* FNV-1a over the key string */
+    unsigned long h = 14695981039346656037UL;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 1099511628211UL;
+    return h;
+}
+
+static inline shard_t *shard_of(unsigned long h) {
+    return &shards[(h >> 32) & (nshards - 1)];
+}
+
+static inline cache_obj_t **bucket_of(shard_t *sp, unsigned long h) {
+    return &sp->buckets[h % SHARD_BUCKETS];
+}
+
+void cache_init(size_t max_cache_size, size_t max_object_size, cache_policy_t pol) {
+    /* Sets the cache budget and builds the shards; a zero budget disables caching */
+    unsigned i;
+
+    policy = pol;
+    max_cache = max_cache_size;
+    max_object = max_object_size < max_cache_size ? max_object_size : max_cache_size;
+
+    if (policy == CACHE_TINYLFU) {
+        window_budget = max_cache / 100 * WINDOW_PERCENT;
+        if (window_budget < max_object)
+            window_budget = max_object;
+        if (window_budget > max_cache / 2)
+            window_budget = max_cache / 2;
+        // Assume objects of a few KiB when sizing the sketch
+        sketch_init(max_cache / 2048);
+    }
+    main_budget = max_cache - window_budget;
+
+    // A few shards per core keeps writers on different locks most of the time
+    for (nshards = 1; nshards < 4 * (unsigned)ncpus() && nshards < MAX_SHARDS; nshards <<= 1)
+        ;
+    shards = Calloc(nshards, sizeof(shard_t));
+    for (i = 0; i < nshards; i++)
+        pthread_rwlock_init(&shards[i].lock, NULL);
+}
+
+int cache_enabled(void) {
+    return max_cache > 0;
+}
+
+void cache_key(char *key, const char *hostname, int port, const char *path) {
+    /* Builds the normalized key host:port/path, with the host in lower case */
+    char *p = key;
+
+    while (*hostname)
+        *p++ = tolower((unsigned char)*hostname++);
+    sprintf(p, ":%d%s", port, *path ? path : "/");
+}
+
+cache_obj_t *cache_lookup(const char *key) {
+    /* Returns a referenced object for key, or NULL on a miss */
+    unsigned long h;
+    shard_t *sp;
+    cache_obj_t *obj;
+
+    if (!cache_enabled())
+        return NULL;
+
+    h = hash(key);
+    if (policy == CACHE_TINYLFU)
+        sketch_record(h);
+
+    sp = shard_of(h);
+    pthread_rwlock_rdlock(&sp->lock);
+    for (obj = *bucket_of(sp, h); obj; obj = obj->next) {
+        if (obj->hash == h && !strcmp(obj->key, key)) {
+            __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+            // Read before writing so hot objects do not bounce their line around
+            if (!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED))
+                __atomic_store_n(&obj->referenced, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    // The shard's line is already dirty from the lock, so count here
+    __atomic_add_fetch(obj ? &sp->hits : &sp->misses, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&sp->lock);
+
+    if (obj == NULL && (obj = disk_lookup(key, h)) != NULL) {
+        __atomic_add_fetch(&disk_hits, 1, __ATOMIC_RELAXED);
+        set_freshness(obj, time(NULL));
+        if (obj->size <= max_object) {
+            char *copy = Malloc(obj->size);
+            memcpy(copy, obj->data, obj->size);
+            cache_release(insert_owned(key, copy, obj->size, 1, obj->born));
+        }
+    }
+    return obj;
+}
+
+void cache_retain(cache_obj_t *obj) {
+    /* Takes another reference on an object the caller already holds */
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void cache_release(cache_obj_t *obj) {
+    /* Drops a reference taken by cache_lookup */
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(obj->key);
+        if (obj->seg)
+            disk_segment_release(obj->seg);
+        else
+            free(obj->data);
+        free(obj);
+    }
+}
+
+static void q_remove(cache_obj_t **head, cache_obj_t **tail, cache_obj_t *obj) {
+    /* Unlinks obj from a FIFO; caller holds the shard's write lock */
+    if (obj->prev_q)
+        obj->prev_q->next_q = obj->next_q;
+    else
+        *head = obj->next_q;
+    if (obj->next_q)
+        obj->next_q->prev_q = obj->prev_q;
+    else
+        *tail = obj->prev_q;
+    obj->prev_q = obj->next_q = NULL;
+}
+
+static void q_prepend(cache_obj_t **head, cache_obj_t **tail, cache_obj_t *obj) {
+    /* Links obj at the front of a FIFO; caller holds the shard's write lock */
+    obj->prev_q = NULL;
+    obj->next_q = *head;
+    if (*head)
+        (*head)->prev_q = obj;
+    else
+        *tail = obj;
+    *head = obj;
+}
+
+static void q_append(cache_obj_t **head, cache_obj_t **tail, cache_obj_t *obj) {
+    /* Links obj at the back of a FIFO; caller holds the shard's write lock */
+    obj->prev_q = *tail;
+    obj->next_q = NULL;
+    if (*tail)
+        (*tail)->next_q = obj;
+    else
+        *head = obj;
+    *tail = obj;
+}
+
+static void unlink_obj(shard_t *sp, cache_obj_t *victim) {
+    /* Removes victim from the index and its queue; caller holds the write lock */
+    cache_obj_t **pp = bucket_of(sp, victim->hash);
+
+    while (*pp != victim)
+        pp = &(*pp)->next;
+    *pp = victim->next;
+
+    switch (victim->state) {
+    case OBJ_WINDOW:
+        q_remove(&sp->win_head, &sp->win_tail, victim);
+        __atomic_sub_fetch(&window_size, victim->size, __ATOMIC_RELAXED);
+        break;
+    case OBJ_MAIN:
+        q_remove(&sp->main_head, &sp->main_tail, victim);
+        __atomic_sub_fetch(&main_size, victim->size, __ATOMIC_RELAXED);
+        break;
+    case OBJ_VICTIM:  // Already off the FIFO, still counted in the main area
+        __atomic_sub_fetch(&main_size, victim->size, __ATOMIC_RELAXED);
+        break;
+    default:  // Candidates are accounted to neither area
+        break;
+    }
+    victim->state = OBJ_GONE;
+    cache_release(victim);
+}
+
+static cache_obj_t *main_victim(shard_t *sp) {
+    /*
+     * Runs the second-chance hand over a shard's main FIFO: referenced
+     * objects get their bit cleared and go to the back. Returns the
+     * first unreferenced object, or NULL if the area is empty. Caller
+     * holds the write lock.
+     */
+    cache_obj_t *obj;
+
+    while ((obj = sp->main_head) != NULL && obj->referenced) {
+        obj->referenced = 0;
+        q_remove(&sp->main_head, &sp->main_tail, obj);
+        q_append(&sp->main_head, &sp->main_tail, obj);
+    }
+    return obj;
+}
+
+static int make_room(size_t size, unsigned long cand_hash) {
+    /*
+     * Evicts main objects until size more bytes fit in the main area.
+     * Shards are visited round-robin and locked one at a time, so callers
+     * never hold two shard locks at once. Victims are chosen before any
+     * is evicted: each is taken off its FIFO but stays indexed. For
+     * TinyLFU candidates, a victim that is at least as popular as the
+     * candidate rejects it, 0 is returned, and every victim chosen for
+     * it goes back to the head of its FIFO. Evicted objects go to the
+     * disk tier, if there is one, after their shard lock is dropped.
+     */
+    unsigned empty = 0;
+    unsigned cand_freq = policy == CACHE_TINYLFU ? sketch_estimate(cand_hash) : 0;
+    cache_obj_t *victims = NULL, *victim, *next;
+    size_t chosen = 0;
+    int ok = 1, evicted;
+
+    if (size > main_budget)
+        return 0;
+    while (__atomic_load_n(&main_size, __ATOMIC_RELAXED) + size > main_budget + chosen &&
+           empty < nshards) {
+        unsigned s = __atomic_fetch_add(&evict_hand, 1, __ATOMIC_RELAXED) & (nshards - 1);
+        shard_t *sp = &shards[s];
+
+        pthread_rwlock_wrlock(&sp->lock);
+        if ((victim = main_victim(sp)) == NULL) {
+            pthread_rwlock_unlock(&sp->lock);
+            empty++;
+            continue;
+        }
+        empty = 0;
+        if (policy == CACHE_TINYLFU && sketch_estimate(victim->hash) >= cand_freq) {
+            pthread_rwlock_unlock(&sp->lock);
+            ok = 0;
+            break;
+        }
+        q_remove(&sp->main_head, &sp->main_tail, victim);
+        victim->state = OBJ_VICTIM;
+        __atomic_add_fetch(&victim->refcnt, 1, __ATOMIC_RELAXED);
+        victim->next_q = victims;
+        victims = victim;
+        chosen += victim->size;
+        pthread_rwlock_unlock(&sp->lock);
+    }
+
+    // Newest first, so victims put back land at the heads in their old order
+    for (victim = victims; victim; victim = next) {
+        shard_t *sp = shard_of(victim->hash);
+
+        next = victim->next_q;
+        evicted = 0;
+        pthread_rwlock_wrlock(&sp->lock);
+        // A newer copy of the key may have unlinked the victim meanwhile
+        if (victim->state == OBJ_VICTIM && ok) {
+            unlink_obj(sp, victim);
+            __atomic_add_fetch(&evictions, 1, __ATOMIC_RELAXED);
+            evicted = 1;
+        } else if (victim->state == OBJ_VICTIM) {
+            victim->state = OBJ_MAIN;
+            q_prepend(&sp->main_head, &sp->main_tail, victim);
+        }
+        pthread_rwlock_unlock(&sp->lock);
+
+        // Objects promoted from disk are still there
+        if (evicted && !victim->from_disk)
+            disk_store(victim);
+        cache_release(victim);
+    }
+    return ok;
+}
+
+static void admit(cache_obj_t *cand) {
+    /* Moves a window candidate into the main area, or drops it */
+    shard_t *sp = shard_of(cand->hash);
+    int ok;
+
+    sketch_flush();  // Count this thread's recent hits before comparing
+    ok = make_room(cand->size, cand->hash);
+
+    pthread_rwlock_wrlock(&sp->lock);
+    // The candidate may have been replaced while no lock was held
+    if (cand->state == OBJ_CANDIDATE) {
+        if (ok) {
+            cand->state = OBJ_MAIN;
+            q_append(&sp->main_head, &sp->main_tail, cand);
+            __atomic_add_fetch(&main_size, cand->size, __ATOMIC_RELAXED);
+        } else {
+            unlink_obj(sp, cand);
+        }
+    }
+    pthread_rwlock_unlock(&sp->lock);
+
+    __atomic_add_fetch(ok ? &admitted : &rejected, 1, __ATOMIC_RELAXED);
+    // Rejected from memory, but the larger disk tier may still see it again
+    if (!ok && !cand->from_disk)
+        disk_store(cand);
+    cache_release(cand);
+}
+
+static cache_obj_t *insert_owned(const char *key, char *data, size_t size, int from_disk,
+                                 time_t born) {
+    /*
+     * Inserts an object whose data buffer the cache takes over, born at
+     * born (0: as its header says), and returns it referenced
+     */
+    cache_obj_t *obj, *cand = NULL, **pp;
+    unsigned long h = hash(key);
+    shard_t *sp = shard_of(h);
+
+    obj = Calloc(1, sizeof(cache_obj_t));
+    obj->key = strdup(key);
+    obj->hash = h;
+    obj->data = data;
+    obj->size = size;
+    obj->refcnt = 2;
+    obj->from_disk = from_disk;
+    obj->born = born;
+    set_freshness(obj, time(NULL));
+
+    // Plain LRU makes room up front and inserts straight into the main area
+    if (policy == CACHE_LRU)
+        make_room(size, h);
+
+    pthread_rwlock_wrlock(&sp->lock);
+
+    // A concurrent miss may already have stored this key; keep the newer copy
+    for (pp = bucket_of(sp, h); *pp; pp = &(*pp)->next) {
+        if ((*pp)->hash == h && !strcmp((*pp)->key, key)) {
+            unlink_obj(sp, *pp);
+            break;
+        }
+    }
+    obj->next = *bucket_of(sp, h);
+    *bucket_of(sp, h) = obj;
+
+    if (policy == CACHE_LRU) {
+        obj->state = OBJ_MAIN;
+        q_append(&sp->main_head, &sp->main_tail, obj);
+        __atomic_add_fetch(&main_size, size, __ATOMIC_RELAXED);
+    } else {
+        obj->state = OBJ_WINDOW;
+        q_append(&sp->win_head, &sp->win_tail, obj);
+
+        // On overflow, this shard's oldest window object competes for the main area
+        if (__atomic_add_fetch(&window_size, size, __ATOMIC_RELAXED) > window_budget) {
+            cand = sp->win_head;
+            q_remove(&sp->win_head, &sp->win_tail, cand);
+            __atomic_sub_fetch(&window_size, cand->size, __ATOMIC_RELAXED);
+            cand->state = OBJ_CANDIDATE;
+            __atomic_add_fetch(&cand->refcnt, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_rwlock_unlock(&sp->lock);
+
+    if (cand)
+        admit(cand);
+    return obj;
+}
+
+void cache_insert(const char *key, const char *data, size_t size) {
+    /* Stores a copy of data under key if it fits the per-object cap */
+    char *copy;
+
+    if (!cache_enabled() || size > max_object)
+        return;
+    copy = Malloc(size);
+    memcpy(copy, data, size);
+    cache_release(insert_owned(key, copy, size, 0, 0));
+}
+
+static long delta_seconds(const char *p, const char *end) {
+    /* Parses a count of seconds, capped at 2^31 - 1; -1 if there is none */
+    long v = 0;
+
+    if (p == end || !isdigit((unsigned char)*p))
+        return -1;
+    for (; p < end && isdigit((unsigned char)*p); p++)
+        if ((v = v * 10 + *p - '0') > 2147483647L)
+            v = 2147483647L;
+    return v;
+}
+
+static void field_value(const char *colon, const char *nl, const char **v, const char **vend) {
+    /* Points [*v, *vend) at a field's value without the surrounding whitespace */
+    for (*v = colon + 1; *v < nl && (**v == ' ' || **v == '\t'); (*v)++)
+        ;
+    for (*vend = nl; *vend > *v && ((*vend)[-1] == '\r' || (*vend)[-1] == ' ' ||
+                                   (*vend)[-1] == '\t'); (*vend)--)
+        ;
+}
+
+static void parse_cache_control(const char *p, const char *end, cache_control_t *cc) {
+    /* Picks the directives this cache acts on out of a Cache-Control value */
+    const char *t;
+    size_t n;
+    long v;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        for (t = p; p < end && *p != ',' && *p != '=' && *p != ' ' && *p != '\t'; p++)
+            ;
+        n = p - t;
+        v = -1;
+        if (p < end && *p == '=') {
+            if (++p < end && *p == '"')
+                p++;
+            v = delta_seconds(p, end);
+        }
+        // Skip the rest, quoted strings included: private="a, b" is one directive
+        for (; p < end && *p != ','; p++)
+            if (*p == '"')
+                while (++p < end && *p != '"')
+                    ;
+#define CC_IS(lit) (n == sizeof(lit) - 1 && !strncasecmp(t, lit, n))
+        if (CC_IS("max-age"))
+            cc->max_age = v;
+        else if (CC_IS("s-maxage"))
+            cc->s_maxage = v;
+        else if (CC_IS("stale-while-revalidate"))
+            cc->swr = v;
+        else if (CC_IS("stale-if-error"))
+            cc->sie = v;
+        else if (CC_IS("no-store") || CC_IS("private"))
+            cc->no_store = 1;   // A shared cache must not keep private responses
+        else if (CC_IS("no-cache"))
+            cc->no_cache = 1;
+        else if (CC_IS("must-revalidate") || CC_IS("proxy-revalidate"))
+            cc->must_revalidate = 1;
+#undef CC_IS
+    }
+}
+
+static void set_freshness(cache_obj_t *obj, time_t now) {
+    /*
+     * Works out an object's lifetime and stale windows from its stored
+     * header, and its birth time unless that is already known (objects
+     * from the disk tier keep the one stored with them). The birth time
+     * backs off from now by the response's age when it arrived: Age, or
+     * how far Date lies in the past if that is more.
+     */
+    const char *p = obj->data, *end = p + obj->size, *nl, *colon, *v, *vend;
+    cache_control_t cc = { -1, -1, -1, -1, 0, 0, 0 };
+    time_t date = -1, expires = -1, modified = -1;
+    long age = 0, lifetime;
+    int has_expires = 0;
+
+    p = (nl = memchr(p, '\n', end - p)) != NULL ? nl + 1 : end;
+    for (; (nl = memchr(p, '\n', end - p)) != NULL && nl > p + 1; p = nl + 1) {
+        if ((colon = memchr(p, ':', nl - p)) == NULL)
+            continue;
+        field_value(colon, nl, &v, &vend);
+        switch (http_field_id(p, colon - p)) {
+        case HDR_CACHE_CONTROL:
+            parse_cache_control(v, vend, &cc);
+            break;
+        case HDR_DATE:
+            date = http_parse_date(v, vend - v);
+            break;
+        case HDR_EXPIRES:
+            // An invalid date, "0" say, means already expired
+            has_expires = 1;
+            expires = http_parse_date(v, vend - v);
+            break;
+        case HDR_LAST_MODIFIED:
+            modified = http_parse_date(v, vend - v);
+            break;
+        case HDR_AGE:
+            if ((age = delta_seconds(v, vend)) < 0)
+                age = 0;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (date < 0)
+        date = now;
+    if (obj->born == 0)
+        obj->born = now - (now - date > age ? now - date : age);
+
+    if (cc.s_maxage >= 0)
+        lifetime = cc.s_maxage;
+    else if (cc.max_age >= 0)
+        lifetime = cc.max_age;
+    else if (has_expires)
+        lifetime = expires > date ? expires - date : 0;
+    else if (modified >= 0)
+        lifetime = modified < date ? (date - modified) / 10 : 0;
+    else
+        lifetime = CACHE_DEFAULT_TTL;
+    if (cc.s_maxage < 0 && cc.max_age < 0 && !has_expires && lifetime > CACHE_HEURISTIC_MAX)
+        lifetime = CACHE_HEURISTIC_MAX;
+    obj->ttl = cc.no_cache ? 0 : lifetime > 2147483647L ? 2147483647 : (int)lifetime;
+    obj->must_revalidate = cc.no_cache || cc.must_revalidate ||
+                           cc.s_maxage >= 0;  // s-maxage implies proxy-revalidate
+    obj->swr = cc.swr > 0 ? (int)cc.swr : 0;
+    obj->sie = cc.sie > 0 ? (int)cc.sie : 0;
+}
+
+long cache_age(const cache_obj_t *obj) {
+    /* Seconds since the end server generated the response */
+    time_t now = time(NULL);
+
+    return now > obj->born ? now - obj->born : 0;
+}
+
+cache_freshness_t cache_freshness(const cache_obj_t *obj) {
+    /* Tells whether obj may be served as it is, and whether it needs refreshing */
+    long age = cache_age(obj);
+
+    if (age < obj->ttl)
+        return CACHE_FRESH;
+    if (!obj->must_revalidate && age < (long)obj->ttl + obj->swr)
+        return CACHE_STALE_REFRESH;
+    return CACHE_STALE;
+}
+
+int cache_stale_if_error(const cache_obj_t *obj) {
+    /* Returns 1 if a stale obj may stand in for an end server that failed */
+    return !obj->must_revalidate && cache_age(obj) < (long)obj->ttl + obj->sie;
+}
+
+static int has_field(const char *hdr, size_t len, const char *name, size_t nlen) {
+    /* Returns 1 if the header block hdr[0..len) has a field called name */
+    const char *p = hdr, *end = hdr + len, *nl, *colon;
+
+    for (; p < end; p = nl + 1) {
+        if ((nl = memchr(p, '\n', end - p)) == NULL)
+            nl = end;
+        if ((colon = memchr(p, ':', nl - p)) != NULL && (size_t)(colon - p) == nlen &&
+            !strncasecmp(p, name, nlen))
+            return 1;
+    }
+    return 0;
+}
+
+cache_obj_t *cache_refresh(cache_obj_t *stale, const char *hdr, size_t len) {
+    /*
+     * Applies a 304 Not Modified to a stale object: hdr[0..len) is the
+     * 304's status line and fields. Its fields replace the stored ones of
+     * the same name, except Content-Length, which is about the 304; the
+     * stored status line and body stay. The result replaces the stale
+     * object in the cache and is returned referenced (unindexed if it no
+     * longer fits).
+     */
+    const char *p = stale->data, *end = p + stale->size, *nl, *colon, *q, *hend = hdr + len;
+    char *buf, *w;
+    cache_obj_t *obj;
+
+    if ((nl = memchr(p, '\n', end - p)) == NULL) {
+        cache_retain(stale);
+        return stale;
+    }
+    w = buf = Malloc(stale->size + len);
+    memcpy(w, p, nl + 1 - p);
+    w += nl + 1 - p;
+
+    // Stored fields the 304 does not replace, then the 304's own
+    for (p = nl + 1; (nl = memchr(p, '\n', end - p)) != NULL && nl > p + 1; p = nl + 1) {
+        if ((colon = memchr(p, ':', nl - p)) != NULL && has_field(hdr, len, p, colon - p))
+            continue;
+        memcpy(w, p, nl + 1 - p);
+        w += nl + 1 - p;
+    }
+    q = (nl = memchr(hdr, '\n', len)) != NULL ? nl + 1 : hend;
+    for (; q < hend && (nl = memchr(q, '\n', hend - q)) != NULL; q = nl + 1) {
+        if ((colon = memchr(q, ':', nl - q)) == NULL ||
+            http_field_id(q, colon - q) == HDR_CONTENT_LENGTH)
+            continue;
+        memcpy(w, q, nl + 1 - q);
+        w += nl + 1 - q;
+    }
+
+    // The empty line and the body
+    memcpy(w, p, end - p);
+    w += end - p;
+
+    if (cache_enabled() && (size_t)(w - buf) <= max_object)
+        return insert_owned(stale->key, Realloc(buf, w - buf), w - buf, 0, 0);
+    obj = Calloc(1, sizeof(cache_obj_t));
+    obj->key = strdup(stale->key);
+    obj->hash = stale->hash;
+    obj->data = buf;
+    obj->size = w - buf;
+    obj->refcnt = 1;
+    obj->state = OBJ_GONE;
+    set_freshness(obj, time(NULL));
+    return obj;
+}
+
+void cache_fill_init(cache_fill_t *fill) {
+    /* Starts collecting a response; nothing is buffered when caching is off */
+    fill->buf = NULL;
+    fill->len = 0;
+    fill->ok = cache_enabled();
+    fill->flight = NULL;
+    fill->stale = NULL;
+}
+
+void cache_fill_append(cache_fill_t *fill, const char *data, size_t n) {
+    /* Adds relayed bytes, giving up once the response cannot be cached */
+    if (fill->flight)
+        flight_append(fill->flight, data, n);
+    if (!fill->ok)
+        return;
+
+    // Only successful responses are worth keeping
+    if (fill->len == 0 &&
+        (n < 12 || strncmp(data, "HTTP/1.", 7) || strncmp(data + 8, " 200", 4))) {
+        fill->ok = 0;
+        return;
+    }
+    if (fill->len + n > max_object) {
+        cache_fill_abort(fill);
+        return;
+    }
+    if (fill->buf == NULL)
+        fill->buf = Malloc(max_object);
+    memcpy(fill->buf + fill->len, data, n);
+    fill->len += n;
+}
+
+void cache_fill_expect(cache_fill_t *fill, size_t n) {
+    /* Gives up early when n more bytes are announced that will not fit */
+    if (fill->ok && fill->len + n > max_object)
+        cache_fill_abort(fill);
+}
+
+static int response_storable(const char *p, size_t len) {
+    /* Returns 0 if a header field of the response forbids caching it */
+    const char *end = p + len, *nl, *colon, *v, *vend;
+    cache_control_t cc = { -1, -1, -1, -1, 0, 0, 0 };
+    http_field_id_t id;
+
+    // Skip the status line, then classify each field up to the blank line
+    if ((nl = memchr(p, '\n', len)) == NULL)
+        return 0;
+    for (p = nl + 1; (nl = memchr(p, '\n', end - p)) != NULL && nl > p + 1; p = nl + 1) {
+        if ((colon = memchr(p, ':', nl - p)) == NULL)
+            continue;
+        id = http_field_id(p, colon - p);
+        if (http_field_flags[id] & HF_NOSTORE)
+            return 0;
+        if (id == HDR_CACHE_CONTROL) {
+            field_value(colon, nl, &v, &vend);
+            parse_cache_control(v, vend, &cc);
+        }
+    }
+    return !cc.no_store;
+}
+
+static int chunks_complete(const char *p, const char *end) {
+    /* Returns 1 if the chunked body at p ends, before end, with its last chunk and trailer */
+    const char *nl;
+    size_t size;
+    int digits;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        // Chunk size in hex, possibly followed by ";extensions"
+        for (size = 0, digits = 0; p < nl && isxdigit((unsigned char)*p); p++, digits++) {
+            if (size > (size_t)(end - nl))
+                return 0;  // Larger than what arrived
+            size = size * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+        }
+        if (digits == 0)
+            return 0;
+        p = nl + 1;
+        if (size == 0) {
+            // Trailer fields up to the empty line
+            for (; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+                if (nl == p || (nl == p + 1 && *p == '\r'))
+                    return 1;
+            return 0;
+        }
+        if (size > (size_t)(end - p))
+            return 0;
+        p += size;
+        if (p < end && *p == '\r')
+            p++;
+        if (p >= end || *p++ != '\n')
+            return 0;
+    }
+    return 0;
+}
+
+int cache_fill_complete(const cache_fill_t *fill) {
+    /*
+     * Returns 1 if the response collected so far is whole by its own
+     * framing: as long as its Content-Length, or ending with the last
+     * chunk. Without either, the body ends at EOF and is taken as whole.
+     */
+    const char *p = fill->buf, *end = fill->buf + fill->len, *nl, *colon, *v, *vend;
+    long length = -1;
+    int chunked = 0;
+    http_field_id_t id;
+
+    if (!fill->ok || fill->len == 0 || (nl = memchr(p, '\n', fill->len)) == NULL)
+        return 0;
+    for (p = nl + 1; (nl = memchr(p, '\n', end - p)) != NULL && nl > p + 1; p = nl + 1) {
+        if ((colon = memchr(p, ':', nl - p)) == NULL)
+            continue;
+        id = http_field_id(p, colon - p);
+        field_value(colon, nl, &v, &vend);
+        if (id == HDR_CONTENT_LENGTH)
+            length = atol(v);
+        else if (id == HDR_TRANSFER_ENCODING)
+            chunked = vend - v >= 7 && !strncasecmp(vend - 7, "chunked", 7);
+    }
+    if (nl == NULL)
+        return 0;  // The header itself was cut short
+    p = nl + 1;
+    if (chunked)
+        return chunks_complete(p, end);
+    return length < 0 || end - p == length;
+}
+
+void cache_fill_commit(cache_fill_t *fill, const char *key) {
+    /* Inserts the collected response if it is complete and cacheable */
+    if (fill->ok && fill->len > 0 && response_storable(fill->buf, fill->len)) {
+        cache_release(insert_owned(key, Realloc(fill->buf, fill->len), fill->len, 0, 0));
+        fill->buf = NULL;
+    }
+    cache_fill_abort(fill);
+}
+
+void cache_fill_abort(cache_fill_t *fill) {
+    /* Discards a partially collected response */
+    free(fill->buf);
+    fill->buf = NULL;
+    fill->ok = 0;
+}
+
+void cache_get_stats(cache_stats_t *st) {
+    /* Sums the per-shard counters into *st */
+    unsigned i;
+
+    memset(st, 0, sizeof(*st));
+    for (i = 0; i < nshards; i++) {
+        st->hits += __atomic_load_n(&shards[i].hits, __ATOMIC_RELAXED);
+        st->misses += __atomic_load_n(&shards[i].misses, __ATOMIC_RELAXED);
+    }
+    st->admitted = __atomic_load_n(&admitted, __ATOMIC_RELAXED);
+    st->rejected = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+    st->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+    st->window_bytes = __atomic_load_n(&window_size, __ATOMIC_RELAXED);
+    st->main_bytes = __atomic_load_n(&main_size, __ATOMIC_RELAXED);
+    st->disk_hits = __atomic_load_n(&disk_hits, __ATOMIC_RELAXED);
+    if (disk_enabled())
+        disk_get_stats(&st->disk_bytes, &st->disk_live, &st->disk_segments);
+}
+
+void cache_print_stats(FILE *fp) {
+    /* Writes a one-line summary of the cache counters to fp */
+    cache_stats_t st;
+    unsigned long lookups;
+
+    cache_get_stats(&st);
+    lookups = st.hits + st.misses;
+    fprintf(fp, "cache[%s]: hits %lu misses %lu hit-ratio %.4f admitted %lu rejected %lu "
+            "evictions %lu window %zu main %zu bytes\n",
+            policy == CACHE_TINYLFU ? "tinylfu" : "lru", st.hits, st.misses,
+            lookups ? (double)st.hits / lookups : 0.0, st.admitted, st.rejected,
+            st.evictions, st.window_bytes, st.main_bytes);
+    if (disk_enabled())
+        fprintf(fp, "disk: hits %lu segments %d bytes %zu live %zu\n",
+                st.disk_hits, st.disk_segments, st.disk_bytes, st.disk_live);
+}
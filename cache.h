@@ -0,0 +1,96 @@
+/*
+ * cache.h - Thread-safe in-memory cache of proxied GET responses
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+
+/* Classic proxy lab limits; override with -C and -O */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Freshness of responses that do not state one (seconds) */
+#define CACHE_DEFAULT_TTL 300       /* Neither an expiry nor Last-Modified */
+#define CACHE_HEURISTIC_MAX 86400   /* Cap on a tenth of the Last-Modified age */
+
+/* Replacement policies selectable with -P */
+typedef enum { CACHE_LRU, CACHE_TINYLFU } cache_policy_t;
+
+/* Where an indexed object currently lives */
+typedef enum {
+    OBJ_WINDOW,
+    OBJ_MAIN,
+    OBJ_CANDIDATE,              /* Out of the window, waiting for admission */
+    OBJ_VICTIM,                 /* Out of the main FIFO, chosen for eviction */
+    OBJ_GONE
+} obj_state_t;
+
+/* Whether a cached response may be used as it is */
+typedef enum {
+    CACHE_FRESH,                /* Within its freshness lifetime */
+    CACHE_STALE_REFRESH,        /* Stale, but may be served while it is refreshed */
+    CACHE_STALE                 /* Must be revalidated first */
+} cache_freshness_t;
+
+/* A cached response: status line, headers and body exactly as relayed */
+typedef struct cache_obj {
+    char *key;
+    unsigned long hash;
+    char *data;
+    size_t size;
+    int refcnt;                 /* Readers plus one for the index */
+    char referenced;            /* Hit since the eviction hand last passed */
+    char must_revalidate;       /* Never served stale (no-cache, must-revalidate) */
+    char refreshing;            /* A background refresh is under way */
+    time_t born;                /* When the end server generated it, by our clock */
+    int ttl;                    /* Freshness lifetime in seconds */
+    int swr, sie;               /* stale-while-revalidate, stale-if-error windows */
+    obj_state_t state;
+    char from_disk;             /* Promoted from the disk tier, already stored there */
+    void *seg;                  /* Disk segment that data points into, or NULL */
+    struct cache_obj *next;     /* Hash chain */
+    struct cache_obj *prev_q, *next_q;  /* Shard's window or main FIFO; victims */
+} cache_obj_t;
+
+/* Counters for comparing policies; summed over shards when read */
+typedef struct {
+    unsigned long hits, misses, disk_hits;
+    unsigned long admitted, rejected, evictions;
+    size_t window_bytes, main_bytes;
+    size_t disk_bytes, disk_live;
+    int disk_segments;
+} cache_stats_t;
+
+/* Accumulates a response while it is relayed, for insertion at the end */
+typedef struct {
+    char *buf;
+    size_t len;
+    int ok;                     /* Still cacheable: 200 and within the cap */
+    struct flight *flight;      /* Shares the bytes with concurrent misses, or NULL */
+    struct cache_obj *stale;    /* Copy being revalidated, or NULL */
+} cache_fill_t;
+
+void cache_init(size_t max_cache_size, size_t max_object_size, cache_policy_t policy);
+int cache_enabled(void);
+void cache_key(char *key, const char *hostname, int port, const char *path);
+
+cache_obj_t *cache_lookup(const char *key);
+void cache_retain(cache_obj_t *obj);
+void cache_release(cache_obj_t *obj);
+void cache_insert(const char *key, const char *data, size_t size);
+cache_obj_t *cache_refresh(cache_obj_t *stale, const char *hdr, size_t len);
+long cache_age(const cache_obj_t *obj);
+cache_freshness_t cache_freshness(const cache_obj_t *obj);
+int cache_stale_if_error(const cache_obj_t *obj);
+void cache_get_stats(cache_stats_t *st);
+void cache_print_stats(FILE *fp);
+
+void cache_fill_init(cache_fill_t *fill);
+void cache_fill_append(cache_fill_t *fill, const char *data, size_t n);
+void cache_fill_expect(cache_fill_t *fill, size_t n);
+int cache_fill_complete(const cache_fill_t *fill);
+void cache_fill_commit(cache_fill_t *fill, const char *key);
+void cache_fill_abort(cache_fill_t *fill);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,114 @@
+/*
+ * connect.c - Connecting to end servers with deadlines and Happy Eyeballs
+ *
+ * A blocking connect() to an address that silently drops SYNs waits out
+ * the kernel's SYN retries, over two minutes, before the next address
+ * is even tried; one blackholed IPv6 address is enough to stall every
+ * request to a dual-stack server. connect_addrs() races the candidates
+ * instead, as RFC 8305 describes: non-blocking attempts start
+ * CONNECT_STAGGER_MS apart in list order (dns.c interleaves the list
+ * by family, the family that last worked for the host first), a failed
+ * attempt lets the next one start at once, and the first socket to
+ * connect wins while the others are closed.
+ *
+ * No attempt is waited on for longer than attempt_ms, and the whole
+ * race is abandoned after total_ms.
+ */
+#include "csapp.h"
+#include <poll.h>
+#include "connect.h"
+
+#define CONNECT_MAX_RACE 16         /* Attempts in flight at once */
+
+static int attempt_ms = CONNECT_ATTEMPT_MS, total_ms = CONNECT_TOTAL_MS;
+
+static long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void connect_init(int attempt, int total) {
+    /* Sets the per-attempt and overall deadlines, in milliseconds */
+    attempt_ms = attempt;
+    total_ms = total;
+}
+
+int connect_addrs(const struct addrinfo *addrs, int *family) {
+    /*
+     * Connects to the first address in addrs that answers. Returns a
+     * blocking socket and sets *family to its address family, or returns
+     * -1 when every attempt failed or the deadline passed.
+     */
+    struct pollfd pfd[CONNECT_MAX_RACE];
+    int afam[CONNECT_MAX_RACE];
+    long until[CONNECT_MAX_RACE];
+    const struct addrinfo *next = addrs;
+    long t = now_ms(), start = t, give_up = t + total_ms, wait;
+    int i, s, n = 0, fd = -1, err, failed;
+    socklen_t len;
+
+    while (fd < 0 && (t = now_ms()) < give_up) {
+        // The next attempt starts on its turn, or right away when none is in flight
+        if (next != NULL && n < CONNECT_MAX_RACE && (t >= start || n == 0)) {
+            s = socket(next->ai_family, next->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       next->ai_protocol);
+            if (s >= 0 && (connect(s, next->ai_addr, next->ai_addrlen) == 0 ||
+                           errno == EINPROGRESS)) {
+                pfd[n].fd = s;
+                pfd[n].events = POLLOUT;
+                afam[n] = next->ai_family;
+                until[n] = t + attempt_ms;
+                n++;
+                start = t + CONNECT_STAGGER_MS;
+            } else if (s >= 0) {
+                close(s);
+            }
+            next = next->ai_next;
+            continue;
+        }
+        if (n == 0)
+            break;
+
+        wait = give_up;
+        if (next != NULL && start < wait)
+            wait = start;
+        for (i = 0; i < n; i++)
+            if (until[i] < wait)
+                wait = until[i];
+        if (poll(pfd, n, wait > t ? wait - t : 0) < 0 && errno != EINTR)
+            break;
+
+        t = now_ms();
+        for (i = 0; i < n; ) {
+            failed = t >= until[i];
+            if (pfd[i].revents) {
+                len = sizeof(err);
+                if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                    fd = pfd[i].fd;
+                    *family = afam[i];
+                    pfd[i] = pfd[--n];
+                    break;
+                }
+                failed = 1;
+            }
+            if (!failed) {
+                i++;
+                continue;
+            }
+            // Given up: the next candidate need not wait for its turn
+            close(pfd[i].fd);
+            pfd[i] = pfd[--n];
+            afam[i] = afam[n];
+            until[i] = until[n];
+            start = t;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        close(pfd[i].fd);
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    return fd;
+}
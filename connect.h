@@ -0,0 +1,16 @@
+/*
+ * connect.h - Connecting to end servers with deadlines and Happy Eyeballs
+ */
+#ifndef __CONNECT_H__
+#define __CONNECT_H__
+
+#include <netdb.h>
+
+#define CONNECT_ATTEMPT_MS 3000     /* Default -w: longest wait for one address */
+#define CONNECT_TOTAL_MS 10000      /* Default -W: longest wait for a connection */
+#define CONNECT_STAGGER_MS 250      /* Head start of each attempt over the next (RFC 8305) */
+
+void connect_init(int attempt_ms, int total_ms);
+int connect_addrs(const struct addrinfo *addrs, int *family);
+
+#endif /* __CONNECT_H__ */
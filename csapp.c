@@ -802,10 +802,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    read() if the internal buffer is empty.
  */
 /* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+static ssize_t rio_refill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -818,6 +816,15 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    if ((cnt = rio_refill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -866,30 +873,43 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
+ *    Instead of going through rio_read() a byte at a time, it finds the
+ *    newline in the buffered bytes with memchr() (which the C library
+ *    vectorizes) and copies each run of the line with one memcpy().
+ *    Like before, at most maxlen-1 bytes are stored, the rest of a long
+ *    line stays buffered for the next call, and the result is always
+ *    NUL-terminated.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (!nl && n + 1 < maxlen) {
+	if (rp->rio_cnt <= 0 && (rc = rio_refill(rp)) <= 0) {
+	    if (rc < 0)
+		return -1;	  /* Error */
+	    if (n == 0)
 		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+	    break;    /* EOF, some data was read */
+	}
+
+	/* Take buffered bytes up to the newline, as far as they fit */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	bufp += cnt;
+	n += cnt;
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
@@ -994,7 +1014,24 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
+static int open_listenfd_opt(char *port, int reuseport);
+
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but sets SO_REUSEPORT so
+ *     that several sockets can listen on the same port and the kernel
+ *     spreads incoming connections across them.
+ */
+int open_reuseport_listenfd(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1019,6 +1056,13 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Share the port with the other reuseport listeners */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -1064,6 +1108,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port) 
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+	unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,439 @@
+/*
+ * disk.c - Log-structured second-tier cache on local disk
+ *
+ * Objects evicted from the memory cache are appended to fixed-size
+ * segment files in the -D directory. Each segment is mapped read-only
+ * as soon as it is created, so a disk hit is a pointer into the
+ * mapping: the response is written to the client straight from the
+ * page cache, without a read() into a user buffer and without going
+ * back to the end server.
+ *
+ * The in-memory index only keeps, per key hash, the segment number,
+ * offset and length of the newest record. The full key is stored in
+ * the record header on disk and checked on lookup, so a hash collision
+ * is just a miss.
+ *
+ * Segments are written once, front to back. When the budget is used
+ * up, the oldest segment is dropped with everything in it. A background
+ * thread compacts sealed segments whose live data has fallen below
+ * half: still-indexed records are copied to the active segment and the
+ * old file is deleted. Mappings are reference counted, so a segment
+ * that is dropped or compacted stays mapped until the last client
+ * reading from it is done.
+ *
+ * The tier starts empty: segment files left over from an earlier run
+ * are deleted at startup.
+ */
+#include "disk.h"
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define REC_MAGIC 0x50584332u          /* "PXC2" */
+#define MAX_SEGMENTS 4096
+#define COMPACT_INTERVAL 1              /* Seconds between compaction scans */
+#define COMPACT_LIVE_PERCENT 50
+
+/* On-disk record header, followed by the key and the response bytes */
+typedef struct {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t data_len;
+    uint64_t hash;
+    int64_t born;                       /* cache_obj_t.born, so age survives eviction */
+} rec_hdr_t;
+
+/* One index entry: 24 bytes per cached object */
+typedef struct {
+    uint64_t hash;                      /* 0 = empty */
+    uint32_t seg;                       /* Segment id; TOMBSTONE if deleted */
+    uint32_t off;
+    uint64_t len;                       /* Whole record, header included */
+} dentry_t;
+
+#define TOMBSTONE UINT32_MAX
+
+typedef struct segment {
+    uint32_t id;
+    int fd;
+    char *map;
+    size_t used;                        /* Bytes appended so far */
+    size_t live;                        /* Bytes of records still indexed */
+    int refcnt;                         /* Readers plus one while in the table */
+    char path[MAXLINE + 32];
+} segment_t;
+
+static char disk_dir[MAXLINE];
+static size_t max_segments;
+static pthread_rwlock_t disk_lock = PTHREAD_RWLOCK_INITIALIZER;
+static segment_t *segs[MAX_SEGMENTS];   /* By id % MAX_SEGMENTS */
+static uint32_t first_seg, next_seg;    /* Live ids are [first_seg, next_seg) */
+static segment_t *active;
+static dentry_t *index_tab;
+static size_t index_cap, index_used;    /* index_used counts tombstones too */
+static size_t index_live;               /* Entries that are not tombstones */
+static size_t total_bytes, live_bytes;
+
+static void *compact_thread(void *vargp);
+static int roll_segment(void);
+static void retire_segment(segment_t *sp);
+
+static inline size_t rec_align(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static inline uint64_t nz(unsigned long h) {
+    /* Index hashes are never 0, which marks empty entries */
+    return h ? h : 1;
+}
+
+int disk_init(const char *dir, size_t max_disk_size) {
+    /* Prepares dir for segment files and starts the compactor */
+    DIR *dp;
+    struct dirent *de;
+    char path[MAXLINE];
+    pthread_t tid;
+
+    if (strlen(dir) >= MAXLINE - 32)
+        return -1;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "disk cache: cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    strcpy(disk_dir, dir);
+
+    // Start from an empty tier
+    if ((dp = opendir(dir)) != NULL) {
+        while ((de = readdir(dp)) != NULL) {
+            if (!strncmp(de->d_name, "seg-", 4)) {
+                snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+                unlink(path);
+            }
+        }
+        closedir(dp);
+    }
+
+    max_segments = max_disk_size / SEGMENT_SIZE;
+    if (max_segments < 2)
+        max_segments = 2;
+    if (max_segments > MAX_SEGMENTS / 2)
+        max_segments = MAX_SEGMENTS / 2;
+
+    index_cap = 1024;
+    index_tab = Calloc(index_cap, sizeof(dentry_t));
+
+    pthread_rwlock_wrlock(&disk_lock);
+    if (roll_segment() < 0) {
+        pthread_rwlock_unlock(&disk_lock);
+        return -1;
+    }
+    pthread_rwlock_unlock(&disk_lock);
+
+    Pthread_create(&tid, NULL, compact_thread, NULL);
+    return 0;
+}
+
+int disk_enabled(void) {
+    return active != NULL;
+}
+
+/*********************
+ * Index (open hashing)
+ *********************/
+
+static dentry_t *index_find(uint64_t h) {
+    /* Returns the live entry for h, or NULL; caller holds disk_lock */
+    size_t i;
+
+    for (i = h & (index_cap - 1); index_tab[i].hash; i = (i + 1) & (index_cap - 1))
+        if (index_tab[i].hash == h && index_tab[i].seg != TOMBSTONE)
+            return &index_tab[i];
+    return NULL;
+}
+
+static void index_drop(dentry_t *e) {
+    /* Deletes an entry and its bytes from its segment's live count */
+    segment_t *sp = segs[e->seg % MAX_SEGMENTS];
+
+    if (sp && sp->id == e->seg)
+        sp->live -= e->len;
+    live_bytes -= e->len;
+    e->seg = TOMBSTONE;
+    index_live--;
+}
+
+static void index_rehash(size_t cap) {
+    /* Rebuilds the table with cap slots, dropping tombstones; caller holds the write lock */
+    dentry_t *old = index_tab;
+    size_t i, j, old_cap = index_cap;
+
+    index_cap = cap;
+    index_tab = Calloc(index_cap, sizeof(dentry_t));
+    index_used = 0;
+    for (i = 0; i < old_cap; i++) {
+        if (!old[i].hash || old[i].seg == TOMBSTONE)
+            continue;
+        for (j = old[i].hash & (index_cap - 1); index_tab[j].hash; j = (j + 1) & (index_cap - 1))
+            ;
+        index_tab[j] = old[i];
+        index_used++;
+    }
+    free(old);
+}
+
+static void index_put(uint64_t h, uint32_t seg, uint32_t off, uint64_t len) {
+    /* Points h at a new record, replacing any older one */
+    dentry_t *e;
+    size_t i;
+
+    if ((e = index_find(h)) != NULL)
+        index_drop(e);
+    // Clearing tombstones makes room; the table only doubles for live entries
+    if ((index_used + 1) * 10 > index_cap * 7)
+        index_rehash((index_live + 1) * 2 <= index_cap ? index_cap : index_cap * 2);
+    for (i = h & (index_cap - 1); index_tab[i].hash && index_tab[i].seg != TOMBSTONE;
+         i = (i + 1) & (index_cap - 1))
+        ;
+    if (!index_tab[i].hash)
+        index_used++;
+    index_tab[i].hash = h;
+    index_tab[i].seg = seg;
+    index_tab[i].off = off;
+    index_tab[i].len = len;
+    index_live++;
+    segs[seg % MAX_SEGMENTS]->live += len;
+    live_bytes += len;
+}
+
+/*******************
+ * Segment handling
+ *******************/
+
+static int roll_segment(void) {
+    /*
+     * Seals the active segment and opens a fresh one, dropping the oldest
+     * when the budget is exhausted. Caller holds the write lock.
+     */
+    segment_t *sp = Calloc(1, sizeof(segment_t));
+
+    while (next_seg - first_seg >= max_segments)
+        retire_segment(segs[first_seg % MAX_SEGMENTS]);
+
+    sp->id = next_seg;
+    sp->refcnt = 1;
+    snprintf(sp->path, sizeof(sp->path), "%s/seg-%08x.dat", disk_dir, sp->id);
+    if ((sp->fd = open(sp->path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        ftruncate(sp->fd, SEGMENT_SIZE) < 0 ||
+        (sp->map = mmap(NULL, SEGMENT_SIZE, PROT_READ, MAP_SHARED, sp->fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "disk cache: cannot create %s: %s\n", sp->path, strerror(errno));
+        if (sp->fd >= 0) {
+            close(sp->fd);
+            unlink(sp->path);
+        }
+        free(sp);
+        return -1;
+    }
+    segs[sp->id % MAX_SEGMENTS] = sp;
+    next_seg++;
+    active = sp;
+    return 0;
+}
+
+static void segment_unref(segment_t *sp) {
+    /* Drops a reference; the last one unmaps and deletes the file */
+    if (__atomic_sub_fetch(&sp->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(sp->map, SEGMENT_SIZE);
+        close(sp->fd);
+        unlink(sp->path);
+        free(sp);
+    }
+}
+
+static void retire_segment(segment_t *sp) {
+    /* Removes a segment and every index entry in it; caller holds the write lock */
+    const rec_hdr_t *hdr;
+    dentry_t *e;
+    size_t off;
+
+    // The segment's own records lead to its entries without a scan of the whole index
+    for (off = 0; off < sp->used; off += rec_align(sizeof(*hdr) + hdr->key_len + hdr->data_len)) {
+        hdr = (const rec_hdr_t *)(sp->map + off);
+        if ((e = index_find(hdr->hash)) != NULL && e->seg == sp->id && e->off == off)
+            index_drop(e);
+    }
+    total_bytes -= sp->used;
+    segs[sp->id % MAX_SEGMENTS] = NULL;
+    while (first_seg != next_seg && segs[first_seg % MAX_SEGMENTS] == NULL)
+        first_seg++;
+    segment_unref(sp);
+}
+
+static int append_record(uint64_t h, const char *key, size_t key_len,
+                         const char *data, size_t data_len, int64_t born) {
+    /* Appends one record to the active segment and indexes it; caller holds the write lock */
+    rec_hdr_t hdr;
+    size_t len = rec_align(sizeof(hdr) + key_len + data_len);
+    off_t off;
+    struct iovec iov[3];
+
+    if (len > SEGMENT_SIZE)
+        return -1;
+    if (active->used + len > SEGMENT_SIZE && roll_segment() < 0)
+        return -1;
+
+    hdr.magic = REC_MAGIC;
+    hdr.key_len = key_len;
+    hdr.data_len = data_len;
+    hdr.hash = h;
+    hdr.born = born;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)key;
+    iov[1].iov_len = key_len;
+    iov[2].iov_base = (void *)data;
+    iov[2].iov_len = data_len;
+    off = active->used;
+    if (pwritev(active->fd, iov, 3, off) != sizeof(hdr) + key_len + data_len) {
+        fprintf(stderr, "disk cache: write to %s failed: %s\n", active->path, strerror(errno));
+        return -1;
+    }
+    active->used += len;
+    total_bytes += len;
+    index_put(h, active->id, off, len);
+    return 0;
+}
+
+/*******************
+ * Public interface
+ *******************/
+
+void disk_store(cache_obj_t *obj) {
+    /* Writes an object evicted from memory to the active segment */
+    if (!disk_enabled())
+        return;
+    pthread_rwlock_wrlock(&disk_lock);
+    append_record(nz(obj->hash), obj->key, strlen(obj->key), obj->data, obj->size, obj->born);
+    pthread_rwlock_unlock(&disk_lock);
+}
+
+cache_obj_t *disk_lookup(const char *key, unsigned long hash) {
+    /*
+     * Returns an unindexed object whose data points into the segment
+     * mapping, or NULL on a miss. The object holds a reference on the
+     * segment until cache_release().
+     */
+    dentry_t *e;
+    segment_t *sp = NULL;
+    const rec_hdr_t *hdr = NULL;
+    size_t key_len = strlen(key);
+    cache_obj_t *obj;
+
+    if (!disk_enabled())
+        return NULL;
+
+    pthread_rwlock_rdlock(&disk_lock);
+    if ((e = index_find(nz(hash))) != NULL) {
+        sp = segs[e->seg % MAX_SEGMENTS];
+        hdr = (const rec_hdr_t *)(sp->map + e->off);
+        if (hdr->magic == REC_MAGIC && hdr->key_len == key_len &&
+            !memcmp((const char *)(hdr + 1), key, key_len))
+            __atomic_add_fetch(&sp->refcnt, 1, __ATOMIC_RELAXED);
+        else
+            sp = NULL;
+    }
+    pthread_rwlock_unlock(&disk_lock);
+    if (sp == NULL)
+        return NULL;
+
+    obj = Calloc(1, sizeof(cache_obj_t));
+    obj->key = strdup(key);
+    obj->hash = hash;
+    obj->data = (char *)(hdr + 1) + key_len;
+    obj->size = hdr->data_len;
+    obj->refcnt = 1;
+    obj->state = OBJ_GONE;
+    obj->seg = sp;
+    obj->born = hdr->born;
+    return obj;
+}
+
+void disk_segment_release(void *seg) {
+    /* Called by cache_release() for objects that point into a segment */
+    segment_unref(seg);
+}
+
+void disk_get_stats(size_t *bytes, size_t *live, int *segments) {
+    pthread_rwlock_rdlock(&disk_lock);
+    *bytes = total_bytes;
+    *live = live_bytes;
+    *segments = next_seg - first_seg;
+    pthread_rwlock_unlock(&disk_lock);
+}
+
+/*************
+ * Compaction
+ *************/
+
+static void compact(segment_t *sp) {
+    /*
+     * Copies the still-indexed records of a sealed segment to the active
+     * one and retires it. Records are re-appended one at a time, so
+     * lookups and stores interleave with a long compaction.
+     */
+    size_t off = 0;
+
+    while (1) {
+        const rec_hdr_t *hdr;
+        dentry_t *e;
+        size_t len;
+
+        pthread_rwlock_wrlock(&disk_lock);
+        if (segs[sp->id % MAX_SEGMENTS] != sp || off >= sp->used) {
+            // Dropped by the budget meanwhile, or fully copied
+            if (segs[sp->id % MAX_SEGMENTS] == sp)
+                retire_segment(sp);
+            pthread_rwlock_unlock(&disk_lock);
+            return;
+        }
+        hdr = (const rec_hdr_t *)(sp->map + off);
+        len = rec_align(sizeof(*hdr) + hdr->key_len + hdr->data_len);
+        e = index_find(hdr->hash);
+        if (e && e->seg == sp->id && e->off == off) {
+            const char *key = (const char *)(hdr + 1);
+            append_record(hdr->hash, key, hdr->key_len, key + hdr->key_len, hdr->data_len,
+                          hdr->born);
+        }
+        off += len;
+        pthread_rwlock_unlock(&disk_lock);
+    }
+}
+
+static void *compact_thread(void *vargp) {
+    /* Background thread: compacts the emptiest sealed segment now and then */
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        segment_t *victim = NULL;
+        uint32_t id;
+
+        sleep(COMPACT_INTERVAL);
+
+        pthread_rwlock_rdlock(&disk_lock);
+        for (id = first_seg; id != next_seg; id++) {
+            segment_t *sp = segs[id % MAX_SEGMENTS];
+            if (!sp || sp == active)
+                continue;
+            if (sp->live * 100 < sp->used * COMPACT_LIVE_PERCENT &&
+                (!victim || sp->live * victim->used < victim->live * sp->used))
+                victim = sp;
+        }
+        if (victim)
+            __atomic_add_fetch(&victim->refcnt, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&disk_lock);
+
+        if (victim) {
+            compact(victim);
+            segment_unref(victim);
+        }
+    }
+    return NULL;
+}
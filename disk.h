@@ -0,0 +1,19 @@
+/*
+ * disk.h - Log-structured second-tier cache on local disk
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "cache.h"
+
+#define DISK_CACHE_SIZE (256UL << 20)   /* Default -Z budget */
+#define SEGMENT_SIZE (8UL << 20)        /* Bytes per segment file */
+
+int disk_init(const char *dir, size_t max_disk_size);
+int disk_enabled(void);
+cache_obj_t *disk_lookup(const char *key, unsigned long hash);
+void disk_store(cache_obj_t *obj);
+void disk_segment_release(void *seg);
+void disk_get_stats(size_t *bytes, size_t *live, int *segments);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,423 @@
+/*
+ * dns.c - Cache of resolved end server addresses
+ *
+ * Every connection to an end server used to start with a getaddrinfo()
+ * call, which may block on the network for as long as the resolver
+ * takes. Lookups are answered from a process-wide cache keyed by
+ * (host, port) instead, and a miss goes to the stub resolver in
+ * resolver.c, which never blocks the caller. dns_lookup() either
+ * answers at once or promises a callback; dns_getaddrinfo() is a
+ * blocking wrapper for the thread engines, whose workers can afford
+ * to wait. Concurrent misses for one key share a single query: later
+ * ones join the first one's list of waiters.
+ *
+ * An answer is kept for its TTL, clamped to [ttl_floor, ttl_ceiling].
+ * Failed lookups are remembered for DNS_NEGATIVE_TTL seconds so that a
+ * bad host name does not send every request to the name servers.
+ * Address literals and /etc/hosts names never reach the cache.
+ *
+ * Answers are handed out with IPv6 and IPv4 addresses alternating, as
+ * RFC 8305 asks, led by the family that dns_prefer() last saw connect
+ * for the host; an address that silently fails then costs a racing
+ * connect at most one stagger delay before the other family is tried.
+ *
+ * Popular entries are refreshed ahead of time: a hit on an entry that
+ * has been used before and is in the last quarter of its lifetime
+ * sends a new query, while the old answer keeps being served. A host
+ * that is asked for steadily thus never expires, and lookups for it
+ * never wait on the resolver.
+ *
+ * The cache is split into shards by key hash, each with its own lock
+ * and its own hash chains. A full shard first drops expired entries,
+ * then the least recently used one; entries with a query in flight
+ * stay, as the resolver holds on to them.
+ */
+#include "csapp.h"
+#include "dns.h"
+#include "resolver.h"
+
+#define DNS_SHARDS 16
+#define DNS_BUCKETS 64              /* Hash chains per shard */
+#define DNS_SHARD_MAX 256           /* Entries per shard */
+#define DNS_MAX_ADDRS RESOLVER_MAX_ADDRS /* Addresses kept per answer */
+#define DNS_HOT_HITS 2              /* Hits that make an entry worth refreshing */
+
+/* An address as handed out: an addrinfo node with its sockaddr */
+typedef struct {
+    struct addrinfo ai;
+    struct sockaddr_storage addr;
+} dns_addr_t;
+
+/* A dns_lookup() caller waiting for a query in flight */
+typedef struct dns_waiter {
+    dns_callback_t cb;
+    void *arg;
+    struct dns_waiter *next;
+} dns_waiter_t;
+
+typedef struct dns_entry {
+    char *host;                     /* Lower case */
+    int port;
+    int err;                        /* EAI_* code of a cached failure, or 0 */
+    int naddrs;
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    time_t expires, lifetime;
+    time_t used;                    /* Last hit */
+    unsigned hits;                  /* Hits since it was resolved */
+    int family;                     /* Address family that last connected, or 0 */
+    int pending;                    /* A query for a miss is in flight */
+    int refreshing;                 /* A refresh query is in flight */
+    dns_waiter_t *waiters;          /* Callers waiting for the pending query */
+    struct dns_entry *next;
+} dns_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    dns_entry_t *buckets[DNS_BUCKETS];
+    int count;
+} __attribute__((aligned(64))) dns_shard_t;
+
+/* A blocked dns_getaddrinfo() caller */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done, err;
+    struct addrinfo *res;
+} dns_sync_t;
+
+static int ttl_floor, ttl_ceiling;
+static dns_shard_t shards[DNS_SHARDS];
+
+static time_t now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+void dns_init(int floor_secs, int ceiling_secs, const char *nameserver) {
+    /*
+     * Sets the TTL bounds and starts the resolver, which asks nameserver
+     * (NULL: the ones in /etc/resolv.conf). With a 0 ceiling nothing is
+     * kept past the query that fetched it.
+     */
+    int i;
+
+    ttl_floor = floor_secs;
+    ttl_ceiling = ceiling_secs;
+    for (i = 0; i < DNS_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+    resolver_init(nameserver);
+}
+
+static unsigned long key_hash(const char *host, int port) {
+    /* FNV-1a over the host name, case-folded, mixed with the port */
+    unsigned long h = 14695981039346656037UL;
+
+    while (*host)
+        h = (h ^ (unsigned char)tolower((unsigned char)*host++)) * 1099511628211UL;
+    return (h ^ port) * 1099511628211UL;
+}
+
+static dns_shard_t *shard_of(unsigned long h) {
+    return &shards[h % DNS_SHARDS];
+}
+
+static dns_entry_t **chain_of(unsigned long h) {
+    return &shard_of(h)->buckets[(h / DNS_SHARDS) % DNS_BUCKETS];
+}
+
+static int resolve_literal(const char *host, int port, dns_addr_t *addrs, int *naddrs) {
+    /* Converts an address literal with getaddrinfo(), which needs no network for it */
+    struct addrinfo hints, *list, *p;
+    char portStr[16];
+    int rc, n = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
+    sprintf(portStr, "%d", port);
+    if ((rc = getaddrinfo(host, portStr, &hints, &list)) != 0)
+        return rc;
+    for (p = list; p && n < DNS_MAX_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+        addrs[n].ai = *p;
+        memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+        n++;
+    }
+    freeaddrinfo(list);
+    *naddrs = n;
+    return n > 0 ? 0 : EAI_NONAME;
+}
+
+static void pack(const struct sockaddr_storage *ss, int n, dns_addr_t *addrs) {
+    /* Wraps resolver answers in addrinfo nodes for stream sockets */
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memset(&addrs[i].ai, 0, sizeof(struct addrinfo));
+        addrs[i].ai.ai_family = ss[i].ss_family;
+        addrs[i].ai.ai_socktype = SOCK_STREAM;
+        addrs[i].ai.ai_protocol = IPPROTO_TCP;
+        addrs[i].ai.ai_addrlen = ss[i].ss_family == AF_INET ? sizeof(struct sockaddr_in)
+                                                           : sizeof(struct sockaddr_in6);
+        addrs[i].addr = ss[i];
+    }
+}
+
+static struct addrinfo *unpack(const dns_addr_t *addrs, int n, int family) {
+    /*
+     * Copies answers into one block that reads as an addrinfo list,
+     * alternating address families for Happy Eyeballs (RFC 8305), with
+     * family, or else that of the first answer, leading.
+     */
+    dns_addr_t *block = Malloc(n * sizeof(dns_addr_t));
+    int i, k, taken[DNS_MAX_ADDRS] = {0};
+
+    if (family == 0)
+        family = addrs[0].ai.ai_family;
+    for (k = 0; k < n; k++) {
+        for (i = 0; i < n && (taken[i] || addrs[i].ai.ai_family != family); i++)
+            ;
+        // That family has run out: the rest go in their own order
+        if (i == n)
+            for (i = 0; taken[i]; i++)
+                ;
+        taken[i] = 1;
+        block[k] = addrs[i];
+        family = addrs[i].ai.ai_family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+    for (i = 0; i < n; i++) {
+        block[i].ai.ai_addr = (struct sockaddr *)&block[i].addr;
+        block[i].ai.ai_canonname = NULL;
+        block[i].ai.ai_next = i + 1 < n ? &block[i + 1].ai : NULL;
+    }
+    return &block[0].ai;
+}
+
+static void evict(dns_shard_t *sp, time_t t) {
+    /* Makes room in a full shard; caller holds its lock */
+    dns_entry_t **pp, *e, **lru = NULL;
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        for (pp = &sp->buckets[i]; (e = *pp) != NULL; ) {
+            if (e->pending || e->refreshing) {
+                pp = &e->next;
+                continue;
+            }
+            if (e->expires <= t) {
+                *pp = e->next;
+                free(e->host);
+                free(e);
+                sp->count--;
+                continue;
+            }
+            if (lru == NULL || e->used < (*lru)->used)
+                lru = pp;
+            pp = &e->next;
+        }
+    }
+    if (sp->count >= DNS_SHARD_MAX && lru != NULL) {
+        e = *lru;
+        *lru = e->next;
+        free(e->host);
+        free(e);
+        sp->count--;
+    }
+}
+
+static dns_entry_t *add_entry(dns_shard_t *sp, dns_entry_t **bp, const char *host, int port,
+                              time_t t) {
+    /* Adds an empty, already expired entry; caller holds the shard lock */
+    dns_entry_t *e;
+    char *p;
+
+    if (sp->count >= DNS_SHARD_MAX)
+        evict(sp, t);
+    e = Calloc(1, sizeof(dns_entry_t));
+    e->host = strdup(host);
+    for (p = e->host; *p; p++)
+        *p = tolower((unsigned char)*p);
+    e->port = port;
+    e->used = t;
+    e->expires = t;
+    e->next = *bp;
+    *bp = e;
+    sp->count++;
+    return e;
+}
+
+static void record(dns_entry_t *e, int err, const dns_addr_t *addrs, int naddrs, int ttl) {
+    /* Stores an answer (ttl < 0 if unknown) or a failure; caller holds the shard lock */
+    time_t t = now();
+
+    if (err)
+        ttl = DNS_NEGATIVE_TTL;
+    else if (ttl < 0)
+        ttl = DNS_TTL_DEFAULT;
+    if (!err && ttl < ttl_floor)
+        ttl = ttl_floor;
+    if (ttl > ttl_ceiling)
+        ttl = ttl_ceiling > 0 ? ttl_ceiling : 0;
+    e->err = err;
+    e->naddrs = err ? 0 : naddrs;
+    if (!err)
+        memcpy(e->addrs, addrs, naddrs * sizeof(dns_addr_t));
+    e->lifetime = ttl;
+    e->expires = t + ttl;
+    e->hits = 0;
+}
+
+static void resolved(void *arg, int err, const struct sockaddr_storage *ss, int n, int ttl) {
+    /* Resolver callback for a miss: records the answer and passes it to every waiter */
+    dns_entry_t *e = arg;
+    dns_shard_t *sp = shard_of(key_hash(e->host, e->port));
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    dns_waiter_t *w, *next;
+    int family;
+
+    pack(ss, n, addrs);
+    pthread_mutex_lock(&sp->lock);
+    record(e, err, addrs, n, ttl);
+    family = e->family;
+    w = e->waiters;
+    e->waiters = NULL;
+    e->pending = 0;
+    pthread_mutex_unlock(&sp->lock);
+
+    for (; w; w = next) {
+        next = w->next;
+        w->cb(w->arg, err, err ? NULL : unpack(addrs, n, family));
+        free(w);
+    }
+}
+
+static void refreshed(void *arg, int err, const struct sockaddr_storage *ss, int n, int ttl) {
+    /* Resolver callback for a refresh; a failure leaves the old answer to expire */
+    dns_entry_t *e = arg;
+    dns_shard_t *sp = shard_of(key_hash(e->host, e->port));
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+
+    pack(ss, n, addrs);
+    pthread_mutex_lock(&sp->lock);
+    if (!err)
+        record(e, 0, addrs, n, ttl);
+    e->refreshing = 0;
+    pthread_mutex_unlock(&sp->lock);
+}
+
+int dns_lookup(const char *host, int port, struct addrinfo **res, dns_callback_t cb, void *arg) {
+    /*
+     * Looks up host:port for a stream connection without blocking.
+     * Returns 0 and a list to be released with dns_freeaddrinfo(), a
+     * getaddrinfo() error code for gai_strerror(), or DNS_PENDING when
+     * cb(arg, err, list) will be called from the resolver thread.
+     */
+    struct sockaddr_storage ss[DNS_MAX_ADDRS];
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    unsigned long h;
+    dns_shard_t *sp;
+    dns_entry_t **bp, *e;
+    dns_waiter_t *w;
+    struct in6_addr literal;
+    time_t t;
+    int rc, n, query = 0;
+
+    // An address literal or a hosts file name needs no resolver and no cache slot
+    if ((inet_pton(AF_INET, host, &literal) == 1 || inet_pton(AF_INET6, host, &literal) == 1) &&
+        resolve_literal(host, port, addrs, &n) == 0) {
+        *res = unpack(addrs, n, 0);
+        return 0;
+    }
+    if ((n = resolver_hosts(host, port, ss, DNS_MAX_ADDRS)) > 0) {
+        pack(ss, n, addrs);
+        *res = unpack(addrs, n, 0);
+        return 0;
+    }
+
+    h = key_hash(host, port);
+    sp = shard_of(h);
+    bp = chain_of(h);
+    t = now();
+    pthread_mutex_lock(&sp->lock);
+    for (e = *bp; e; e = e->next)
+        if (e->port == port && !strcasecmp(e->host, host))
+            break;
+    if (e != NULL && !e->pending && t < e->expires) {
+        e->used = t;
+        e->hits++;
+        // Popular and close to expiry: have it resolved again in the background
+        if (!e->err && !e->refreshing && e->hits >= DNS_HOT_HITS &&
+            e->expires - t <= (e->lifetime + 3) / 4)
+            e->refreshing = query = 1;
+        rc = e->err;
+        if (!rc)
+            *res = unpack(e->addrs, e->naddrs, e->family);
+        pthread_mutex_unlock(&sp->lock);
+        if (query)
+            resolver_query(e->host, e->port, refreshed, e);
+        return rc;
+    }
+
+    // Missing or expired: wait for the query in flight, or send one
+    if (e == NULL)
+        e = add_entry(sp, bp, host, port, t);
+    w = Malloc(sizeof(dns_waiter_t));
+    w->cb = cb;
+    w->arg = arg;
+    w->next = e->waiters;
+    e->waiters = w;
+    if (!e->pending)
+        e->pending = query = 1;
+    pthread_mutex_unlock(&sp->lock);
+    if (query)
+        resolver_query(e->host, e->port, resolved, e);
+    return DNS_PENDING;
+}
+
+static void wake_caller(void *arg, int err, struct addrinfo *res) {
+    /* dns_lookup() callback for dns_getaddrinfo() */
+    dns_sync_t *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    s->err = err;
+    s->res = res;
+    s->done = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+int dns_getaddrinfo(const char *host, int port, struct addrinfo **res) {
+    /* Like dns_lookup(), but waits for the answer; for threads that may block */
+    dns_sync_t s = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL};
+    int rc;
+
+    if ((rc = dns_lookup(host, port, res, wake_caller, &s)) != DNS_PENDING)
+        return rc;
+    pthread_mutex_lock(&s.lock);
+    while (!s.done)
+        pthread_cond_wait(&s.cond, &s.lock);
+    pthread_mutex_unlock(&s.lock);
+    *res = s.res;
+    return s.err;
+}
+
+void dns_prefer(const char *host, int port, int family) {
+    /* Notes the address family a connection to host:port succeeded with */
+    unsigned long h = key_hash(host, port);
+    dns_shard_t *sp = shard_of(h);
+    dns_entry_t *e;
+
+    pthread_mutex_lock(&sp->lock);
+    for (e = *chain_of(h); e; e = e->next)
+        if (e->port == port && !strcasecmp(e->host, host))
+            e->family = family;
+    pthread_mutex_unlock(&sp->lock);
+}
+
+void dns_freeaddrinfo(struct addrinfo *res) {
+    /* Releases a list from dns_lookup(), which is a single block */
+    free(res);
+}
@@ -0,0 +1,25 @@
+/*
+ * dns.h - Cache of resolved end server addresses
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <netdb.h>
+
+#define DNS_TTL_FLOOR 5         /* Default -r: shortest time an answer is kept */
+#define DNS_TTL_CEILING 300     /* Default -R: longest time; 0 disables the cache */
+#define DNS_TTL_DEFAULT 60      /* For answers that come without a TTL */
+#define DNS_NEGATIVE_TTL 5      /* Seconds a failed lookup is remembered */
+
+#define DNS_PENDING 1           /* dns_lookup(): the answer comes through the callback */
+
+/* Called from the resolver thread with 0 and a list, or an EAI_* code */
+typedef void (*dns_callback_t)(void *arg, int err, struct addrinfo *res);
+
+void dns_init(int ttl_floor, int ttl_ceiling, const char *nameserver);
+int dns_lookup(const char *host, int port, struct addrinfo **res, dns_callback_t cb, void *arg);
+int dns_getaddrinfo(const char *host, int port, struct addrinfo **res);
+void dns_prefer(const char *host, int port, int family);
+void dns_freeaddrinfo(struct addrinfo *res);
+
+#endif /* __DNS_H__ */
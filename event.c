@@ -0,0 +1,579 @@
+/*
+ * event.c - Non-blocking, edge-triggered epoll engine for the proxy
+ *
+ * Instead of one blocking thread per client, a small fixed number of
+ * loop threads drive every socket. Each connection is a state machine:
+ *
+ *   READ_REQUEST  -> buffer the client request until the blank line
+ *   RESOLVE       -> wait for the end server's address from the resolver
+ *   CONNECT       -> non-blocking connect to the end server
+ *   WRITE_REQUEST -> send the header built by build_http_header()
+ *   RELAY         -> copy the end server's response back to the client
+ *   SEND_CACHED   -> or write a cached copy instead of connecting
+ *
+ * Request parsing reuses read_request() from proxy.c: the request bytes
+ * are collected directly into the connection's rio_t buffer and fed to
+ * the incremental parser as they arrive, so each byte is parsed once,
+ * and once the blank line is in read_request() finds the parse complete
+ * and never touches the socket.
+ *
+ * A DNS cache miss is answered on the resolver thread, which appends
+ * the connection to its loop's list of resolved ones and signals the
+ * loop's eventfd; the loop picks the connection up from there.
+ *
+ * Expired cache entries are not revalidated here: there are no
+ * conditional requests, 304 merges, stale-while-revalidate or
+ * stale-if-error, as in the blocking engines. A stale object is
+ * fetched again in full, and an end server error reaches the client.
+ */
+#include "proxy.h"
+#include "cache.h"
+#include "dns.h"
+#include "stats.h"
+#include <sys/epoll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#define MAXEVENTS 256
+
+typedef enum {
+    ST_READ_REQUEST,
+    ST_RESOLVE,
+    ST_CONNECT,
+    ST_WRITE_REQUEST,
+    ST_RELAY,
+    ST_SEND_CACHED,
+    ST_SEND_STATS,
+    ST_CLOSED
+} conn_state_t;
+
+struct conn;
+struct loop;
+
+/* epoll user data: tells the loop which side of a connection woke up */
+typedef struct {
+    struct conn *c;
+    int fd;
+} endpoint_t;
+
+typedef struct conn {
+    conn_state_t state;
+    endpoint_t client, server;
+    rio_t rio;                   /* Client request bytes */
+    http_req_t req;              /* Parse of rio's buffer so far */
+    char *uri, *hostname;        /* Kept for the log entry */
+    char *key;                   /* Cache key of the request */
+    int port;
+    size_t hdr_len, hdr_sent;    /* Header for the end server, staged in buf */
+    struct addrinfo *addrs, *next_addr;
+    struct loop *loop;           /* Owner, for the resolver's callback */
+    int dns_err;                 /* Outcome of a lookup that went to the resolver */
+    struct conn *next_resolved;
+    char buf[MAXBUF];            /* End server -> client relay buffer */
+    size_t buf_len, buf_off;
+    size_t total_size;
+    cache_obj_t *obj;            /* Cached response being sent */
+    cache_fill_t fill;           /* Response being collected for the cache */
+    binlog_trace_t trace;        /* What the binary log records about the request */
+    struct conn *next_dead;
+} conn_t;
+
+typedef struct loop {
+    int epfd;
+    int listenfd;
+    pthread_t tid;
+    conn_t *dead;                /* Closed during this batch, freed after it */
+    endpoint_t wake;             /* eventfd the resolver signals */
+    pthread_mutex_t resolved_lock;
+    conn_t *resolved;            /* Lookups completed by the resolver */
+} loop_t;
+
+static void *loop_thread(void *vargp);
+static void accept_clients(loop_t *lp);
+static void conn_drive(loop_t *lp, conn_t *c);
+static void conn_close(loop_t *lp, conn_t *c);
+static void conn_resolve(loop_t *lp, conn_t *c);
+static void dns_done(void *arg, int err, struct addrinfo *res);
+static void take_resolved(loop_t *lp);
+static int start_connect(loop_t *lp, conn_t *c);
+static int set_nonblocking(int fd);
+
+void event_run(int listenfd, int nloops) {
+    /* Starts nloops epoll loops sharing listenfd and waits on them forever */
+    loop_t *loops = Calloc(nloops, sizeof(loop_t));
+    struct epoll_event ev;
+    int i;
+
+    set_nonblocking(listenfd);
+    for (i = 0; i < nloops; i++) {
+        loops[i].listenfd = listenfd;
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+            unix_error("epoll_create1 error");
+
+        // Every loop watches the listener; EPOLLEXCLUSIVE wakes only one of them
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+            unix_error("epoll_ctl error");
+
+        // The resolver's wakeups; an endpoint without a connection
+        if ((loops[i].wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            unix_error("eventfd error");
+        pthread_mutex_init(&loops[i].resolved_lock, NULL);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &loops[i].wake;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wake.fd, &ev) < 0)
+            unix_error("epoll_ctl error");
+        Pthread_create(&loops[i].tid, NULL, loop_thread, &loops[i]);
+    }
+    printf("Event engine running with %d loop threads\n", nloops);
+
+    for (i = 0; i < nloops; i++)
+        Pthread_join(loops[i].tid, NULL);
+    free(loops);
+}
+
+static void *loop_thread(void *vargp) {
+    /* Body of a loop thread: waits for readiness and drives connections */
+    loop_t *lp = vargp;
+    struct epoll_event events[MAXEVENTS];
+    int i, n;
+
+    while (1) {
+        if ((n = epoll_wait(lp->epfd, events, MAXEVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            endpoint_t *ep = events[i].data.ptr;
+            if (ep == NULL)
+                accept_clients(lp);
+            else if (ep->c == NULL)
+                take_resolved(lp);
+            else
+                conn_drive(lp, ep->c);
+        }
+
+        // Both ends of a connection may appear in one batch, so free lazily
+        while (lp->dead) {
+            conn_t *c = lp->dead;
+            lp->dead = c->next_dead;
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+static void accept_clients(loop_t *lp) {
+    /* Accepts until the backlog is drained and registers each new client */
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    char hostname[MAXLINE], port[MAXLINE];
+    struct epoll_event ev;
+    int connfd;
+    conn_t *c;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = accept(lp->listenfd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            return;
+        }
+        set_nonblocking(connfd);
+
+        // Numeric lookup only: a reverse DNS query would stall the whole loop
+        if (getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,
+                        NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+            printf("Accepted connection from (%s, %s)\n", hostname, port);
+
+        stats_add(STAT_CONNS_OPENED, 1);
+        c = Calloc(1, sizeof(conn_t));
+        c->state = ST_READ_REQUEST;
+        c->client.c = c;
+        c->client.fd = connfd;
+        c->server.c = c;
+        c->server.fd = -1;
+        rio_readinitb(&c->rio, connfd);
+        http_req_init(&c->req);
+        if (binlog_enabled())
+            binlog_peer(&c->trace, (SA *)&clientaddr);
+
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &c->client;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            fprintf(stderr, "epoll_ctl error: %s\n", strerror(errno));
+            conn_close(lp, c);
+            continue;
+        }
+        conn_drive(lp, c);
+    }
+}
+
+static void conn_drive(loop_t *lp, conn_t *c) {
+    /*
+     * Advances the connection's state machine as far as the sockets allow.
+     * Edge-triggered notifications only fire on new readiness, so every
+     * state keeps going until read or write reports EAGAIN.
+     */
+    ssize_t n;
+    char uri[MAXLINE], hostname[MAXLINE], path[MAXLINE], key[MAXLINE];
+    http_hdr_t http_header;
+
+    while (1) {
+        switch (c->state) {
+        case ST_READ_REQUEST:
+            n = read(c->client.fd, c->rio.rio_buf + c->rio.rio_cnt,
+                     RIO_BUFSIZE - c->rio.rio_cnt);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                if (errno == EINTR)
+                    continue;
+                conn_close(lp, c);
+                return;
+            }
+            if (n == 0) {  // EOF before the request was complete
+                conn_close(lp, c);
+                return;
+            }
+            c->rio.rio_cnt += n;
+            switch (http_parse_request(&c->req, c->rio.rio_bufptr, c->rio.rio_cnt)) {
+            case HTTP_AGAIN:
+                if (c->rio.rio_cnt == RIO_BUFSIZE) {
+                    fprintf(stderr, "Error: request header too large\n");
+                    conn_close(lp, c);
+                    return;
+                }
+                continue;
+            case HTTP_ERROR:
+                fprintf(stderr, "Error: malformed request\n");
+                conn_close(lp, c);
+                return;
+            case HTTP_DONE:
+                break;
+            }
+
+            // The whole request is parsed; finish it exactly as doit() does
+            if (read_request(&c->rio, &c->req, uri, hostname, path, &c->port) < 0) {
+                conn_close(lp, c);
+                return;
+            }
+            c->uri = strdup(uri);
+            c->hostname = strdup(hostname);
+            stats_add(STAT_REQUESTS, 1);
+            stats_add(STAT_BYTES_IN, c->req.len);
+            binlog_start(&c->trace);
+
+            // The proxy's own stats are answered from the relay buffer
+            if (stats_is_request(hostname, path)) {
+                c->buf_len = stats_response(c->buf, sizeof(c->buf), path, 0);
+                c->buf_off = 0;
+                c->state = ST_SEND_STATS;
+                break;
+            }
+
+            // A fresh cache hit is written back without contacting the end server;
+            // a stale one is fetched again in full
+            cache_key(key, hostname, c->port, path);
+            if (request_cacheable(&c->req) && (c->obj = cache_lookup(key)) != NULL) {
+                if (cache_freshness(c->obj) == CACHE_FRESH) {
+                    c->trace.cache = BINLOG_HIT;
+                    c->trace.status = http_response_status(c->obj->data, c->obj->size);
+                    c->state = ST_SEND_CACHED;
+                    break;
+                }
+                cache_release(c->obj);
+                c->obj = NULL;
+            }
+            c->key = strdup(key);
+            cache_fill_init(&c->fill);
+            if (!request_cacheable(&c->req))
+                cache_fill_abort(&c->fill);
+            c->trace.cache = cache_enabled() && request_cacheable(&c->req) ? BINLOG_MISS
+                                                                           : BINLOG_BYPASS;
+
+            // The relay buffer is idle until the response arrives, so stage the header
+            // there; this engine reads every response to EOF, so the server closes
+            if (build_http_header(&http_header, &c->req, hostname, path, 0) < 0 ||
+                (n = http_hdr_copy(&http_header, c->buf, sizeof(c->buf))) < 0) {
+                fprintf(stderr, "Error: request header too large\n");
+                conn_close(lp, c);
+                return;
+            }
+            c->hdr_len = n;
+            conn_resolve(lp, c);
+            break;
+
+        case ST_RESOLVE:
+            // Until the resolver calls back, the connection is only watched
+            return;
+
+        case ST_CONNECT:
+            // A repeated connect() reports the outcome of the pending one
+            if (connect(c->server.fd, c->next_addr->ai_addr, c->next_addr->ai_addrlen) < 0 &&
+                errno != EISCONN) {
+                if (errno == EALREADY || errno == EINPROGRESS || errno == EINTR)
+                    return;
+                // This address failed, move on to the next candidate
+                close(c->server.fd);
+                c->server.fd = -1;
+                c->next_addr = c->next_addr->ai_next;
+                if (start_connect(lp, c) < 0) {
+                    fprintf(stderr, "Error: Failed to connect to server %s\n", c->hostname);
+                    stats_add(STAT_CONNECT_FAILURES, 1);
+                    conn_close(lp, c);
+                    return;
+                }
+                break;
+            }
+            dns_prefer(c->hostname, c->port, c->next_addr->ai_family);
+            dns_freeaddrinfo(c->addrs);
+            c->addrs = c->next_addr = NULL;
+            binlog_mark(&c->trace, BINLOG_CONNECTED);
+            c->state = ST_WRITE_REQUEST;
+            break;
+
+        case ST_WRITE_REQUEST:
+            n = write(c->server.fd, c->buf + c->hdr_sent, c->hdr_len - c->hdr_sent);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "Rio_writen error: %s\n", strerror(errno));
+                conn_close(lp, c);
+                return;
+            }
+            c->hdr_sent += n;
+            if (c->hdr_sent == c->hdr_len)
+                c->state = ST_RELAY;
+            break;
+
+        case ST_CLOSED:
+            return;
+
+        case ST_RELAY:
+            // Flush whatever is pending for the client before reading more
+            if (c->buf_off < c->buf_len) {
+                n = write(c->client.fd, c->buf + c->buf_off, c->buf_len - c->buf_off);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return;
+                    if (errno == EINTR)
+                        continue;
+                    fprintf(stderr, "Rio_writen error: %s\n", strerror(errno));
+                    conn_close(lp, c);
+                    return;
+                }
+                c->buf_off += n;
+                c->total_size += n;
+                continue;
+            }
+            n = read(c->server.fd, c->buf, MAXBUF);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "Error: Failed to read response from server\n");
+                cache_fill_abort(&c->fill);
+                n = 0;
+            }
+            if (n == 0) {  // End server is done: log and tear down
+                // An early close leaves a body short of its Content-Length or last chunk
+                if (!cache_fill_complete(&c->fill))
+                    cache_fill_abort(&c->fill);
+                cache_fill_commit(&c->fill, c->key);
+                if (c->total_size > 0)
+                    format_log_entry(c->hostname, c->uri, c->total_size, &c->trace);
+                conn_close(lp, c);
+                return;
+            }
+            // Bytes are relayed as they come; the status line starts the first read
+            if (c->total_size == 0) {
+                c->trace.status = http_response_status(c->buf, n);
+                binlog_mark(&c->trace, BINLOG_HEADER);
+            }
+            cache_fill_append(&c->fill, c->buf, n);
+            c->buf_len = n;
+            c->buf_off = 0;
+            break;
+
+        case ST_SEND_CACHED:
+            n = write(c->client.fd, c->obj->data + c->total_size, c->obj->size - c->total_size);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                if (errno == EINTR)
+                    continue;
+                fprintf(stderr, "Rio_writen error: %s\n", strerror(errno));
+                conn_close(lp, c);
+                return;
+            }
+            c->total_size += n;
+            if (c->total_size == c->obj->size) {
+                format_log_entry(c->hostname, c->uri, c->total_size, &c->trace);
+                conn_close(lp, c);
+                return;
+            }
+            break;
+
+        case ST_SEND_STATS:
+            if (c->buf_off == c->buf_len) {
+                conn_close(lp, c);
+                return;
+            }
+            n = write(c->client.fd, c->buf + c->buf_off, c->buf_len - c->buf_off);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                if (errno == EINTR)
+                    continue;
+                conn_close(lp, c);
+                return;
+            }
+            c->buf_off += n;
+            break;
+        }
+    }
+}
+
+static void conn_resolve(loop_t *lp, conn_t *c) {
+    /*
+     * Looks up the end server and starts connecting to it, or parks the
+     * connection in ST_RESOLVE until dns_done() hands it back. Closes the
+     * connection when the lookup or every connect attempt fails.
+     */
+    int rc;
+
+    c->loop = lp;
+    c->state = ST_RESOLVE;
+    if ((rc = dns_lookup(c->hostname, c->port, &c->addrs, dns_done, c)) == DNS_PENDING)
+        return;
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%d): %s\n", c->hostname, c->port, gai_strerror(rc));
+        stats_add(STAT_CONNECT_FAILURES, 1);
+        c->addrs = NULL;
+        conn_close(lp, c);
+        return;
+    }
+    c->next_addr = c->addrs;
+    if (start_connect(lp, c) < 0) {
+        fprintf(stderr, "Error: Failed to connect to server %s\n", c->hostname);
+        stats_add(STAT_CONNECT_FAILURES, 1);
+        conn_close(lp, c);
+        return;
+    }
+    c->state = ST_CONNECT;
+}
+
+static void dns_done(void *arg, int err, struct addrinfo *res) {
+    /* Resolver callback: queues the connection for its loop thread */
+    conn_t *c = arg;
+    loop_t *lp = c->loop;
+    uint64_t one = 1;
+
+    c->dns_err = err;
+    c->addrs = res;
+    pthread_mutex_lock(&lp->resolved_lock);
+    c->next_resolved = lp->resolved;
+    lp->resolved = c;
+    pthread_mutex_unlock(&lp->resolved_lock);
+    if (write(lp->wake.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "eventfd write error: %s\n", strerror(errno));
+}
+
+static void take_resolved(loop_t *lp) {
+    /* Moves every connection whose lookup finished on to connecting */
+    conn_t *c, *next;
+    uint64_t count;
+    int rc;
+
+    while (read(lp->wake.fd, &count, sizeof(count)) > 0)
+        ;
+    pthread_mutex_lock(&lp->resolved_lock);
+    c = lp->resolved;
+    lp->resolved = NULL;
+    pthread_mutex_unlock(&lp->resolved_lock);
+
+    for (; c; c = next) {
+        next = c->next_resolved;
+        if ((rc = c->dns_err) != 0) {
+            fprintf(stderr, "getaddrinfo failed (%s:%d): %s\n", c->hostname, c->port, gai_strerror(rc));
+            stats_add(STAT_CONNECT_FAILURES, 1);
+            c->addrs = NULL;
+            conn_close(lp, c);
+            continue;
+        }
+        c->next_addr = c->addrs;
+        if (start_connect(lp, c) < 0) {
+            fprintf(stderr, "Error: Failed to connect to server %s\n", c->hostname);
+            stats_add(STAT_CONNECT_FAILURES, 1);
+            conn_close(lp, c);
+            continue;
+        }
+        c->state = ST_CONNECT;
+        conn_drive(lp, c);
+    }
+}
+
+static int start_connect(loop_t *lp, conn_t *c) {
+    /*
+     * Starts a non-blocking connect to the next usable end server address.
+     * Returns -1 when none are left.
+     */
+    struct epoll_event ev;
+    int fd;
+
+    for (; c->next_addr; c->next_addr = c->next_addr->ai_next) {
+        struct addrinfo *p = c->next_addr;
+
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            continue;
+        }
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &c->server;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        c->server.fd = fd;
+        return 0;
+    }
+    return -1;
+}
+
+static void conn_close(loop_t *lp, conn_t *c) {
+    /* Releases everything a connection owns; closing fds removes them from epoll */
+    if (c->client.fd >= 0)
+        close(c->client.fd);
+    if (c->server.fd >= 0)
+        close(c->server.fd);
+    if (c->addrs)
+        dns_freeaddrinfo(c->addrs);
+    free(c->uri);
+    free(c->hostname);
+    free(c->key);
+    if (c->obj)
+        cache_release(c->obj);
+    cache_fill_abort(&c->fill);
+    stats_add(STAT_CONNS_CLOSED, 1);
+    c->state = ST_CLOSED;
+    c->next_dead = lp->dead;
+    lp->dead = c;
+}
+
+static int set_nonblocking(int fd) {
+    /* Puts fd in O_NONBLOCK mode */
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
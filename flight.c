@@ -0,0 +1,218 @@
+/*
+ * flight.c - Collapsed forwarding: one end server fetch per missing object
+ *
+ * When a popular object is missing from the cache, because it expired or
+ * the cache was just flushed, every request for it that arrives before
+ * the first fetch finishes would go to the end server on its own.
+ * flight_join() makes the first of them the leader of a flight for the
+ * cache key instead. The leader fetches the response and appends it to
+ * the flight as it relays it; the others follow the flight and stream
+ * its bytes to their own clients as they arrive.
+ *
+ * A flight is found through a sharded table until its leader ends it.
+ * Its bytes sit in fixed-size blocks that never move, so followers copy
+ * them out without holding its lock, and the blocks are freed when the
+ * last participant leaves. Leaders only share what the cache would
+ * keep: a 200 without no-store of at most max_bytes. For anything else
+ * the flight is ended before the header is in, and each follower then
+ * fetches for itself. A response without a length that turns out to be
+ * larger fails the flight midway; followers already streaming it close
+ * their connections without the last chunk, so their clients see it cut
+ * short.
+ */
+#include "csapp.h"
+#include "flight.h"
+
+#define FLIGHT_SHARDS 16
+#define FLIGHT_BUCKETS 64           /* Hash chains per shard */
+#define FLIGHT_BLOCK (64 * 1024)
+
+typedef enum { FLIGHT_RUNNING, FLIGHT_DONE, FLIGHT_FAILED } flight_state_t;
+
+struct flight {
+    char *key;
+    unsigned long hash;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;            /* Signalled on new bytes and at the end */
+    char **blocks;
+    int nblocks;
+    size_t len;
+    flight_state_t state;
+    int refcnt;                     /* Leader plus followers */
+    struct flight *next;            /* Hash chain */
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    flight_t *buckets[FLIGHT_BUCKETS];
+} __attribute__((aligned(64))) flight_shard_t;
+
+static flight_shard_t shards[FLIGHT_SHARDS];
+static size_t max_size;
+static unsigned long collapsed;     /* Requests that followed a flight */
+
+void flight_init(size_t max_bytes) {
+    /* Sets the largest response a flight carries */
+    int i;
+
+    max_size = max_bytes;
+    for (i = 0; i < FLIGHT_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+size_t flight_max_size(void) {
+    return max_size;
+}
+
+unsigned long flight_collapsed(void) {
+    return __atomic_load_n(&collapsed, __ATOMIC_RELAXED);
+}
+
+static unsigned long key_hash(const char *key) {
+    /* FNV-1a */
+    unsigned long h = 14695981039346656037UL;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 1099511628211UL;
+    return h;
+}
+
+flight_t *flight_join(const char *key, int lead, int *leader) {
+    /*
+     * Returns the flight for key with a reference held. *leader is set
+     * if the caller started it and must fetch the response; otherwise
+     * it follows the flight with flight_wait(). Without lead, returns
+     * NULL rather than start one.
+     */
+    unsigned long h = key_hash(key);
+    flight_shard_t *sp = &shards[h % FLIGHT_SHARDS];
+    flight_t **bp = &sp->buckets[(h / FLIGHT_SHARDS) % FLIGHT_BUCKETS], *f;
+
+    pthread_mutex_lock(&sp->lock);
+    for (f = *bp; f; f = f->next)
+        if (f->hash == h && !strcmp(f->key, key))
+            break;
+    if (f != NULL) {
+        __atomic_add_fetch(&f->refcnt, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sp->lock);
+        __atomic_add_fetch(&collapsed, 1, __ATOMIC_RELAXED);
+        *leader = 0;
+        return f;
+    }
+    if (!lead) {
+        pthread_mutex_unlock(&sp->lock);
+        return NULL;
+    }
+    f = Calloc(1, sizeof(flight_t));
+    f->key = strdup(key);
+    f->hash = h;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->state = FLIGHT_RUNNING;
+    f->refcnt = 1;
+    f->next = *bp;
+    *bp = f;
+    pthread_mutex_unlock(&sp->lock);
+    *leader = 1;
+    return f;
+}
+
+void flight_append(flight_t *f, const char *data, size_t n) {
+    /* Adds response bytes for the followers; past max_bytes the flight fails */
+    size_t off, k;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FLIGHT_RUNNING && f->len + n > max_size) {
+        f->state = FLIGHT_FAILED;
+        n = 0;
+    }
+    for (; n > 0 && f->state == FLIGHT_RUNNING; data += k, n -= k) {
+        off = f->len % FLIGHT_BLOCK;
+        if (off == 0) {
+            f->blocks = Realloc(f->blocks, (f->nblocks + 1) * sizeof(char *));
+            f->blocks[f->nblocks++] = Malloc(FLIGHT_BLOCK);
+        }
+        k = n < FLIGHT_BLOCK - off ? n : FLIGHT_BLOCK - off;
+        memcpy(f->blocks[f->nblocks - 1] + off, data, k);
+        f->len += k;
+    }
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+static void put(flight_t *f) {
+    /* Drops a reference; the last one frees the flight */
+    int i;
+
+    if (__atomic_sub_fetch(&f->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (i = 0; i < f->nblocks; i++)
+        free(f->blocks[i]);
+    free(f->blocks);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f->key);
+    free(f);
+}
+
+void flight_end(flight_t *f, int complete) {
+    /*
+     * Called by the leader once the response is relayed (complete) or
+     * given up on. New requests no longer find the flight; followers get
+     * what is left and the outcome.
+     */
+    flight_shard_t *sp = &shards[f->hash % FLIGHT_SHARDS];
+    flight_t **pp;
+
+    pthread_mutex_lock(&sp->lock);
+    for (pp = &sp->buckets[(f->hash / FLIGHT_SHARDS) % FLIGHT_BUCKETS]; *pp; pp = &(*pp)->next) {
+        if (*pp == f) {
+            *pp = f->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FLIGHT_RUNNING)
+        f->state = complete ? FLIGHT_DONE : FLIGHT_FAILED;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    put(f);
+}
+
+size_t flight_wait(flight_t *f, size_t off, const char **p) {
+    /*
+     * Waits until the flight has bytes past off and points *p at them.
+     * Returns how many are contiguous there, or 0 once the flight has
+     * ended without more; flight_complete() then tells how it ended.
+     */
+    size_t n = 0;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->len <= off && f->state == FLIGHT_RUNNING)
+        pthread_cond_wait(&f->cond, &f->lock);
+    if (f->len > off) {
+        *p = f->blocks[off / FLIGHT_BLOCK] + off % FLIGHT_BLOCK;
+        n = FLIGHT_BLOCK - off % FLIGHT_BLOCK;
+        if (n > f->len - off)
+            n = f->len - off;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return n;
+}
+
+int flight_complete(flight_t *f) {
+    /* Returns 1 if the leader relayed the whole response */
+    int done;
+
+    pthread_mutex_lock(&f->lock);
+    done = f->state == FLIGHT_DONE;
+    pthread_mutex_unlock(&f->lock);
+    return done;
+}
+
+void flight_leave(flight_t *f) {
+    /* Called by a follower when it is done with the flight */
+    put(f);
+}
@@ -0,0 +1,21 @@
+/*
+ * flight.h - Collapsed forwarding: one end server fetch per missing object
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stddef.h>
+
+typedef struct flight flight_t;
+
+void flight_init(size_t max_bytes);
+flight_t *flight_join(const char *key, int lead, int *leader);
+void flight_append(flight_t *f, const char *data, size_t n);
+void flight_end(flight_t *f, int complete);
+size_t flight_wait(flight_t *f, size_t off, const char **p);
+int flight_complete(flight_t *f);
+void flight_leave(flight_t *f);
+size_t flight_max_size(void);
+unsigned long flight_collapsed(void);
+
+#endif /* __FLIGHT_H__ */
@@ -0,0 +1,334 @@
+/*
+ * http.c - Incremental, zero-copy HTTP/1.x request parser
+ *
+ * http_parse_request() is fed the bytes of a request as they arrive,
+ * always starting at the same request start and with more bytes each
+ * time. It picks up where the previous call stopped, so every byte is
+ * searched for line ends once and every complete line is parsed once,
+ * whether the request arrives in one read or in many. Nothing is
+ * allocated or copied: the method, the parts of the request target,
+ * the version and every header field are views into the caller's
+ * buffer. The caller may move the unparsed bytes between calls (when
+ * compacting a read buffer, say) as long as the request start moves
+ * with them; the views are rebased on the next call.
+ *
+ * The parser is deliberately small. It accepts origin-form ("/path")
+ * and absolute-form ("http://host:port/path") targets, skips empty
+ * lines before the request line, and rejects obsolete line folding and
+ * lines without a colon.
+ *
+ * Header names are classified while they are parsed, with a perfect
+ * hash over the fields in HTTP_FIELDS: the slot is a function of the
+ * name's length and its first and last letter, and one case-insensitive
+ * compare against the slot's name confirms the match. The slot table is
+ * laid out by the compiler; two names that hash to the same slot are a
+ * build error (an initializer overriding another), at which point the
+ * hash constants below need changing.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+enum { ST_REQUEST_LINE, ST_FIELDS, ST_DONE };
+
+#define FIELD_SLOTS 64
+#define FIELD_HASH(len, first, last) (((len) + 25 * (first) + 32 * (last)) & (FIELD_SLOTS - 1))
+
+const unsigned char http_field_flags[HDR_COUNT] = {
+#define HTTP_FIELD_FLAGS(id, name, first, last, flags) [HDR_##id] = (flags),
+    HTTP_FIELDS(HTTP_FIELD_FLAGS)
+#undef HTTP_FIELD_FLAGS
+};
+
+#pragma GCC diagnostic error "-Woverride-init"
+static const struct {
+    const char *name;
+    unsigned char len;
+    unsigned char id;
+} field_slots[FIELD_SLOTS] = {
+#define HTTP_FIELD_SLOT(id, name, first, last, flags) \
+    [FIELD_HASH(sizeof(name) - 1, first, last)] = { name, sizeof(name) - 1, HDR_##id },
+    HTTP_FIELDS(HTTP_FIELD_SLOT)
+#undef HTTP_FIELD_SLOT
+};
+
+static inline void set(http_str_t *s, const char *p, size_t len) {
+    s->p = p;
+    s->len = len;
+}
+
+static void rebase(http_str_t *s, const char *old, const char *buf) {
+    /* Moves a view along with the bytes it points at */
+    if (s->p)
+        s->p = buf + (s->p - old);
+}
+
+void http_req_init(http_req_t *req) {
+    /* Prepares req for a new request */
+    memset(req, 0, offsetof(http_req_t, fields));
+    req->nfields = 0;
+    req->flags = 0;
+    req->state = ST_REQUEST_LINE;
+    req->base = NULL;
+    req->line = req->scan = 0;
+}
+
+void http_split_host(http_str_t authority, http_str_t *host, http_str_t *port) {
+    /* Splits "host[:port]" or "[v6addr][:port]"; port is empty if absent */
+    const char *p = authority.p, *end = p + authority.len, *q, *colon = NULL;
+
+    set(port, NULL, 0);
+    if (p < end && *p == '[' && (q = memchr(p, ']', end - p)) != NULL) {
+        set(host, p + 1, q - p - 1);
+        if (q + 1 < end && q[1] == ':')
+            set(port, q + 2, end - q - 2);
+        return;
+    }
+    for (q = p; q < end; q++)
+        if (*q == ':')
+            colon = q;
+    if (colon) {
+        set(host, p, colon - p);
+        set(port, colon + 1, end - colon - 1);
+    } else {
+        set(host, p, end - p);
+    }
+}
+
+static void parse_target(http_req_t *req) {
+    /* Splits the request target into scheme, host, port and path */
+    const char *p = req->target.p, *end = p + req->target.len;
+    const char *auth, *q;
+    http_str_t authority;
+
+    if (p < end && *p == '/') {  // Origin form: the host is in the Host field
+        set(&req->path, p, end - p);
+        return;
+    }
+
+    // Absolute form, or a bare host[:port][/path]
+    for (q = p; q + 2 < end && *q != '/'; q++) {
+        if (q[0] == ':' && q[1] == '/' && q[2] == '/') {
+            set(&req->scheme, p, q - p);
+            p = q + 3;
+            break;
+        }
+    }
+    for (auth = p; p < end && *p != '/' && *p != '?' && *p != '#'; p++)
+        if (*p == '@')
+            auth = p + 1;  // Drop any userinfo
+    set(&authority, auth, p - auth);
+    set(&req->path, p, end - p);
+    http_split_host(authority, &req->host, &req->port);
+}
+
+static int parse_request_line(http_req_t *req, const char *p, size_t len) {
+    /* Splits "METHOD SP target SP version" */
+    const char *end = p + len, *sp1, *sp2;
+
+    if ((sp1 = memchr(p, ' ', len)) == NULL || sp1 == p)
+        return -1;
+    if ((sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1)) == NULL || sp2 == sp1 + 1)
+        return -1;
+    if (end - sp2 - 1 < 5 || strncmp(sp2 + 1, "HTTP/", 5))
+        return -1;
+    set(&req->method, p, sp1 - p);
+    set(&req->target, sp1 + 1, sp2 - sp1 - 1);
+    set(&req->version, sp2 + 1, end - sp2 - 1);
+    parse_target(req);
+    return 0;
+}
+
+static int parse_field(http_req_t *req, const char *p, size_t len, size_t line_len) {
+    /* Splits "name: value" and records the field */
+    const char *colon, *v, *end = p + len;
+    http_field_t *f;
+
+    if (*p == ' ' || *p == '\t')
+        return -1;  // Obsolete line folding
+    if ((colon = memchr(p, ':', len)) == NULL || colon == p)
+        return -1;
+    if (req->nfields == HTTP_MAX_FIELDS)
+        return -1;
+    for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+        ;
+    while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    f = &req->fields[req->nfields++];
+    set(&f->name, p, colon - p);
+    set(&f->value, v, end - v);
+    set(&f->line, p, line_len);
+    f->id = http_field_id(p, colon - p);
+    req->flags |= http_field_flags[f->id];
+    return 0;
+}
+
+http_status_t http_parse_request(http_req_t *req, const char *buf, size_t len) {
+    /*
+     * Parses as much of the request in buf[0..len) as has arrived.
+     * Returns HTTP_DONE once the blank line after the header has been
+     * seen (req->len is then the size of the request head), HTTP_AGAIN
+     * if more bytes are needed, or HTTP_ERROR for a malformed request.
+     */
+    const char *nl, *p;
+    size_t n;
+    int i;
+
+    if (req->state == ST_DONE)
+        return HTTP_DONE;
+
+    // The caller moved the buffer: carry the views already handed out along
+    if (req->base && req->base != buf) {
+        rebase(&req->method, req->base, buf);
+        rebase(&req->target, req->base, buf);
+        rebase(&req->version, req->base, buf);
+        rebase(&req->scheme, req->base, buf);
+        rebase(&req->host, req->base, buf);
+        rebase(&req->port, req->base, buf);
+        rebase(&req->path, req->base, buf);
+        for (i = 0; i < req->nfields; i++) {
+            rebase(&req->fields[i].name, req->base, buf);
+            rebase(&req->fields[i].value, req->base, buf);
+            rebase(&req->fields[i].line, req->base, buf);
+        }
+    }
+    req->base = buf;
+
+    while ((nl = memchr(buf + req->scan, '\n', len - req->scan)) != NULL) {
+        p = buf + req->line;
+        n = nl - p;                     // Line length without "\n"
+        if (n > 0 && p[n - 1] == '\r')
+            n--;
+        req->scan = nl + 1 - buf;
+
+        if (req->state == ST_REQUEST_LINE) {
+            // Stray empty lines before a request are allowed
+            if (n > 0) {
+                if (parse_request_line(req, p, n) < 0)
+                    return HTTP_ERROR;
+                req->state = ST_FIELDS;
+            }
+        } else if (n == 0) {
+            req->state = ST_DONE;
+            req->len = req->scan;
+            return HTTP_DONE;
+        } else if (parse_field(req, p, n, nl + 1 - p) < 0) {
+            return HTTP_ERROR;
+        }
+        req->line = req->scan;
+    }
+    req->scan = len;
+    return HTTP_AGAIN;
+}
+
+http_field_id_t http_field_id(const char *name, size_t len) {
+    /* Classifies a header name (any case); HDR_OTHER if it is not in HTTP_FIELDS */
+    unsigned slot;
+
+    if (len == 0 || len > 255)
+        return HDR_OTHER;
+    // Or-ing in 0x20 lower-cases letters; anything else fails the compare anyway
+    slot = FIELD_HASH(len, name[0] | 0x20, name[len - 1] | 0x20);
+    if (field_slots[slot].len == len && !strncasecmp(field_slots[slot].name, name, len))
+        return field_slots[slot].id;
+    return HDR_OTHER;
+}
+
+const http_field_t *http_find_field(const http_req_t *req, http_field_id_t id) {
+    /* Returns the first field with the given id, or NULL */
+    int i;
+
+    for (i = 0; i < req->nfields; i++)
+        if (req->fields[i].id == id)
+            return &req->fields[i];
+    return NULL;
+}
+
+int http_str_eq(http_str_t s, const char *lit) {
+    /* Case-insensitive comparison of a view with a C string */
+    return strlen(lit) == s.len && (s.len == 0 || !strncasecmp(s.p, lit, s.len));
+}
+
+size_t http_str_copy(char *dst, size_t size, http_str_t s) {
+    /* Copies a view into a NUL-terminated string, truncating to fit */
+    size_t n = s.len < size - 1 ? s.len : size - 1;
+
+    if (n)
+        memcpy(dst, s.p, n);
+    dst[n] = '\0';
+    return n;
+}
+
+int http_str_port(http_str_t s) {
+    /* Converts a port view to a number; -1 if it is not one */
+    size_t i;
+    int port = 0;
+
+    if (s.len == 0 || s.len > 5)
+        return -1;
+    for (i = 0; i < s.len; i++) {
+        if (s.p[i] < '0' || s.p[i] > '9')
+            return -1;
+        port = port * 10 + s.p[i] - '0';
+    }
+    return port > 0 && port <= 65535 ? port : -1;
+}
+
+time_t http_parse_date(const char *p, size_t len) {
+    /*
+     * Converts an HTTP-date in any of the three formats RFC 9110 accepts
+     * (IMF-fixdate, RFC 850 and asctime) to a time; -1 if it is none
+     */
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char buf[64], mon[4];
+    const char *m;
+    struct tm tm;
+    int day, year, hh, mm, ss, n = 0;
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    if (sscanf(buf, "%*[A-Za-z], %d %3s %d %d:%d:%d GMT%n",
+               &day, mon, &year, &hh, &mm, &ss, &n) == 6 && n) {
+        // Sun, 06 Nov 1994 08:49:37 GMT
+    } else if (sscanf(buf, "%*[A-Za-z], %d-%3s-%d %d:%d:%d GMT%n",
+                      &day, mon, &year, &hh, &mm, &ss, &n) == 6 && n) {
+        // Sunday, 06-Nov-94 08:49:37 GMT
+        if (year < 100)
+            year += year < 70 ? 2000 : 1900;
+    } else if (sscanf(buf, "%*[A-Za-z] %3s %d %d:%d:%d %d%n",
+                      mon, &day, &hh, &mm, &ss, &year, &n) == 6 && n) {
+        // Sun Nov  6 08:49:37 1994
+    } else {
+        return -1;
+    }
+    if (strlen(mon) != 3 || (m = strstr(months, mon)) == NULL || (m - months) % 3 ||
+        day < 1 || day > 31 || year < 1900 || hh > 23 || mm > 59 || ss > 60 ||
+        hh < 0 || mm < 0 || ss < 0)
+        return -1;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_mday = day;
+    tm.tm_hour = hh;
+    tm.tm_min = mm;
+    tm.tm_sec = ss;
+    return timegm(&tm);
+}
+
+int http_response_status(const char *p, size_t len) {
+    /* Returns the status code of a response's status line in p[0..len); 0 if it has none */
+    int i, status = 0;
+
+    if (len < 12 || memcmp(p, "HTTP/", 5) || p[8] != ' ')
+        return 0;
+    for (i = 9; i < 12; i++) {
+        if (p[i] < '0' || p[i] > '9')
+            return 0;
+        status = status * 10 + p[i] - '0';
+    }
+    return status;
+}
@@ -0,0 +1,106 @@
+/*
+ * http.h - Incremental, zero-copy HTTP/1.x request parser
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#define HTTP_MAX_FIELDS 64      /* Header fields kept per request */
+
+/* What the proxy does with a header field */
+#define HF_HOP      0x1         /* Hop-by-hop: never forwarded */
+#define HF_OWN      0x2         /* The proxy sends its own instead */
+#define HF_PRIVATE  0x4         /* In a request: bypass the shared cache */
+#define HF_NOSTORE  0x8         /* In a response: do not cache it */
+
+/*
+ * Header fields the proxy knows: id, lower-case name, its first and
+ * last letter (for the perfect hash in http.c), and flags.
+ */
+#define HTTP_FIELDS(F) \
+    F(HOST,                "host",                'h', 't', HF_OWN) \
+    F(CONNECTION,          "connection",          'c', 'n', HF_HOP | HF_OWN) \
+    F(PROXY_CONNECTION,    "proxy-connection",    'p', 'n', HF_HOP | HF_OWN) \
+    F(KEEP_ALIVE,          "keep-alive",          'k', 'e', HF_HOP) \
+    F(TE,                  "te",                  't', 'e', HF_HOP) \
+    F(TRAILER,             "trailer",             't', 'r', HF_HOP) \
+    F(TRANSFER_ENCODING,   "transfer-encoding",   't', 'g', HF_HOP) \
+    F(UPGRADE,             "upgrade",             'u', 'e', HF_HOP) \
+    F(PROXY_AUTHORIZATION, "proxy-authorization", 'p', 'n', HF_HOP) \
+    F(PROXY_AUTHENTICATE,  "proxy-authenticate",  'p', 'e', HF_HOP) \
+    F(USER_AGENT,          "user-agent",          'u', 't', HF_OWN) \
+    F(CONTENT_LENGTH,      "content-length",      'c', 'h', 0) \
+    F(CACHE_CONTROL,       "cache-control",       'c', 'l', 0) \
+    F(PRAGMA,              "pragma",              'p', 'a', 0) \
+    F(EXPIRES,             "expires",             'e', 's', 0) \
+    F(LAST_MODIFIED,       "last-modified",       'l', 'd', 0) \
+    F(ETAG,                "etag",                'e', 'g', 0) \
+    F(AGE,                 "age",                 'a', 'e', 0) \
+    F(DATE,                "date",                'd', 'e', 0) \
+    F(VARY,                "vary",                'v', 'y', HF_NOSTORE) \
+    F(IF_MODIFIED_SINCE,   "if-modified-since",   'i', 'e', 0) \
+    F(IF_UNMODIFIED_SINCE, "if-unmodified-since", 'i', 'e', 0) \
+    F(IF_NONE_MATCH,       "if-none-match",       'i', 'h', 0) \
+    F(IF_MATCH,            "if-match",            'i', 'h', 0) \
+    F(IF_RANGE,            "if-range",            'i', 'e', HF_PRIVATE) \
+    F(RANGE,               "range",               'r', 'e', HF_PRIVATE) \
+    F(AUTHORIZATION,       "authorization",       'a', 'n', HF_PRIVATE) \
+    F(COOKIE,              "cookie",              'c', 'e', 0) \
+    F(SET_COOKIE,          "set-cookie",          's', 'e', HF_NOSTORE)
+
+typedef enum {
+    HDR_OTHER,
+#define HTTP_FIELD_ID(id, name, first, last, flags) HDR_##id,
+    HTTP_FIELDS(HTTP_FIELD_ID)
+#undef HTTP_FIELD_ID
+    HDR_COUNT
+} http_field_id_t;
+
+extern const unsigned char http_field_flags[HDR_COUNT];
+
+/* A view of bytes in the caller's buffer; not NUL-terminated */
+typedef struct {
+    const char *p;
+    size_t len;
+} http_str_t;
+
+typedef struct {
+    http_str_t name, value;     /* Value without surrounding whitespace */
+    http_str_t line;            /* The whole line, line ending included */
+    http_field_id_t id;
+} http_field_t;
+
+/* Results of http_parse_request() */
+typedef enum { HTTP_ERROR = -1, HTTP_AGAIN = 0, HTTP_DONE = 1 } http_status_t;
+
+typedef struct {
+    /* Filled in as lines complete; all of them are set once HTTP_DONE */
+    http_str_t method, target, version;
+    http_str_t scheme, host, port, path;    /* Parts of target; empty if absent */
+    http_field_t fields[HTTP_MAX_FIELDS];
+    int nfields;
+    unsigned flags;             /* HF_* flags of all fields, or'ed */
+    size_t len;                 /* Request line and header, blank line included */
+
+    /* Parser state */
+    int state;
+    const char *base;           /* Buffer passed to the previous call */
+    size_t line;                /* Offset of the line being parsed */
+    size_t scan;                /* How far that line has been searched */
+} http_req_t;
+
+void http_req_init(http_req_t *req);
+http_status_t http_parse_request(http_req_t *req, const char *buf, size_t len);
+
+void http_split_host(http_str_t authority, http_str_t *host, http_str_t *port);
+http_field_id_t http_field_id(const char *name, size_t len);
+const http_field_t *http_find_field(const http_req_t *req, http_field_id_t id);
+int http_str_eq(http_str_t s, const char *lit);
+size_t http_str_copy(char *dst, size_t size, http_str_t s);
+int http_str_port(http_str_t s);
+time_t http_parse_date(const char *p, size_t len);
+int http_response_status(const char *p, size_t len);
+
+#endif /* __HTTP_H__ */
@@ -1,70 +1,451 @@
 #include <stdio.h>
-#include "csapp.h"
+#include <poll.h>
+#include "proxy.h"
+#include "cache.h"
+#include "disk.h"
+#include "sbuf.h"
+#include "sysdep.h"
+#include "upstream.h"
+#include "dns.h"
+#include "connect.h"
+#include "flight.h"
+#include "accesslog.h"
+#include "binlog.h"
+#include "stats.h"
+
+/* Default sizes for the pre-spawned worker pool (-m pool) */
+#define NTHREADS 16
+#define SBUFSIZE 64
+
+/* Block size for relaying response bodies, and the largest response header */
+#define RELAY_BUFSIZE (64 * 1024)
+#define RELAY_HDRSIZE (32 * 1024)
+
+/* Default seconds a client connection may sit idle between requests (-I) */
+#define CLIENT_IDLE_TIMEOUT 15
+
+/* Most pipelined requests served at once, and the read-ahead for each */
+#define PIPELINE_MAX 16
+#define PIPELINE_PIPESIZE (1024 * 1024)
+
+/* Helper threads, shared by all connections, for pipelined requests and refreshes */
+#define NHELPERS 32
+
+/* Cleared the first time splice() turns out not to work for sockets */
+static int splice_ok = 1;
+
+static int client_timeout = CLIENT_IDLE_TIMEOUT;
 
 /* Predefined HTTP header components for the proxy */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
+static const char *keepalive_hdr = "Connection: keep-alive\r\n";
+static const char *chunked_hdr = "Transfer-Encoding: chunked\r\n";
 static const char *prox_hdr = "Proxy-Connection: close\r\n";
-static const char *host_hdr_format = "Host: %s\r\n";
-static const char *requestlint_hdr_format = "GET %s HTTP/1.0\r\n";
+static const char *host_hdr_prefix = "Host: ";
+static const char *request_hdr_prefix = "GET ";
+static const char *request_hdr_suffix = " HTTP/1.0\r\n";
+static const char *request_hdr_suffix11 = " HTTP/1.1\r\n";
 static const char *endof_hdr = "\r\n";
+static const char *if_none_match_hdr = "If-None-Match:";
+static const char *if_modified_since_hdr = "If-Modified-Since:";
 
-/* Key strings used in HTTP headers */
-static const char *connection_key = "Connection";
-static const char *user_agent_key= "User-Agent";
-static const char *proxy_connection_key = "Proxy-Connection";
-static const char *host_key = "Host";
-pthread_mutex_t mutex;
+/* Connection engines selectable with -m */
+typedef enum { MODE_THREAD, MODE_POOL, MODE_EVENT, MODE_URING } engine_t;
 
-void *thread(void *vargp);
-void doit(int connfd);
-void parse_uri(char *uri, char *hostname, char *path, int *port);
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio);
-void format_log_entry(char *browser_ip, char *url, size_t size);
-int connect_endServer(char *hostname, int port, char *http_header);
+/* Engine settings, shared by every acceptor in -a mode */
+typedef struct {
+    engine_t mode;
+    int nthreads, sbufsize, nloops;
+    char *port;
+} engine_conf_t;
+
+/* A request read from a client connection, and where its response goes */
+typedef struct {
+    http_req_t req;
+    char uri[MAXLINE], hostname[MAXLINE], path[MAXLINE], key[MAXLINE];
+    int port;
+    int keep;                   /* Connection stays open after it; cleared if it cannot */
+    int chunked_ok;             /* The client takes chunked bodies (HTTP/1.1) */
+    cache_obj_t *obj;           /* Cache hit, or NULL */
+    int outfd;                  /* The client, or the pipe of a request served early */
+    int pipefd;                 /* Read end of that pipe; -1 if none */
+    sem_t done;                 /* Posted when a helper has served it */
+    binlog_trace_t trace;       /* What the binary log records about it */
+} client_req_t;
+
+/* Work handed to the helper threads, at most one job per idle helper */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    void (*fn[NHELPERS])(void *);
+    void *arg[NHELPERS];
+    int front, count;
+    int idle;                   /* Helpers waiting for a job and not yet promised one */
+} helpers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
 
-ssize_t Rio_readn_w(int fd, void *usrbuf, size_t n);
-ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen);
-ssize_t Rio_writen_w(int fd, void *usrbuf, size_t n);
+/* One SO_REUSEPORT acceptor and the CPU it is pinned to */
+typedef struct {
+    engine_conf_t *conf;
+    int cpu;
+    pthread_t tid;
+} acceptor_t;
+
+void *thread(void *vargp);
+void *worker(void *vargp);
+void *acceptor(void *vargp);
+void *signal_thread(void *vargp);
+void serve(engine_conf_t *conf, int listenfd);
+void serve_threads(int listenfd);
+void serve_pool(int listenfd, int nthreads, int sbufsize);
+void accept_client(int listenfd, int *connfdp);
+void usage(char *prog);
+static int read_pipeline(rio_t *rio, client_req_t **reqs, int *closing,
+                         const binlog_trace_t *peer);
+static int serve_pipeline(int connfd, client_req_t **reqs, int n);
+static void helpers_init(int n);
+static int helper_run(void (*fn)(void *), void *arg);
+static void *helper_thread(void *vargp);
+static void serve_early(void *vp);
+static void serve_request(client_req_t *r);
+static int wait_request(int connfd);
+static int client_keepalive(http_req_t *req);
+static int send_cached(int connfd, cache_obj_t *obj, int *keepalive);
+static int follow_flight(client_req_t *r, flight_t *f, size_t *total);
+static size_t fetch_response(client_req_t *r, cache_obj_t *stale, flight_t *flight);
+static void start_refresh(client_req_t *r, cache_obj_t *obj);
+static void refresh_job(void *vp);
+static int request_conditional(http_req_t *req);
+static int add_validators(http_hdr_t *hdr, cache_obj_t *obj);
+static size_t send_stale(int connfd, cache_obj_t *obj, int *keepalive);
+static void send_stats(client_req_t *r);
+static int hdr_add(http_hdr_t *hdr, const char *p, size_t n);
+static int list_has_token(const char *p, size_t len, const char *tok, size_t toklen);
+size_t relay_response(rio_t *server_rio, int connfd, cache_fill_t *fill, int *reusable,
+                      int *keepalive, int chunked_ok, binlog_trace_t *trace);
 
 int main(int argc, char **argv) {
     /* Main function: sets up a server listening for connections */
-    int listenfd, *connfdp;
-    char hostname[MAXLINE], port[MAXLINE];
+    int i, opt, nacceptors = -1;
+    long max_cache = MAX_CACHE_SIZE, max_object = MAX_OBJECT_SIZE;
+    cache_policy_t policy = CACHE_TINYLFU;
+    char *disk_dir = NULL;
+    long max_disk = DISK_CACHE_SIZE;
+    int max_idle = UPSTREAM_MAX_IDLE, idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+    int ttl_floor = DNS_TTL_FLOOR, ttl_ceiling = DNS_TTL_CEILING;
+    char *nameserver = NULL;
+    int attempt_ms = CONNECT_ATTEMPT_MS, connect_ms = CONNECT_TOTAL_MS;
+    char *binlog_path = NULL;
+    long binlog_size = BINLOG_SIZE;
+    sigset_t mask;
     pthread_t tid;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    engine_conf_t conf = { MODE_THREAD, NTHREADS, SBUFSIZE, 0, NULL };
+    acceptor_t *acceptors;
 
-    // Initialize mutex for thread synchronization
-    pthread_mutex_init(&mutex, NULL);
+    // Parse the optional engine selection flags
+    while ((opt = getopt(argc, argv, "m:n:t:q:a:C:O:P:D:Z:k:K:I:r:R:N:w:W:L:l:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "thread"))
+                conf.mode = MODE_THREAD;
+            else if (!strcmp(optarg, "pool"))
+                conf.mode = MODE_POOL;
+            else if (!strcmp(optarg, "event"))
+                conf.mode = MODE_EVENT;
+            else if (!strcmp(optarg, "uring"))
+                conf.mode = MODE_URING;
+            else
+                usage(argv[0]);
+            break;
+        case 'n':
+            conf.nloops = atoi(optarg);
+            break;
+        case 't':
+            if ((conf.nthreads = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'q':
+            if ((conf.sbufsize = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'a':
+            if ((nacceptors = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'C':
+            if ((max_cache = atol(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'O':
+            if ((max_object = atol(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'P':
+            if (!strcmp(optarg, "lru"))
+                policy = CACHE_LRU;
+            else if (!strcmp(optarg, "tinylfu"))
+                policy = CACHE_TINYLFU;
+            else
+                usage(argv[0]);
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'Z':
+            if ((max_disk = atol(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'k':
+            if ((max_idle = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'K':
+            if ((idle_timeout = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'I':
+            if ((client_timeout = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if ((ttl_floor = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'R':
+            if ((ttl_ceiling = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'N':
+            nameserver = optarg;
+            break;
+        case 'w':
+            if ((attempt_ms = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'W':
+            if ((connect_ms = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'L':
+            binlog_path = optarg;
+            break;
+        case 'l':
+            if ((binlog_size = atol(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
     // Check if port number is provided as argument
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1); // Exit if port number is not provided
-    }
+    if (optind != argc - 1)
+        usage(argv[0]); // Exit if port number is not provided
+    conf.port = argv[optind];
 
     signal(SIGPIPE, SIG_IGN);
+    cache_init(max_cache, max_object, policy);
+    flight_init(max_object);
+
+    // SIGUSR1 dumps counters; block it everywhere but the thread that waits for it
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    Pthread_create(&tid, NULL, signal_thread, NULL);
+
+    // The compactor, pool reaper, resolver and log writer threads inherit the blocked mask
+    if (disk_dir && cache_enabled() && disk_init(disk_dir, max_disk) < 0)
+        fprintf(stderr, "disk cache disabled\n");
+    upstream_init(max_idle, idle_timeout);
+    dns_init(ttl_floor, ttl_ceiling, nameserver);
+    connect_init(attempt_ms, connect_ms);
+
+    // The binary log replaces the text one
+    if (binlog_path && binlog_init(binlog_path, binlog_size) < 0)
+        fprintf(stderr, "binary log disabled\n");
+    if (!binlog_enabled())
+        accesslog_init(ACCESSLOG_PATH);
+    if (conf.mode == MODE_THREAD || conf.mode == MODE_POOL)
+        helpers_init(NHELPERS);
+
+    if (nacceptors < 0) {
+        // Open a listening socket on the provided port
+        if ((conf.mode == MODE_EVENT || conf.mode == MODE_URING) && conf.nloops <= 0)
+            conf.nloops = ncpus();
+        serve(&conf, Open_listenfd(conf.port));
+    } else {
+        // One pinned acceptor per core, each with a listener of its own
+        if (nacceptors == 0)
+            nacceptors = ncpus();
+        if ((conf.mode == MODE_EVENT || conf.mode == MODE_URING) && conf.nloops <= 0)
+            conf.nloops = 1;
+        acceptors = Calloc(nacceptors, sizeof(acceptor_t));
+        for (i = 0; i < nacceptors; i++) {
+            acceptors[i].conf = &conf;
+            acceptors[i].cpu = i;
+            Pthread_create(&acceptors[i].tid, NULL, acceptor, &acceptors[i]);
+        }
+        for (i = 0; i < nacceptors; i++)
+            Pthread_join(acceptors[i].tid, NULL);
+        free(acceptors);
+    }
+
+    return 0;
+}
+
+void serve(engine_conf_t *conf, int listenfd) {
+    /* Runs the configured connection engine on listenfd; never returns */
+    switch (conf->mode) {
+    case MODE_THREAD:
+        serve_threads(listenfd);
+        break;
+    case MODE_POOL:
+        serve_pool(listenfd, conf->nthreads, conf->sbufsize);
+        break;
+    case MODE_EVENT:
+        // The event engine drives every socket from a few epoll loops
+        event_run(listenfd, conf->nloops);
+        break;
+    case MODE_URING:
+        // Batched io_uring loops, or the blocking engine on kernels without it
+        if (uring_run(listenfd, conf->nloops) < 0) {
+            fprintf(stderr, "io_uring unavailable, falling back to -m thread\n");
+            serve_threads(listenfd);
+        }
+        break;
+    }
+}
+
+void *acceptor(void *vargp) {
+    /*
+     * Acceptor thread for -a: pins itself to a CPU before opening its own
+     * SO_REUSEPORT listener, so that the kernel load-balances new
+     * connections across acceptors and every thread an acceptor starts
+     * inherits its CPU.
+     */
+    acceptor_t *ap = vargp;
+    int rc;
+
+    if ((rc = pin_thread(ap->cpu)) != 0)
+        fprintf(stderr, "Warning: could not pin acceptor %d: %s\n", ap->cpu, strerror(rc));
+    serve(ap->conf, Open_reuseport_listenfd(ap->conf->port));
+    return NULL;
+}
+
+void usage(char *prog) {
+    /* Prints the command line synopsis and exits */
+    fprintf(stderr, "usage: %s [-m thread|pool|event|uring] [-t threads] [-q depth] [-n loops]\n"
+                    "       [-a acceptors] [-C cache_bytes] [-O object_bytes] [-P lru|tinylfu]\n"
+                    "       [-D disk_dir] [-Z disk_bytes] [-k idle_conns] [-K idle_secs]\n"
+                    "       [-I client_idle_secs] [-r dns_min_ttl] [-R dns_max_ttl]\n"
+                    "       [-N nameserver[:port]] [-w attempt_ms] [-W connect_ms]\n"
+                    "       [-L binlog_file] [-l binlog_bytes] <port>\n",
+            prog);
+    fprintf(stderr, "  -m  connection engine: one thread per connection (default),\n"
+                    "      a pre-spawned worker pool, epoll loops, or io_uring rings\n");
+    fprintf(stderr, "  -t  worker threads for -m pool (default: %d)\n", NTHREADS);
+    fprintf(stderr, "  -q  connection queue depth for -m pool (default: %d)\n", SBUFSIZE);
+    fprintf(stderr, "  -n  number of loop threads for -m event and -m uring (default: one per CPU)\n");
+    fprintf(stderr, "  -a  run that many CPU-pinned acceptors, each with its own SO_REUSEPORT\n"
+                    "      listener and its own engine (-t, -q, -n apply per acceptor;\n"
+                    "      0 means one per CPU)\n");
+    fprintf(stderr, "  -C  total response cache budget in bytes, 0 disables it (default: %d)\n",
+            MAX_CACHE_SIZE);
+    fprintf(stderr, "  -O  largest response the cache stores, in bytes (default: %d)\n",
+            MAX_OBJECT_SIZE);
+    fprintf(stderr, "  -P  cache policy: plain LRU or W-TinyLFU admission (default)\n");
+    fprintf(stderr, "  -D  keep objects evicted from memory in segment files under this directory\n");
+    fprintf(stderr, "  -Z  disk cache budget in bytes (default: %lu)\n", DISK_CACHE_SIZE);
+    fprintf(stderr, "  -k  idle keep-alive connections kept per end server by -m thread and\n"
+                    "      -m pool, 0 disables pooling (default: %d)\n", UPSTREAM_MAX_IDLE);
+    fprintf(stderr, "  -K  seconds an idle end server connection is kept (default: %d)\n",
+            UPSTREAM_IDLE_TIMEOUT);
+    fprintf(stderr, "  -I  seconds -m thread and -m pool wait for the next request on a\n"
+                    "      keep-alive client connection (default: %d)\n", CLIENT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -r  shortest time in seconds a resolved address is cached (default: %d)\n",
+            DNS_TTL_FLOOR);
+    fprintf(stderr, "  -R  longest time, 0 disables the DNS cache (default: %d)\n",
+            DNS_TTL_CEILING);
+    fprintf(stderr, "  -N  send DNS queries to this server instead of the ones in\n"
+                    "      /etc/resolv.conf\n");
+    fprintf(stderr, "  -w  milliseconds -m thread and -m pool wait for one end server address\n"
+                    "      to accept a connection (default: %d)\n", CONNECT_ATTEMPT_MS);
+    fprintf(stderr, "  -W  milliseconds they wait for any address to accept (default: %d)\n",
+            CONNECT_TOTAL_MS);
+    fprintf(stderr, "  -L  write the access log as binary records to this file, and the URLs\n"
+                    "      to <file>%s, instead of text lines to %s; read it with binlogdump\n",
+            BINLOG_URLS_SUFFIX, ACCESSLOG_PATH);
+    fprintf(stderr, "  -l  size of the binary log, whose oldest records are overwritten once\n"
+                    "      it is full (default: %ld)\n", BINLOG_SIZE);
+    fprintf(stderr, "Send SIGUSR1 to print the cache hit ratio and admission counters.\n");
+    exit(1);
+}
+
+void accept_client(int listenfd, int *connfdp) {
+    /* Accepts one connection into *connfdp and reports who it came from */
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+
+    clientlen = sizeof(clientaddr);
+    *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+
+    // Retrieve and print the client's hostname and port number
+    Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+    printf("Accepted connection from (%s, %s)\n", hostname, port);
+}
+
+void serve_threads(int listenfd) {
+    /* Thread-per-connection engine: every client gets a fresh detached thread */
+    int *connfdp;
+    pthread_t tid;
 
-    // Open a listening socket on the provided port
-    listenfd = Open_listenfd(argv[1]);
     while (1) {
-        clientlen = sizeof(clientaddr);
         connfdp = malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-
-        // Retrieve and print the client's hostname and port number
-        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        accept_client(listenfd, connfdp);
 
         // Create a new thread to handle the client connection
         Pthread_create(&tid, NULL, thread, connfdp);
     }
+}
 
-    // Destroy the mutex before the program terminates
-    pthread_mutex_destroy(&mutex);
+void serve_pool(int listenfd, int nthreads, int sbufsize) {
+    /* Worker pool engine: a fixed set of threads fed through a bounded queue */
+    sbuf_t *sp = Malloc(sizeof(sbuf_t));
+    pthread_t tid;
+    int i, connfd;
 
-    return 0;
+    sbuf_init(sp, sbufsize);
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, worker, sp);
+
+    while (1) {
+        // Claim a queue slot first so a full queue leaves clients in the backlog
+        sbuf_reserve(sp);
+        accept_client(listenfd, &connfd);
+        sbuf_put(sp, connfd);
+    }
+}
+
+void *signal_thread(void *vargp) {
+    /* Waits for SIGUSR1 and prints the cache counters each time it arrives */
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    while (1) {
+        if (sigwait(&mask, &sig) == 0 && sig == SIGUSR1) {
+            cache_print_stats(stderr);
+            if (upstream_enabled())
+                fprintf(stderr, "upstream: %d idle connections\n", upstream_idle_count());
+            fprintf(stderr, "collapsed: %lu requests followed another's fetch\n",
+                    flight_collapsed());
+            fprintf(stderr, "access log: %lu records dropped\n", accesslog_dropped());
+        }
+    }
+    return NULL;
 }
 
 void *thread(void *vargp){
@@ -78,155 +459,1214 @@ void *thread(void *vargp){
     return NULL;
 }
 
+void *worker(void *vargp) {
+    /* Pool thread: serves connections from the shared queue until exit */
+    sbuf_t *sp = vargp;
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        int connfd = sbuf_remove(sp);
+        doit(connfd);
+        Close(connfd);
+    }
+    return NULL;
+}
+
 void doit(int connfd) {
-    /* Handles the HTTP transaction for a client */
-    int port, end_serverfd;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char endserver_http_header[MAXLINE];
-    char hostname[MAXLINE], path[MAXLINE];
-    rio_t rio, server_rio;
+    /*
+     * Serves the requests of a client connection for as long as the
+     * client keeps it open and a next request arrives within the idle
+     * timeout. Requests the client pipelined are taken in batches: all
+     * of them are started at once and their responses written in order.
+     */
+    rio_t rio;
+    client_req_t *reqs[PIPELINE_MAX] = { NULL };
+    int i, n, closing = 0;
+    binlog_trace_t peer;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
 
+    stats_add(STAT_CONNS_OPENED, 1);
+    memset(&peer, 0, sizeof(peer));
+    if (binlog_enabled() && getpeername(connfd, (SA *)&addr, &addrlen) == 0)
+        binlog_peer(&peer, (SA *)&addr);
     Rio_readinitb(&rio, connfd);
-    if (Rio_readlineb_w(&rio, buf, MAXLINE) == 0)
-        return;  // EOF or error
+    while (!closing && (n = read_pipeline(&rio, reqs, &closing, &peer)) > 0) {
+        if (!serve_pipeline(connfd, reqs, n))
+            break;
+        // Bytes already buffered are the start of the next request
+        if (rio.rio_cnt == 0 && !wait_request(connfd))
+            break;
+    }
+    for (i = 0; i < PIPELINE_MAX; i++)
+        free(reqs[i]);
+    stats_add(STAT_CONNS_CLOSED, 1);
+}
 
-    sscanf(buf, "%s %s %s", method, uri, version); // Parse the request line
+static int wait_request(int connfd) {
+    /* Waits up to the idle timeout for the client to send more; 0 if it does not */
+    struct pollfd pfd = { connfd, POLLIN, 0 };
+    int rc;
 
-    // Check if the method is GET, the only method implemented by this proxy
-    if (strcasecmp(method, "GET")) {
-        printf("Proxy does not implement the method\n");
-        return;
+    while ((rc = poll(&pfd, 1, client_timeout * 1000)) < 0 && errno == EINTR)
+        ;
+    return rc > 0;
+}
+
+static int client_keepalive(http_req_t *req) {
+    /* Returns 1 if the client wants its connection kept open after this request */
+    const http_field_t *f;
+    int keep = http_str_eq(req->version, "HTTP/1.1");
+
+    // Old HTTP/1.0 clients ask a proxy with Proxy-Connection
+    if ((f = http_find_field(req, HDR_CONNECTION)) != NULL ||
+        (f = http_find_field(req, HDR_PROXY_CONNECTION)) != NULL) {
+        if (list_has_token(f->value.p, f->value.len, "close", 5))
+            keep = 0;
+        else if (list_has_token(f->value.p, f->value.len, "keep-alive", 10))
+            keep = 1;
     }
 
-    // Parse the URI to extract hostname, path, and port
-    parse_uri(uri, hostname, path, &port);
+    // A request body is not read, so the next request could not be found
+    if (http_find_field(req, HDR_TRANSFER_ENCODING) != NULL ||
+        ((f = http_find_field(req, HDR_CONTENT_LENGTH)) != NULL && strtol(f->value.p, NULL, 10) != 0))
+        keep = 0;
+    return keep;
+}
 
-    // Build the HTTP header to be sent to the end server
-    build_http_header(endserver_http_header, hostname, path, port, &rio);
+static int read_pipeline(rio_t *rio, client_req_t **reqs, int *closing,
+                         const binlog_trace_t *peer) {
+    /*
+     * Reads the next request, waiting for it if need be, then every
+     * further request the client has already sent in full, up to
+     * PIPELINE_MAX. The rio buffer is not read into again until these
+     * are served, since their views and upstream headers point into it.
+     * Sets *closing if the connection ends after the last of them.
+     * Each request's trace starts from peer, the client's address.
+     * Returns the number of requests, 0 if there is none.
+     */
+    client_req_t *r;
+    int n;
 
-    // Connect to the end server
-    end_serverfd = connect_endServer(hostname, port, endserver_http_header);
-    if (end_serverfd < 0) {
-        fprintf(stderr, "Error: Failed to connect to server %s\n", hostname);
-        return;
+    for (n = 0; n < PIPELINE_MAX; n++) {
+        if (reqs[n] == NULL)
+            reqs[n] = Malloc(sizeof(client_req_t));
+        r = reqs[n];
+        http_req_init(&r->req);
+
+        // Later requests are only taken if they are complete already
+        if (n > 0 && http_parse_request(&r->req, rio->rio_bufptr, rio->rio_cnt) == HTTP_AGAIN)
+            break;
+        if (read_request(rio, &r->req, r->uri, r->hostname, r->path, &r->port) < 0) {
+            *closing = 1;
+            break;
+        }
+        stats_add(STAT_REQUESTS, 1);
+        stats_add(STAT_BYTES_IN, r->req.len);
+        r->trace = *peer;
+        binlog_start(&r->trace);
+        r->keep = client_keepalive(&r->req);
+        r->chunked_ok = http_str_eq(r->req.version, "HTTP/1.1");
+        cache_key(r->key, r->hostname, r->port, r->path);
+        if (!r->keep) {
+            *closing = 1;
+            n++;
+            break;
+        }
+    }
+    return n;
+}
+
+static int serve_pipeline(int connfd, client_req_t **reqs, int n) {
+    /*
+     * Serves n requests read together, writing their responses to the
+     * client in request order. Fresh cache hits and the first request are
+     * served in turn; every other request goes to an idle helper thread
+     * that fetches its response into a pipe right away, and the pipes
+     * are drained to the client one after the other. With no helper
+     * idle, a request is served in turn as well. Only GET is accepted,
+     * so starting requests early never changes what the client gets.
+     * Returns 1 if the connection stays open.
+     */
+    client_req_t *r;
+    int i, fds[2], keep = 1;
+    char buf[RELAY_BUFSIZE];
+    ssize_t m;
+
+    for (i = 0; i < n; i++) {
+        r = reqs[i];
+        r->obj = request_cacheable(&r->req) && !stats_is_request(r->hostname, r->path) ?
+                 cache_lookup(r->key) : NULL;
+        r->outfd = connfd;
+        r->pipefd = -1;
+        if (i > 0 && (r->obj == NULL || cache_freshness(r->obj) == CACHE_STALE) &&
+            open_pipe(fds, PIPELINE_PIPESIZE) == 0) {
+            r->pipefd = fds[0];
+            r->outfd = fds[1];
+            Sem_init(&r->done, 0, 0);
+            if (!helper_run(serve_early, r)) {
+                Close(r->pipefd);
+                Close(r->outfd);
+                r->pipefd = -1;
+                r->outfd = connfd;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        r = reqs[i];
+        if (r->pipefd < 0) {
+            if (keep)
+                serve_request(r);
+            else if (r->obj)
+                cache_release(r->obj);
+            keep = keep && r->keep;
+            continue;
+        }
+        if (keep && splice_drain(r->pipefd, connfd) < 0) {
+            // Copy instead if splice() cannot write to the client
+            m = -1;
+            if (errno == EINVAL)
+                while ((m = read(r->pipefd, buf, sizeof(buf))) > 0 && Rio_writen_w(connfd, buf, m) >= 0)
+                    ;
+            if (m != 0)
+                keep = 0;  // Client gone, or the pipe failed mid-response
+        }
+        // Once the connection is closing, a helper still writing fails and stops
+        Close(r->pipefd);
+        P(&r->done);
+        sem_destroy(&r->done);
+        keep = keep && r->keep;
+    }
+    return keep;
+}
+
+static void serve_early(void *vp) {
+    /* Serves a pipelined request ahead of its turn, into its pipe */
+    client_req_t *r = vp;
+
+    serve_request(r);
+    Close(r->outfd);  // EOF marks the end of the response
+    V(&r->done);
+}
+
+static void helpers_init(int n) {
+    /* Starts up to n helper threads; fewer if the system will not have more */
+    pthread_t tid;
+    int i, rc;
+
+    for (i = 0; i < n; i++) {
+        if ((rc = pthread_create(&tid, NULL, helper_thread, NULL)) != 0) {
+            fprintf(stderr, "Warning: started %d of %d helper threads: %s\n", i, n, strerror(rc));
+            break;
+        }
+    }
+}
+
+static int helper_run(void (*fn)(void *), void *arg) {
+    /* Hands fn(arg) to an idle helper thread; returns 0, doing nothing, if none is idle */
+    int i;
+
+    pthread_mutex_lock(&helpers.lock);
+    if (helpers.idle == 0) {
+        pthread_mutex_unlock(&helpers.lock);
+        return 0;
     }
+    helpers.idle--;
+    i = (helpers.front + helpers.count++) % NHELPERS;
+    helpers.fn[i] = fn;
+    helpers.arg[i] = arg;
+    pthread_cond_signal(&helpers.ready);
+    pthread_mutex_unlock(&helpers.lock);
+    return 1;
+}
 
-    // Initialize robust I/O for the connection with the end server
-    Rio_readinitb(&server_rio, end_serverfd);
+static void *helper_thread(void *vargp) {
+    /* Runs jobs from helper_run() one at a time, forever */
+    void (*fn)(void *);
+    void *arg;
 
-    // Write the built HTTP header to the end server
-    Rio_writen_w(end_serverfd, endserver_http_header, strlen(endserver_http_header));
+    Pthread_detach(pthread_self());
+    pthread_mutex_lock(&helpers.lock);
+    while (1) {
+        helpers.idle++;
+        while (helpers.count == 0)
+            pthread_cond_wait(&helpers.ready, &helpers.lock);
+        fn = helpers.fn[helpers.front];
+        arg = helpers.arg[helpers.front];
+        helpers.front = (helpers.front + 1) % NHELPERS;
+        helpers.count--;
+        pthread_mutex_unlock(&helpers.lock);
 
-    size_t n;
+        fn(arg);
+        pthread_mutex_lock(&helpers.lock);
+    }
+    return NULL;
+}
+
+static cache_obj_t *lookup_fresh(const char *key) {
+    /* Returns a referenced cached copy that needs no revalidation first, or NULL */
+    cache_obj_t *obj = cache_lookup(key);
+
+    if (obj != NULL && cache_freshness(obj) == CACHE_STALE) {
+        cache_release(obj);
+        obj = NULL;
+    }
+    return obj;
+}
+
+static void serve_request(client_req_t *r) {
+    /*
+     * Handles one HTTP transaction, writing the response to r->outfd.
+     * Clears r->keep if the client connection cannot carry another one.
+     */
+    cache_obj_t *stale = NULL;
+    flight_t *flight = NULL;
     size_t total_size = 0;
+    int leader, served = 0;
+
+    if (stats_is_request(r->hostname, r->path)) {
+        send_stats(r);
+        return;
+    }
 
-    // Read the response from the end server and forward it to the client
-    while ((n = Rio_readlineb_w(&server_rio, buf, MAXLINE)) != 0) {
-        if (n < 0) {  // Error reading from server
-            fprintf(stderr, "Error: Failed to read response from server\n");
+    // A stale copy is revalidated, unless it may be served while that runs
+    if (r->obj != NULL) {
+        switch (cache_freshness(r->obj)) {
+        case CACHE_STALE_REFRESH:
+            start_refresh(r, r->obj);
+            r->trace.cache = BINLOG_STALE;
+            break;
+        case CACHE_STALE:
+            stale = r->obj;
+            r->obj = NULL;
+            break;
+        default:
             break;
         }
-        // Write the server's response to the client
-        Rio_writen_w(connfd, buf, n);
-        total_size += n;
     }
 
-    Close(end_serverfd); // Close the connection to the end server
+    // A miss that another request is already fetching follows that fetch.
+    // Requests served ahead of turn may only follow: a leader stuck on a
+    // full pipe would stall the request its client is waiting for.
+    if (r->obj == NULL && cache_enabled() && request_cacheable(&r->req) &&
+        (flight = flight_join(r->key, r->pipefd < 0, &leader)) != NULL) {
+        if (!leader) {
+            served = follow_flight(r, flight, &total_size);
+            flight_leave(flight);
+            flight = NULL;
+            if (served)
+                r->trace.cache = BINLOG_COLLAPSED;
+            // Not shared after all, but it may have been cached meanwhile
+            if (!served)
+                r->obj = lookup_fresh(r->key);
+        } else if ((r->obj = lookup_fresh(r->key)) != NULL) {
+            // Cached between the caller's lookup and the join
+            flight_end(flight, 0);
+            flight = NULL;
+        }
+    }
+
+    // Serve a cached copy without contacting the end server at all, unless
+    // the response was streamed from another request's fetch already
+    if (!served && r->obj != NULL) {
+        if (r->trace.cache != BINLOG_STALE)
+            r->trace.cache = BINLOG_HIT;
+        r->trace.status = http_response_status(r->obj->data, r->obj->size);
+        if (send_cached(r->outfd, r->obj, &r->keep) < 0)
+            r->keep = 0;
+        total_size = r->obj->size;
+        cache_release(r->obj);
+    } else if (!served) {
+        total_size = fetch_response(r, stale, flight);
+    }
 
     // Log the request if any data was transferred
     if(total_size > 0)
     {
-        format_log_entry(hostname, uri, total_size);
-    }    
+        format_log_entry(r->hostname, r->uri, total_size, &r->trace);
+    }
+    else
+    {
+        r->keep = 0;
+    }
+    if (stale)
+        cache_release(stale);
 }
 
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio) {
-    /* Constructs the HTTP header for forwarding the request to the end server */
-    char buf[MAXLINE], request_hdr[MAXLINE], other_hdr[MAXLINE], host_hdr[MAXLINE];
-    sprintf(request_hdr, requestlint_hdr_format, path);
+static size_t fetch_response(client_req_t *r, cache_obj_t *stale, flight_t *flight) {
+    /*
+     * Fetches r's response from the end server and relays it to r->outfd
+     * (to no one if that is -1), filling the cache and the flight, if
+     * any, on the way; the flight has ended on return. Given a stale
+     * copy, the request is made conditional on its validators, unless
+     * the client made it conditional itself. Returns the number of bytes
+     * relayed.
+     */
+    int end_serverfd, reused, reusable, keep = r->keep;
+    http_hdr_t endserver_http_header;
+    rio_t server_rio;
+    cache_fill_t fill;
+    size_t total_size;
 
-    // Read and process each line from the client's HTTP header
-    while (Rio_readlineb_w(client_rio, buf, MAXLINE) > 0) {
-        if (strcmp(buf, endof_hdr) == 0) break;
+    // A 304 to the client's own conditions says nothing about the stale copy
+    if (stale && request_conditional(&r->req))
+        stale = NULL;
+    r->trace.cache = cache_enabled() && request_cacheable(&r->req) ? BINLOG_MISS : BINLOG_BYPASS;
 
-        // Check for host key in the header and copy it to host_hdr
-        if (!strncasecmp(buf, host_key, strlen(host_key))) {
-            strcpy(host_hdr, buf);
+    // Build the header for the end server; with pooling on, ask it to keep the connection
+    if (build_http_header(&endserver_http_header, &r->req, r->hostname, r->path,
+                          upstream_enabled()) < 0 ||
+        (stale && add_validators(&endserver_http_header, stale) < 0)) {
+        if (flight)
+            flight_end(flight, 0);
+        return 0;
+    }
+
+    do {
+        // Connect to the end server, or take an idle connection to it from the pool
+        end_serverfd = connect_endServer(r->hostname, r->port, &reused);
+        if (end_serverfd < 0) {
+            fprintf(stderr, "Error: Failed to connect to server %s\n", r->hostname);
+            stats_add(STAT_CONNECT_FAILURES, 1);
+            if (flight)
+                flight_end(flight, 0);
+            if (!stale || !cache_stale_if_error(stale))
+                return 0;
+            r->trace.cache = BINLOG_STALE;
+            r->trace.status = http_response_status(stale->data, stale->size);
+            return send_stale(r->outfd, stale, &r->keep);
+        }
+        binlog_mark(&r->trace, BINLOG_CONNECTED);
+
+        // Initialize robust I/O for the connection with the end server
+        Rio_readinitb(&server_rio, end_serverfd);
+
+        // Write the built HTTP header to the end server in one writev()
+        reusable = 0;
+        total_size = 0;
+        r->keep = keep;  // A failed attempt on a dropped connection cleared it
+        r->trace.status = 0;
+        cache_fill_init(&fill);
+        if (!request_cacheable(&r->req))
+            cache_fill_abort(&fill);
+        fill.flight = flight;
+        fill.stale = stale;
+        if (http_hdr_write(end_serverfd, &endserver_http_header) >= 0) {
+            // Read the response from the end server and forward it to the client
+            total_size = relay_response(&server_rio, r->outfd, &fill, &reusable, &r->keep,
+                                        r->chunked_ok, &r->trace);
+        }
+        flight = fill.flight;  // Still set if unused, or if it got the whole response
+
+        if (reusable)
+            upstream_checkin(r->hostname, r->port, end_serverfd);
+        else
+            Close(end_serverfd); // Close the connection to the end server
+
+        // A pooled connection the server dropped meanwhile fails before the
+        // client has seen anything; the request is then sent on another one.
+        // Once the server has answered, nothing relayed means the client left.
+    } while (total_size == 0 && reused && r->trace.status == 0);
+    cache_fill_commit(&fill, r->key);
+    if (flight)
+        flight_end(flight, total_size > 0);
+    return total_size;
+}
+
+static void start_refresh(client_req_t *r, cache_obj_t *obj) {
+    /*
+     * Revalidates obj on a helper thread for stale-while-revalidate, with
+     * a copy of r's request, unless a refresh of obj is already running.
+     * With no helper idle the refresh is dropped; a later hit tries again.
+     */
+    client_req_t *job;
+    char *head;
+
+    if (__atomic_exchange_n(&obj->refreshing, 1, __ATOMIC_ACQ_REL))
+        return;
+    job = Malloc(sizeof(client_req_t) + r->req.len);
+    *job = *r;
+    head = (char *)(job + 1);
+    memcpy(head, r->req.base, r->req.len);
+    http_req_init(&job->req);
+    http_parse_request(&job->req, head, r->req.len);
+    cache_retain(obj);
+    job->obj = obj;
+    job->outfd = -1;
+    job->pipefd = -1;
+    job->keep = 0;
+    if (!helper_run(refresh_job, job)) {
+        __atomic_store_n(&obj->refreshing, 0, __ATOMIC_RELEASE);
+        cache_release(obj);
+        free(job);
+    }
+}
+
+static void refresh_job(void *vp) {
+    /* Runs a refresh started by start_refresh(); its response goes to the cache only */
+    client_req_t *job = vp;
+    cache_obj_t *stale = job->obj;
+
+    job->obj = NULL;
+    fetch_response(job, stale, NULL);
+    // A successful refresh replaced the object; a failed one may be tried again
+    __atomic_store_n(&stale->refreshing, 0, __ATOMIC_RELEASE);
+    cache_release(stale);
+    free(job);
+}
+
+static int request_conditional(http_req_t *req) {
+    /* Returns 1 if the client's request carries conditions of its own */
+    int i;
+
+    for (i = 0; i < req->nfields; i++) {
+        switch (req->fields[i].id) {
+        case HDR_IF_NONE_MATCH:
+        case HDR_IF_MODIFIED_SINCE:
+        case HDR_IF_MATCH:
+        case HDR_IF_UNMODIFIED_SINCE:
+            return 1;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+static int add_validators(http_hdr_t *hdr, cache_obj_t *obj) {
+    /*
+     * Makes a header built by build_http_header() conditional on a stored
+     * response's validators: If-None-Match on its ETag, If-Modified-Since
+     * on its Last-Modified, with the values sliced out of obj's data.
+     * Returns -1 if there are too many slices.
+     */
+    const char *p = obj->data, *end = p + obj->size, *nl, *colon;
+    http_field_id_t id;
+    int rc = 0;
+
+    // The empty line comes off the end, and back on after the new fields
+    hdr->iov[hdr->cnt - 1].iov_len -= strlen(endof_hdr);
+    hdr->len -= strlen(endof_hdr);
+    if (hdr->iov[hdr->cnt - 1].iov_len == 0)
+        hdr->cnt--;
+    p = (nl = memchr(p, '\n', end - p)) != NULL ? nl + 1 : end;
+    for (; (nl = memchr(p, '\n', end - p)) != NULL && nl > p + 1; p = nl + 1) {
+        if ((colon = memchr(p, ':', nl - p)) == NULL)
+            continue;
+        if ((id = http_field_id(p, colon - p)) == HDR_ETAG)
+            rc |= hdr_add(hdr, if_none_match_hdr, strlen(if_none_match_hdr));
+        else if (id == HDR_LAST_MODIFIED)
+            rc |= hdr_add(hdr, if_modified_since_hdr, strlen(if_modified_since_hdr));
+        else
             continue;
+        rc |= hdr_add(hdr, colon + 1, nl + 1 - (colon + 1));
+    }
+    rc |= hdr_add(hdr, endof_hdr, strlen(endof_hdr));
+
+    if (rc < 0)
+        fprintf(stderr, "Error: request header has too many fields\n");
+    return rc;
+}
+
+static size_t send_stale(int connfd, cache_obj_t *obj, int *keepalive) {
+    /* Answers with a stored copy in place of the end server's response; returns its size */
+    if (connfd >= 0 && send_cached(connfd, obj, keepalive) < 0)
+        *keepalive = 0;
+    return obj->size;
+}
+
+static void send_stats(client_req_t *r) {
+    /* Answers a request for the stats endpoint; never cached, and not logged */
+    char buf[MAXBUF + MAXLINE];
+    size_t len = stats_response(buf, sizeof(buf), r->path, r->keep);
+
+    if (len == 0 || Rio_writen_w(r->outfd, buf, len) < 0)
+        r->keep = 0;
+}
+
+static int send_cached(int connfd, cache_obj_t *obj, int *keepalive) {
+    /*
+     * Writes a cached response with framing for this client connection:
+     * the stored header minus any hop-by-hop fields, a Content-Length if
+     * the response had none (the size of a stored body is known), its
+     * current Age, and the proxy's Connection field. Returns -1 if the
+     * write failed.
+     */
+    const char *p = obj->data, *end = p + obj->size, *nl, *colon, *body = NULL;
+    char length[64], age[64];
+    int has_length = 0, rc = 0;
+    http_hdr_t h;
+    http_field_id_t id;
+
+    h.cnt = 0;
+    h.len = 0;
+    for (; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+        if (nl == p || (nl == p + 1 && *p == '\r')) {
+            body = nl + 1;
+            break;
+        }
+        if ((colon = memchr(p, ':', nl - p)) != NULL) {
+            id = http_field_id(p, colon - p);
+            if ((http_field_flags[id] & HF_HOP) || id == HDR_AGE)
+                continue;
+            has_length |= id == HDR_CONTENT_LENGTH;
         }
+        rc |= hdr_add(&h, p, nl + 1 - p);
+    }
+    if (body == NULL || rc < 0 || h.cnt > HDR_MAX_IOV - 5) {
+        // Not a header this can take apart; send it as it is and close
+        *keepalive = 0;
+        return Rio_writen_w(connfd, obj->data, obj->size) < 0 ? -1 : 0;
+    }
+    if (!has_length) {
+        sprintf(length, "Content-Length: %zu\r\n", (size_t)(end - body));
+        hdr_add(&h, length, strlen(length));
+    }
+    sprintf(age, "Age: %ld\r\n", cache_age(obj));
+    hdr_add(&h, age, strlen(age));
+    if (*keepalive)
+        hdr_add(&h, keepalive_hdr, strlen(keepalive_hdr));
+    else
+        hdr_add(&h, conn_hdr, strlen(conn_hdr));
+    hdr_add(&h, endof_hdr, strlen(endof_hdr));
+    if (end > body)
+        hdr_add(&h, body, end - body);
+    return http_hdr_write(connfd, &h) < 0 ? -1 : 0;
+}
+
+static int follow_flight(client_req_t *r, flight_t *f, size_t *total) {
+    /*
+     * Streams the response another request is fetching to this client as
+     * its bytes arrive, framed as send_cached() would frame it. A body
+     * without Content-Length is sent in chunks, or to a client that
+     * cannot take them, with a Content-Length once the fetch is done.
+     * Returns 0 without writing anything if the flight ended before it
+     * shared a response, 1 otherwise (*total is then the bytes written).
+     */
+    char hdr[RELAY_HDRSIZE], length[64];
+    const char *p, *nl, *colon;
+    size_t hlen = 0, hend = 0, body = 0, off, n, lp;
+    int has_length = 0, rechunk;
+    http_hdr_t h;
 
-        // Concatenate other relevant headers to other_hdr
-        if (!strncasecmp(buf, connection_key, strlen(connection_key)) &&
-            !strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key)) &&
-            !strncasecmp(buf, user_agent_key, strlen(user_agent_key))) {
-            strcat(other_hdr, buf);
+    // Collect the stored header, up to the empty line that ends it
+    while (body == 0) {
+        if ((n = flight_wait(f, hlen, &p)) == 0 || hlen == sizeof(hdr))
+            return 0;
+        if (n > sizeof(hdr) - hlen)
+            n = sizeof(hdr) - hlen;
+        memcpy(hdr + hlen, p, n);
+        hlen += n;
+        for (p = hdr; (nl = memchr(p, '\n', hdr + hlen - p)) != NULL; p = nl + 1) {
+            if (nl == p || (nl == p + 1 && *p == '\r')) {
+                hend = p - hdr;
+                body = nl + 1 - hdr;
+                break;
+            }
+            if ((colon = memchr(p, ':', nl - p)) != NULL)
+                has_length |= http_field_id(p, colon - p) == HDR_CONTENT_LENGTH;
         }
     }
-    // If no host header was provided, use the hostname from the URI
-    if (strlen(host_hdr) == 0) {
-        sprintf(host_hdr, host_hdr_format, hostname);
+    rechunk = !has_length && r->chunked_ok;
+    r->trace.status = http_response_status(hdr, hlen);
+    binlog_mark(&r->trace, BINLOG_HEADER);
+
+    // Without either framing, the length is only known at the end
+    if (!has_length && !rechunk) {
+        for (off = body; (n = flight_wait(f, off, &p)) > 0; off += n)
+            ;
+        if (!flight_complete(f))
+            return 0;
+        sprintf(length, "Content-Length: %zu\r\n", off - body);
+    }
+
+    h.cnt = 0;
+    h.len = 0;
+    hdr_add(&h, hdr, hend);  // The stored fields, minus the empty line
+    if (rechunk)
+        hdr_add(&h, chunked_hdr, strlen(chunked_hdr));
+    else if (!has_length)
+        hdr_add(&h, length, strlen(length));
+    if (r->keep)
+        hdr_add(&h, keepalive_hdr, strlen(keepalive_hdr));
+    else
+        hdr_add(&h, conn_hdr, strlen(conn_hdr));
+    hdr_add(&h, endof_hdr, strlen(endof_hdr));
+    if (http_hdr_write(r->outfd, &h) < 0) {
+        r->keep = 0;
+        return 1;
+    }
+    *total = h.len;
+
+    for (off = body; (n = flight_wait(f, off, &p)) > 0; off += n) {
+        h.cnt = 0;
+        h.len = 0;
+        if (rechunk) {
+            lp = sprintf(length, "%zx\r\n", n);
+            hdr_add(&h, length, lp);
+        }
+        hdr_add(&h, p, n);
+        if (rechunk)
+            hdr_add(&h, endof_hdr, 2);
+        if (http_hdr_write(r->outfd, &h) < 0) {
+            r->keep = 0;
+            return 1;
+        }
+        *total += h.len;
     }
-    // Construct the complete HTTP header
-    sprintf(http_header, "%s%s%s%s%s%s%s", request_hdr, host_hdr, conn_hdr, prox_hdr, user_agent_hdr, other_hdr, endof_hdr);
+
+    // A body cut short leaves the client no way to tell but the close
+    if (!flight_complete(f))
+        r->keep = 0;
+    else if (rechunk && Rio_writen_w(r->outfd, "0\r\n\r\n", 5) < 0)
+        r->keep = 0;
+    else if (rechunk)
+        *total += 5;
+    return 1;
 }
 
-inline int connect_endServer(char *hostname,int port,char *http_header) {
-    /* Function to establish a connection with the end server */
-    char portStr[100];
-    sprintf(portStr,"%d",port);
-    return Open_clientfd(hostname, portStr);
+static int list_has_token(const char *p, size_t len, const char *tok, size_t toklen) {
+    /* Returns 1 if the comma-separated list p[0..len) contains tok (any case) */
+    const char *end = p + len, *t;
+
+    for (; p < end; p++) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        for (t = p; p < end && *p != ',' && *p != ' ' && *p != '\t' && *p != ';' &&
+                    *p != '\r' && *p != '\n'; p++)
+            ;
+        if ((size_t)(p - t) == toklen && !strncasecmp(t, tok, toklen))
+            return 1;
+        while (p < end && *p != ',')
+            p++;  // Skip parameters after ';'
+    }
+    return 0;
 }
 
-void parse_uri(char *uri, char *hostname, char *path, int *port) {
-    /* Parses the URI to obtain hostname, path, and port number */
-    *port = 80; // Default port number is 80
-    char *pos = strstr(uri, "//");
+static int relay_write(int *connfd, const char *p, size_t n, cache_fill_t *fill) {
+    /*
+     * Writes relayed bytes to the client. While other requests follow the
+     * fetch, a client that went away is only dropped (*connfd becomes -1)
+     * so that the rest still reaches them. Returns -1 when relaying
+     * should stop.
+     */
+    if (*connfd < 0)
+        return 0;
+    if (Rio_writen_w(*connfd, (void *)p, n) < 0) {
+        if (fill->flight == NULL)
+            return -1;
+        *connfd = -1;
+    }
+    return 0;
+}
 
-    pos = pos != NULL ? pos + 2 : uri;
+static long relay_bytes(rio_t *server_rio, int *connfd, cache_fill_t *fill, long len) {
+    /*
+     * Relays len body bytes, or everything up to EOF if len < 0: first
+     * whatever rio already buffered and then straight from the socket.
+     * Bytes that are not being cached are spliced from socket to socket
+     * through a pipe and never enter user space. Returns the number of
+     * bytes relayed, which is short if either side failed.
+     */
+    char buf[RELAY_BUFSIZE];
+    ssize_t n;
+    long total = 0, remaining = len;
 
-    char *pos2 = strstr(pos, ":");
-    if (pos2 != NULL) {
-        // If a port is specified in the URI
-        *pos2 = '\0';
-        sscanf(pos, "%s", hostname);
-        sscanf(pos2 + 1, "%d%s", port, path);
-    } else {
-        // If no port is specified in the URI
-        pos2 = strstr(pos, "/");
-        if (pos2 != NULL) {
-            *pos2 = '\0';
-            sscanf(pos, "%s", hostname);
-            *pos2 = '/';
-            sscanf(pos2, "%s", path);
-        } else {
-            sscanf(pos, "%s", hostname);
+    while (remaining != 0) {
+        char *p = buf;
+        size_t want = sizeof(buf);
+
+        if (remaining > 0 && (size_t)remaining < want)
+            want = remaining;
+        if (server_rio->rio_cnt > 0) {
+            // Hand over the rest of rio's buffer without copying it
+            n = server_rio->rio_cnt < (int)want ? server_rio->rio_cnt : (ssize_t)want;
+            p = server_rio->rio_bufptr;
+            server_rio->rio_bufptr += n;
+            server_rio->rio_cnt -= n;
+        } else if (!fill->ok && fill->flight == NULL && *connfd >= 0 && splice_ok) {
+            // Nothing to tee into the cache, so let the kernel move the rest
+            if ((n = splice_relay(server_rio->rio_fd, *connfd, remaining)) >= 0) {
+                total += n;
+                break;
+            }
+            splice_ok = 0;  // Not supported here; copy from now on
+            continue;
+        } else if ((n = read(server_rio->rio_fd, buf, want)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error: Failed to read response from server: %s\n", strerror(errno));
+            break;
+        } else if (n == 0) {
+            break;
+        }
+        if (relay_write(connfd, p, n, fill) < 0)
+            break;  // Client went away
+        cache_fill_append(fill, p, n);
+        total += n;
+        if (remaining > 0)
+            remaining -= n;
+    }
+    return total;
+}
+
+static int relay_chunked(rio_t *server_rio, int *connfd, cache_fill_t *fill, size_t *total,
+                         int rechunk) {
+    /*
+     * Relays a chunked body. The cache gets the bytes without the chunk
+     * framing; so does the client unless rechunk is set, in which case it
+     * gets them in chunks of its own (the server's chunk extensions and
+     * trailer fields are dropped either way). Returns 1 if the body ended
+     * with its last chunk, 0 otherwise.
+     */
+    char line[MAXLINE], *end;
+    long size, n;
+
+    while (1) {
+        // Chunk size in hex, possibly followed by ";extensions"
+        if (Rio_readlineb_w(server_rio, line, MAXLINE) <= 0)
+            return 0;
+        size = strtol(line, &end, 16);
+        if (end == line || size < 0)
+            return 0;
+        if (rechunk) {
+            n = sprintf(line, "%lx\r\n", size);
+            if (size == 0)
+                n += sprintf(line + n, "\r\n");
+            if (relay_write(connfd, line, n, fill) < 0)
+                return 0;
+            *total += n;
+        }
+        if (size == 0)
+            break;
+        cache_fill_expect(fill, size);
+        n = relay_bytes(server_rio, connfd, fill, size);
+        *total += n;
+        if (n != size)
+            return 0;
+        if (Rio_readlineb_w(server_rio, line, MAXLINE) <= 0 ||
+            (strcmp(line, "\r\n") && strcmp(line, "\n")))
+            return 0;
+        if (rechunk && relay_write(connfd, endof_hdr, 2, fill) < 0)
+            return 0;
+        *total += rechunk ? 2 : 0;
+    }
+    do {
+        if (Rio_readlineb_w(server_rio, line, MAXLINE) <= 0)
+            return 0;
+    } while (strcmp(line, "\r\n") && strcmp(line, "\n"));
+    return 1;
+}
+
+size_t relay_response(rio_t *server_rio, int connfd, cache_fill_t *fill, int *reusable,
+                      int *keepalive, int chunked_ok, binlog_trace_t *trace) {
+    /*
+     * Forwards the end server's response to the client. The header is
+     * collected first, hop-by-hop fields left out, and sent in one write
+     * with the proxy's own framing fields; then the body follows. It
+     * ends after Content-Length bytes, with the last chunk of a chunked
+     * one, or at EOF when there is neither.
+     *
+     * *keepalive says whether the client wants its connection kept; it is
+     * cleared when this response can only be delimited by closing it: a
+     * body that runs to EOF, or a chunked one for a client that cannot
+     * take chunks (chunked_ok is 0). *reusable is set when the server may
+     * keep its connection open and the response was read exactly to its
+     * end, so that the connection can carry another request. Returns the
+     * number of bytes written to the client; connfd -1 means there is
+     * no client, for a refresh that only feeds the cache.
+     *
+     * A fill with a stale copy was sent with that copy's validators: a
+     * 304 refreshes the copy and the client gets it instead, and so it
+     * does in place of a server error that stale-if-error covers.
+     *
+     * A fill with a flight shares the response with the requests that
+     * follow it when the cache would keep it, and otherwise ends the
+     * flight before the header is in. A flight whose body ended early is
+     * ended here too; one that got all of it is left to the caller, who
+     * ends it once the response is in the cache.
+     *
+     * The status, the end of the header and a stale copy's fate go to
+     * trace, for the binary log.
+     */
+    char hdr[RELAY_HDRSIZE];
+    ssize_t n;
+    size_t hlen = 0, total = 0;
+    long length = -1, relayed;  // Content-Length; -1 reads to EOF
+    size_t length_off = 0, length_len = 0;
+    int status = 0, minor = 0, chunked = 0, server_keep = 0, framed, complete;
+    int client = connfd;
+    cache_obj_t *obj;
+    http_hdr_t h;
+
+    *reusable = 0;
+    while (hlen + MAXLINE <= sizeof(hdr) &&
+           (n = Rio_readlineb_w(server_rio, hdr + hlen, MAXLINE)) > 0) {
+        char *line = hdr + hlen, *colon;
+
+        if (hlen == 0) {
+            sscanf(line, "HTTP/1.%d %d", &minor, &status);
+            server_keep = minor >= 1;  // The HTTP/1.1 default
+        } else if (!strcmp(line, "\r\n") || !strcmp(line, "\n")) {
+            break;
+        } else if ((colon = memchr(line, ':', n)) != NULL) {
+            http_field_id_t id = http_field_id(line, colon - line);
+            size_t vlen = n - (colon + 1 - line);
+
+            if (id == HDR_CONTENT_LENGTH) {
+                length = atol(colon + 1);
+                length_off = hlen;
+                length_len = n;
+            } else if (id == HDR_TRANSFER_ENCODING) {
+                chunked = list_has_token(colon + 1, vlen, "chunked", 7);
+            } else if (id == HDR_CONNECTION && list_has_token(colon + 1, vlen, "close", 5)) {
+                server_keep = 0;
+            } else if (id == HDR_CONNECTION && list_has_token(colon + 1, vlen, "keep-alive", 10)) {
+                server_keep = 1;
+            } else if (id == HDR_CACHE_CONTROL && (list_has_token(colon + 1, vlen, "no-store", 8) ||
+                                                   list_has_token(colon + 1, vlen, "private", 7))) {
+                cache_fill_abort(fill);
+            }
+            if (http_field_flags[id] & HF_NOSTORE)
+                cache_fill_abort(fill);  // Lets the body be spliced
+            if (http_field_flags[id] & HF_HOP)
+                continue;  // About the server's connection, not the client's
+        }
+        hlen += n;
+    }
+    if (hlen + MAXLINE > sizeof(hdr) || n <= 0) {
+        // Header cut short or too large; the client cannot be answered properly
+        fprintf(stderr, "Error: bad response header from server\n");
+        *keepalive = 0;
+        return 0;
+    }
+    trace->status = status;
+    binlog_mark(trace, BINLOG_HEADER);
+
+    // A 304 to the proxy's own revalidation makes the stale copy good again, with
+    // the 304's fields; after a server error, stale-if-error may let it stand in
+    if (fill->stale && (status == 304 || (status >= 500 && cache_stale_if_error(fill->stale)))) {
+        obj = status == 304 ? cache_refresh(fill->stale, hdr, hlen) : NULL;
+        *reusable = status == 304 && server_keep && server_rio->rio_cnt == 0;
+        if (fill->flight) {
+            flight_end(fill->flight, 0);  // Followers find the refreshed copy instead
+            fill->flight = NULL;
+        }
+        cache_fill_abort(fill);
+        trace->cache = status == 304 ? BINLOG_REVALIDATED : BINLOG_STALE;
+        trace->status = http_response_status(fill->stale->data, fill->stale->size);
+        total = send_stale(connfd, obj ? obj : fill->stale, keepalive);
+        if (obj)
+            cache_release(obj);
+        return total;
+    }
+
+    // These never carry a body, whatever the headers say
+    if (status / 100 == 1 || status == 204 || status == 304) {
+        chunked = 0;
+        length = 0;
+    } else if (chunked && length_len) {
+        // Chunking wins over a Content-Length, which must not be passed on
+        memmove(hdr + length_off, hdr + length_off + length_len, hlen - length_off - length_len);
+        hlen -= length_len;
+        length = -1;
+    }
+    framed = length >= 0 || (chunked && chunked_ok);
+    *keepalive = *keepalive && framed;
+
+    // Followers only get what the cache would keep; the rest fetch for themselves
+    if (fill->flight && (status != 200 || !fill->ok || length > (long)flight_max_size())) {
+        flight_end(fill->flight, 0);
+        fill->flight = NULL;
+    }
+
+    // The cache keeps the response as the server framed it, without the proxy's fields
+    cache_fill_append(fill, hdr, hlen);
+    cache_fill_append(fill, endof_hdr, strlen(endof_hdr));
+    h.cnt = 0;
+    h.len = 0;
+    hdr_add(&h, hdr, hlen);
+    if (chunked && chunked_ok)
+        hdr_add(&h, chunked_hdr, strlen(chunked_hdr));
+    if (*keepalive)
+        hdr_add(&h, keepalive_hdr, strlen(keepalive_hdr));
+    else
+        hdr_add(&h, conn_hdr, strlen(conn_hdr));
+    hdr_add(&h, endof_hdr, strlen(endof_hdr));
+    if (client >= 0 && http_hdr_write(client, &h) < 0) {
+        *keepalive = 0;
+        if (fill->flight == NULL) {
+            cache_fill_abort(fill);
+            return 0;
         }
+        client = -1;  // Still fetched for the followers
+    }
+    total = h.len;
+
+    if (chunked) {
+        complete = relay_chunked(server_rio, &client, fill, &total, chunked_ok);
+    } else {
+        if (length > 0)
+            cache_fill_expect(fill, length);
+        relayed = relay_bytes(server_rio, &client, fill, length);
+        total += relayed;
+        complete = length >= 0 && relayed == length;
+    }
+
+    // Never cache a body that ended early, and never leave its client waiting for the rest
+    if (!complete && (chunked || length > 0)) {
+        cache_fill_abort(fill);
+        *keepalive = 0;
+    }
+
+    // A body without framing is complete at EOF
+    if (fill->flight && !complete && (chunked || length > 0)) {
+        flight_end(fill->flight, 0);
+        fill->flight = NULL;
+    }
+    if (client < 0)
+        *keepalive = 0;
+
+    // An interim 1xx response is followed by the real one, which was not read
+    *reusable = server_keep && complete && status / 100 != 1 && server_rio->rio_cnt == 0;
+    if (status / 100 == 1)
+        *keepalive = 0;
+    return total;
+}
+
+static int read_more(rio_t *rp) {
+    /*
+     * Reads more request bytes into rp's buffer behind the unread ones,
+     * sliding those to the front first. Returns the number of bytes
+     * read, 0 on EOF, or -1 on error or when the buffer is full.
+     */
+    ssize_t n;
+
+    if (rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == RIO_BUFSIZE) {
+        fprintf(stderr, "Error: request header too large\n");
+        return -1;
+    }
+    while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt)) < 0)
+        if (errno != EINTR)
+            return -1;
+    rp->rio_cnt += n;
+    return n;
+}
+
+int read_request(rio_t *client_rio, http_req_t *req, char *uri, char *hostname, char *path,
+                 int *port) {
+    /*
+     * Parses the client request where it sits in the rio buffer, reading
+     * more from the socket until the header is complete. req may already
+     * hold the parse of the buffered bytes: the non-blocking engines feed
+     * it as data arrives.
+     */
+    http_status_t st;
+    const http_field_t *host_field;
+    http_str_t host, port_str;
+
+    while ((st = http_parse_request(req, client_rio->rio_bufptr, client_rio->rio_cnt)) == HTTP_AGAIN)
+        if (read_more(client_rio) <= 0)
+            return -1;  // EOF or error
+    if (st == HTTP_ERROR) {
+        fprintf(stderr, "Error: malformed request\n");
+        return -1;
+    }
+    client_rio->rio_bufptr += req->len;
+    client_rio->rio_cnt -= req->len;
+
+    // Check if the method is GET, the only method implemented by this proxy
+    if (!http_str_eq(req->method, "GET")) {
+        printf("Proxy does not implement the method\n");
+        return -1;
+    }
+
+    // The target names the server, or else the Host field does
+    host = req->host;
+    port_str = req->port;
+    if (host.len == 0 && (host_field = http_find_field(req, HDR_HOST)) != NULL)
+        http_split_host(host_field->value, &host, &port_str);
+    if (host.len == 0 || host.len >= MAXLINE || req->path.len >= MAXLINE) {
+        fprintf(stderr, "Error: bad request target\n");
+        return -1;
     }
+    if ((*port = port_str.len ? http_str_port(port_str) : 80) < 0) {
+        fprintf(stderr, "Error: bad port in request\n");
+        return -1;
+    }
+    http_str_copy(uri, MAXLINE, req->target);
+    http_str_copy(hostname, MAXLINE, host);
+    if (req->path.len)
+        http_str_copy(path, MAXLINE, req->path);
+    else
+        strcpy(path, "/");
+    return 0;
+}
+
+static int hdr_add(http_hdr_t *hdr, const char *p, size_t n) {
+    /* Appends a slice, extending the last one when p directly follows it */
+    struct iovec *last = hdr->cnt ? &hdr->iov[hdr->cnt - 1] : NULL;
+
+    if (last && (char *)last->iov_base + last->iov_len == p) {
+        last->iov_len += n;
+    } else {
+        if (hdr->cnt == HDR_MAX_IOV)
+            return -1;
+        hdr->iov[hdr->cnt].iov_base = (void *)p;
+        hdr->iov[hdr->cnt].iov_len = n;
+        hdr->cnt++;
+    }
+    hdr->len += n;
+    return 0;
 }
 
-void format_log_entry(char *browser_ip, char *url, size_t size) {
-    /* Formats and logs each HTTP request */
-    time_t now;
-    char time_str[MAXLINE];
+static int connection_option(http_req_t *req, http_str_t name) {
+    /* Returns 1 if the client's Connection field lists name as hop-by-hop */
+    const http_field_t *f = http_find_field(req, HDR_CONNECTION);
+
+    return f && list_has_token(f->value.p, f->value.len, name.p, name.len);
+}
 
-    // Get the current time
-    time(&now);
+int build_http_header(http_hdr_t *hdr, http_req_t *req, char *hostname, char *path,
+                      int keepalive) {
+    /*
+     * Constructs the HTTP header for forwarding the request to the end
+     * server, as slices of the client's header lines and constant blocks.
+     * Nothing is copied. Which client fields go through is decided by
+     * their class in HTTP_FIELDS: hop-by-hop fields and the ones the
+     * proxy sets itself are dropped, and so are fields the client's
+     * Connection field names. With keepalive the request is HTTP/1.1 and
+     * asks the server to keep the connection for the pool; otherwise it
+     * is HTTP/1.0 with Connection: close. Returns -1 if there are too
+     * many slices.
+     */
+    const char *suffix = keepalive ? request_hdr_suffix11 : request_hdr_suffix;
+    const http_field_t *f, *host_field = http_find_field(req, HDR_HOST);
+    int i, rc = 0;
 
-    // Format the time into a readable string
-    strftime(time_str, MAXLINE, "%a %d %b %Y %H:%M:%S %Z", localtime(&now));
+    hdr->cnt = 0;
+    hdr->len = 0;
+    rc |= hdr_add(hdr, request_hdr_prefix, strlen(request_hdr_prefix));
+    rc |= hdr_add(hdr, path, strlen(path));
+    rc |= hdr_add(hdr, suffix, strlen(suffix));
 
-    // Prepare the log entry
-    char log_entry[MAXLINE];
-    sprintf(log_entry, "%s: %s %s %zu\n", time_str, browser_ip, url, size);
+    // If no host header was provided, use the hostname from the URI
+    if (host_field) {
+        rc |= hdr_add(hdr, host_field->line.p, host_field->line.len);
+    } else {
+        rc |= hdr_add(hdr, host_hdr_prefix, strlen(host_hdr_prefix));
+        rc |= hdr_add(hdr, hostname, strlen(hostname));
+        rc |= hdr_add(hdr, endof_hdr, strlen(endof_hdr));
+    }
+    if (keepalive) {
+        rc |= hdr_add(hdr, keepalive_hdr, strlen(keepalive_hdr));
+    } else {
+        rc |= hdr_add(hdr, conn_hdr, strlen(conn_hdr));
+        rc |= hdr_add(hdr, prox_hdr, strlen(prox_hdr));
+    }
+    rc |= hdr_add(hdr, user_agent_hdr, strlen(user_agent_hdr));
 
-    // Write the log entry to a file
-    pthread_mutex_lock(&mutex); // Lock mutex for thread-safe file access
-    FILE *log_file = fopen("proxy.log", "a");
-    if (log_file != NULL) {
-        fputs(log_entry, log_file);
-        fclose(log_file);
+    // Pass the other end-to-end fields through as they are
+    for (i = 0; i < req->nfields; i++) {
+        f = &req->fields[i];
+        if (http_field_flags[f->id] & (HF_HOP | HF_OWN))
+            continue;
+        if (f->id == HDR_OTHER && connection_option(req, f->name))
+            continue;
+        rc |= hdr_add(hdr, f->line.p, f->line.len);
     }
-    pthread_mutex_unlock(&mutex); // Unlock mutex
+    rc |= hdr_add(hdr, endof_hdr, strlen(endof_hdr));
+
+    if (rc < 0)
+        fprintf(stderr, "Error: request header has too many fields\n");
+    return rc;
+}
+
+int request_cacheable(http_req_t *req) {
+    /* Returns 0 if a field of the request rules out the shared cache */
+    return !(req->flags & HF_PRIVATE);
+}
+
+ssize_t http_hdr_write(int fd, http_hdr_t *hdr) {
+    /* Sends the whole header with writev(), resuming after short writes */
+    struct iovec iov[HDR_MAX_IOV], *v = iov;
+    int cnt = hdr->cnt;
+    size_t left = hdr->len;
+    ssize_t n;
+
+    memcpy(iov, hdr->iov, cnt * sizeof(struct iovec));
+    while (left > 0) {
+        if ((n = writev(fd, v, cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Rio_writen error: %s\n", strerror(errno));
+            return -1;
+        }
+        left -= n;
+        // Skip the slices that went out and trim the one cut short
+        while (cnt > 0 && (size_t)n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return hdr->len;
+}
+
+ssize_t http_hdr_copy(http_hdr_t *hdr, char *dst, size_t size) {
+    /* Gathers the header into dst for engines that send from their own buffer */
+    int i;
+
+    if (hdr->len > size)
+        return -1;
+    for (i = 0; i < hdr->cnt; i++) {
+        memcpy(dst, hdr->iov[i].iov_base, hdr->iov[i].iov_len);
+        dst += hdr->iov[i].iov_len;
+    }
+    return hdr->len;
+}
+
+int connect_endServer(char *hostname, int port, int *reused) {
+    /*
+     * Establishes a connection with the end server: an idle pooled one
+     * if there is one (*reused is then set), else a new one to whichever
+     * of its addresses answers first. Returns -1 if the server cannot be
+     * reached.
+     */
+    struct addrinfo *addrs;
+    int fd, rc, family;
+
+    if ((fd = upstream_checkout(hostname, port)) >= 0) {
+        *reused = 1;
+        return fd;
+    }
+    *reused = 0;
+    if ((rc = dns_getaddrinfo(hostname, port, &addrs)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%d): %s\n", hostname, port, gai_strerror(rc));
+        return -1;
+    }
+    if ((fd = connect_addrs(addrs, &family)) >= 0)
+        dns_prefer(hostname, port, family);
+    dns_freeaddrinfo(addrs);
+    return fd;
+}
+
+void format_log_entry(char *browser_ip, char *url, size_t size, binlog_trace_t *trace) {
+    /* Logs each HTTP request: as a binary record with -L, else for the log writer thread */
+    stats_add(STAT_BYTES_OUT, size);
+    if (binlog_enabled())
+        binlog_write(trace, url, size);
+    else
+        accesslog_record(browser_ip, url, size);
 }
 
 /* Wrapper functions for robust I/O operations */
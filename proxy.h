@@ -0,0 +1,48 @@
+/*
+ * proxy.h - Declarations shared by proxy.c and its connection engines
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "http.h"
+#include "binlog.h"
+#include <sys/uio.h>
+
+/* Most slices an upstream request header may be made of */
+#define HDR_MAX_IOV 64
+
+/*
+ * Upstream request header as a list of slices: constant blocks, the
+ * path and hostname strings, and lines of the client's own header still
+ * sitting in its rio buffer. Valid until that buffer is read again.
+ */
+typedef struct {
+    struct iovec iov[HDR_MAX_IOV];
+    int cnt;
+    size_t len;                 /* Total bytes over all slices */
+} http_hdr_t;
+
+/* Request handling (proxy.c) */
+void doit(int connfd);
+int read_request(rio_t *client_rio, http_req_t *req, char *uri, char *hostname, char *path,
+                 int *port);
+int build_http_header(http_hdr_t *hdr, http_req_t *req, char *hostname, char *path,
+                      int keepalive);
+int request_cacheable(http_req_t *req);
+ssize_t http_hdr_write(int fd, http_hdr_t *hdr);
+ssize_t http_hdr_copy(http_hdr_t *hdr, char *dst, size_t size);
+void format_log_entry(char *browser_ip, char *url, size_t size, binlog_trace_t *trace);
+int connect_endServer(char *hostname, int port, int *reused);
+
+ssize_t Rio_readn_w(int fd, void *usrbuf, size_t n);
+ssize_t Rio_readlineb_w(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_writen_w(int fd, void *usrbuf, size_t n);
+
+/* Non-blocking epoll engine (event.c) */
+void event_run(int listenfd, int nloops);
+
+/* io_uring engine (uring.c); returns -1 if the kernel cannot run it */
+int uring_run(int listenfd, int nrings);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,645 @@
+/*
+ * resolver.c - Asynchronous DNS stub resolver
+ *
+ * getaddrinfo() keeps its caller waiting for as long as the name servers
+ * take to answer, which on a bad day is many seconds of a worker doing
+ * nothing. This is a minimal stub resolver instead: one thread sends A
+ * and AAAA queries over UDP to the name servers, matches the replies to
+ * queries by id, and calls each query's callback once its answer is
+ * complete. Callers never wait on the network.
+ *
+ * Servers and search rules come from /etc/resolv.conf (nameserver,
+ * search or domain, and the ndots, timeout and attempts options), or
+ * the proxy's -N option names a single server. A try sends the query
+ * to one server and waits `timeout' seconds for it; then the next
+ * server gets a try, and a query that `attempts' rounds over all of
+ * them leave unanswered fails with EAI_AGAIN. A server that refuses the
+ * datagram (ICMP port unreachable) is given up on at once.
+ *
+ * Names in /etc/hosts are answered from there, as with the usual
+ * "files dns" order, without a query. As with AI_ADDRCONFIG, AAAA
+ * records are only asked for when the host has an IPv6 address other
+ * than loopback (and A records when it has an IPv4 one).
+ *
+ * Only the answer section of a reply is read. A and AAAA records in it
+ * are taken whatever their owner name, which follows the CNAME chain a
+ * recursive server returns with them. There is no EDNS and no TCP
+ * retry, so a truncated reply is used as far as it goes.
+ */
+#include "csapp.h"
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <poll.h>
+#include "resolver.h"
+
+#define RESOLV_MAXNS 3              /* Name servers used, as in glibc */
+#define RESOLV_MAXSEARCH 6          /* Search domains used */
+#define RESOLV_NAMELEN 256
+#define RESOLV_BUFSIZE 4096         /* Largest reply read */
+
+#define T_A 1
+#define T_AAAA 28
+#define T_CNAME 5
+#define C_IN 1
+#define R_NOERROR 0
+#define R_NXDOMAIN 3
+
+/* A query in flight; [0] is its A half and [1] its AAAA half */
+typedef struct rquery {
+    char host[RESOLV_NAMELEN];      /* As asked for */
+    int port;
+    char name[RESOLV_NAMELEN];      /* Candidate being tried (host or host.search) */
+    int cand;                       /* Its index, see candidate() */
+    int id[2];                      /* Outstanding query ids, -1 when answered */
+    int ns, tries;                  /* Server of the current try, tries so far */
+    long deadline;                  /* End of the current try, in ms */
+    int naddrs[2];
+    struct sockaddr_storage addrs[2][RESOLVER_MAX_ADDRS];
+    int ttl;
+    resolver_cb_t cb;
+    void *arg;
+    struct rquery *next;
+} rquery_t;
+
+/* An /etc/hosts line's address, once per name */
+typedef struct {
+    char *name;
+    struct sockaddr_storage addr;
+} hosts_entry_t;
+
+static struct sockaddr_storage servers[RESOLV_MAXNS];
+static int nservers, socks[RESOLV_MAXNS];
+static char *search[RESOLV_MAXSEARCH];
+static int nsearch;
+static int ndots = 1, timeout = 5, attempts = 2;
+static int want[2] = {1, 1};        /* Ask for A, AAAA */
+
+static hosts_entry_t *hosts;
+static int nhosts;
+
+/* Queries from resolver_query() not yet seen by the resolver thread */
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+static rquery_t *submitted;
+static int wakefd[2];
+
+/* Owned by the resolver thread */
+static rquery_t *active;
+static rquery_t *byid[65536];
+static unsigned int seed;
+
+static void *resolver_thread(void *vargp);
+
+static long now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static int clamp(int v, int lo, int hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static int parse_addr(const char *s, int port, struct sockaddr_storage *ss) {
+    /* Fills *ss from an IPv4 or IPv6 literal; returns 0 if s is neither */
+    struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    char buf[INET6_ADDRSTRLEN + 16], *p;
+
+    memset(ss, 0, sizeof(*ss));
+    if (inet_pton(AF_INET, s, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        return 1;
+    }
+    // Zone ids ("fe80::1%eth0") are dropped
+    snprintf(buf, sizeof(buf), "%s", s);
+    if ((p = strchr(buf, '%')) != NULL)
+        *p = '\0';
+    if (inet_pton(AF_INET6, buf, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        return 1;
+    }
+    return 0;
+}
+
+static int add_server(const char *spec) {
+    /* Adds a name server given as addr, addr:port, or [addr6]:port */
+    char buf[RESOLV_NAMELEN], *colon, *addr = buf;
+    int port = 53;
+
+    if (nservers == RESOLV_MAXNS)
+        return 1;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    if (buf[0] == '[' && (colon = strchr(buf, ']')) != NULL) {
+        *colon++ = '\0';
+        addr = buf + 1;
+        if (*colon == ':')
+            port = atoi(colon + 1);
+    } else if ((colon = strchr(buf, ':')) != NULL && strchr(colon + 1, ':') == NULL) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    if (port <= 0 || port > 65535 || !parse_addr(addr, port, &servers[nservers]))
+        return 0;
+    nservers++;
+    return 1;
+}
+
+static void read_resolv_conf(void) {
+    /* Takes name servers, search domains and options from /etc/resolv.conf */
+    char line[MAXLINE], *save, *key, *tok;
+    FILE *fp = fopen("/etc/resolv.conf", "r");
+
+    if (fp == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        if ((key = strtok_r(line, " \t\r\n", &save)) == NULL || *key == '#' || *key == ';')
+            continue;
+        if (!strcmp(key, "nameserver")) {
+            if ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+                add_server(tok);
+        } else if (!strcmp(key, "search") || !strcmp(key, "domain")) {
+            // The last search or domain line wins
+            while (nsearch > 0)
+                free(search[--nsearch]);
+            while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL && nsearch < RESOLV_MAXSEARCH)
+                if (strcmp(tok, "."))
+                    search[nsearch++] = strdup(tok);
+        } else if (!strcmp(key, "options")) {
+            while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+                if (!strncmp(tok, "ndots:", 6))
+                    ndots = clamp(atoi(tok + 6), 0, 15);
+                else if (!strncmp(tok, "timeout:", 8))
+                    timeout = clamp(atoi(tok + 8), 1, 30);
+                else if (!strncmp(tok, "attempts:", 9))
+                    attempts = clamp(atoi(tok + 9), 1, 5);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static void read_hosts(void) {
+    /* Loads /etc/hosts; lookups in it are linear, it is normally a few lines */
+    char line[MAXLINE], *save, *tok, *hash;
+    struct sockaddr_storage addr;
+    int cap = 0;
+    FILE *fp = fopen("/etc/hosts", "r");
+
+    if (fp == NULL)
+        return;
+    while (fgets(line, sizeof(line), fp)) {
+        if ((hash = strchr(line, '#')) != NULL)
+            *hash = '\0';
+        if ((tok = strtok_r(line, " \t\r\n", &save)) == NULL || !parse_addr(tok, 0, &addr))
+            continue;
+        while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (nhosts == cap) {
+                cap = cap ? 2 * cap : 16;
+                hosts = Realloc(hosts, cap * sizeof(hosts_entry_t));
+            }
+            hosts[nhosts].name = strdup(tok);
+            hosts[nhosts].addr = addr;
+            nhosts++;
+        }
+    }
+    fclose(fp);
+}
+
+static void check_families(void) {
+    /* Asks only for the address types this host can reach, like AI_ADDRCONFIG */
+    struct ifaddrs *list, *ifa;
+    int have[2] = {0, 0};
+
+    if (getifaddrs(&list) < 0)
+        return;
+    for (ifa = list; ifa; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == NULL || (ifa->ifa_flags & IFF_LOOPBACK))
+            continue;
+        if (ifa->ifa_addr->sa_family == AF_INET)
+            have[0] = 1;
+        else if (ifa->ifa_addr->sa_family == AF_INET6)
+            have[1] = 1;
+    }
+    freeifaddrs(list);
+    // With nothing but loopback configured, ask for both
+    if (have[0] || have[1]) {
+        want[0] = have[0];
+        want[1] = have[1];
+    }
+}
+
+void resolver_init(const char *nameserver) {
+    /* Reads the resolver configuration and starts the resolver thread */
+    pthread_t tid;
+    int i;
+
+    if (nameserver != NULL) {
+        if (!add_server(nameserver))
+            app_error("bad name server address");
+    } else {
+        read_resolv_conf();
+    }
+    if (nservers == 0)
+        add_server("127.0.0.1");
+    read_hosts();
+    check_families();
+
+    for (i = 0; i < nservers; i++) {
+        socklen_t len = servers[i].ss_family == AF_INET ? sizeof(struct sockaddr_in)
+                                                       : sizeof(struct sockaddr_in6);
+
+        // Connected, so the kernel drops datagrams from anywhere else
+        socks[i] = Socket(servers[i].ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (connect(socks[i], (struct sockaddr *)&servers[i], len) < 0)
+            unix_error("resolver connect error");
+    }
+    if (pipe(wakefd) < 0)
+        unix_error("resolver pipe error");
+    for (i = 0; i < 2; i++)
+        fcntl(wakefd[i], F_SETFL, O_NONBLOCK);
+    seed = (unsigned int)(now_ms() ^ getpid());
+    Pthread_create(&tid, NULL, resolver_thread, NULL);
+}
+
+int resolver_hosts(const char *host, int port, struct sockaddr_storage *addrs, int max) {
+    /* Copies host's /etc/hosts addresses, with port, into addrs; returns how many */
+    size_t len = strlen(host);
+    int i, n = 0;
+
+    // "name." is the same name
+    if (len > 0 && host[len - 1] == '.')
+        len--;
+    for (i = 0; i < nhosts && n < max; i++) {
+        if (strlen(hosts[i].name) != len || strncasecmp(hosts[i].name, host, len))
+            continue;
+        addrs[n] = hosts[i].addr;
+        if (addrs[n].ss_family == AF_INET)
+            ((struct sockaddr_in *)&addrs[n])->sin_port = htons(port);
+        else
+            ((struct sockaddr_in6 *)&addrs[n])->sin6_port = htons(port);
+        n++;
+    }
+    return n;
+}
+
+void resolver_query(const char *host, int port, resolver_cb_t cb, void *arg) {
+    /* Starts resolving host; cb is called from the resolver thread when done */
+    rquery_t *q = Calloc(1, sizeof(rquery_t));
+    char c = 0;
+
+    // Overlong names are left empty, which fails the query
+    if (strlen(host) < sizeof(q->host))
+        strcpy(q->host, host);
+    q->port = port;
+    q->cb = cb;
+    q->arg = arg;
+
+    pthread_mutex_lock(&submit_lock);
+    q->next = submitted;
+    submitted = q;
+    pthread_mutex_unlock(&submit_lock);
+    if (write(wakefd[1], &c, 1) < 0 && errno != EAGAIN)
+        unix_error("resolver wake error");
+}
+
+static int valid_name(const char *name) {
+    /* Checks that name fits a query: labels of 1-63 bytes, 253 bytes in all */
+    const char *p = name, *dot;
+
+    if (*name == '\0' || strlen(name) > 253)
+        return 0;
+    while (*p) {
+        dot = strchr(p, '.');
+        if (dot == NULL)
+            return strlen(p) <= 63;
+        if (dot == p || dot - p > 63)
+            return 0;
+        p = dot + 1;
+    }
+    return 1;
+}
+
+static int candidate(rquery_t *q) {
+    /*
+     * Sets q->name to the q->cand'th name to try, skipping invalid ones:
+     * a name with at least ndots dots is tried as is first, any other
+     * after the search domains. Returns 0 when none are left.
+     */
+    const char *host = q->host;
+    size_t len = strlen(host);
+    int dots = 0, i;
+
+    for (i = 0; host[i]; i++)
+        dots += host[i] == '.';
+    for (; ; q->cand++) {
+        if (len > 0 && host[len - 1] == '.') {
+            // Fully qualified: only itself
+            if (q->cand > 0 || len >= sizeof(q->name))
+                return 0;
+            memcpy(q->name, host, len - 1);
+            q->name[len - 1] = '\0';
+        } else if (q->cand > nsearch) {
+            return 0;
+        } else if (dots >= ndots ? q->cand == 0 : q->cand == nsearch) {
+            snprintf(q->name, sizeof(q->name), "%s", host);
+        } else {
+            i = dots >= ndots ? q->cand - 1 : q->cand;
+            if (len + 1 + strlen(search[i]) >= sizeof(q->name))
+                continue;
+            memcpy(q->name, host, len);
+            q->name[len] = '.';
+            strcpy(q->name + len + 1, search[i]);
+        }
+        if (valid_name(q->name))
+            return 1;
+    }
+}
+
+static int build_query(unsigned char *buf, int id, const char *name, int type) {
+    /* Writes a recursive query for name into buf; returns its length */
+    unsigned char *p = buf + 12;
+    const char *label = name;
+    size_t len;
+
+    memset(buf, 0, 12);
+    buf[0] = id >> 8;
+    buf[1] = id;
+    buf[2] = 0x01;                  /* RD */
+    buf[5] = 1;                     /* QDCOUNT */
+    while (*label) {
+        len = strcspn(label, ".");
+        *p++ = len;
+        memcpy(p, label, len);
+        p += len;
+        label += len;
+        if (*label == '.')
+            label++;
+    }
+    *p++ = 0;
+    *p++ = type >> 8;
+    *p++ = type;
+    *p++ = 0;
+    *p++ = C_IN;
+    return p - buf;
+}
+
+static void release_ids(rquery_t *q) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (q->id[i] >= 0 && byid[q->id[i]] == q)
+            byid[q->id[i]] = NULL;
+        q->id[i] = -1;
+    }
+}
+
+static void send_try(rquery_t *q, int *pending, long t) {
+    /* Sends the unanswered halves of q to server q->ns under fresh ids */
+    unsigned char buf[RESOLV_NAMELEN + 16];
+    int i, id, len, refused = 0;
+
+    for (i = 0; i < 2; i++) {
+        if (!pending[i])
+            continue;
+        do
+            id = rand_r(&seed) & 0xffff;
+        while (byid[id] != NULL);
+        byid[id] = q;
+        q->id[i] = id;
+        len = build_query(buf, id, q->name, i ? T_AAAA : T_A);
+        // A failed send is treated like a lost datagram, unless it reports
+        // the refusal of an earlier one
+        if (send(socks[q->ns], buf, len, 0) < 0 && errno == ECONNREFUSED)
+            refused = 1;
+    }
+    q->deadline = refused ? t : t + timeout * 1000L;
+}
+
+static void complete(rquery_t *q, int err) {
+    /* Unlinks q, reports its result and frees it; AAAA answers are listed first */
+    struct sockaddr_storage addrs[RESOLVER_MAX_ADDRS];
+    rquery_t **pp;
+    int i, j, n = 0;
+
+    for (pp = &active; *pp != q; pp = &(*pp)->next)
+        ;
+    *pp = q->next;
+    release_ids(q);
+    for (i = 1; i >= 0; i--)
+        for (j = 0; j < q->naddrs[i] && n < RESOLVER_MAX_ADDRS; j++)
+            addrs[n++] = q->addrs[i][j];
+    if (err == 0 && n == 0)
+        err = EAI_NONAME;
+    q->cb(q->arg, err, addrs, err ? 0 : n, q->ttl);
+    free(q);
+}
+
+static void start_name(rquery_t *q, long t) {
+    /* Sends the first try for the current candidate name */
+    int pending[2] = {want[0], want[1]};
+
+    release_ids(q);
+    q->ns = 0;
+    q->tries = 0;
+    send_try(q, pending, t);
+}
+
+static void next_try(rquery_t *q, long t) {
+    /* Moves q on to the next server, or fails it once all tries are spent */
+    int pending[2] = {q->id[0] >= 0, q->id[1] >= 0};
+
+    // Out of tries: whichever half did answer is better than nothing
+    if (++q->tries >= attempts * nservers) {
+        complete(q, q->naddrs[0] + q->naddrs[1] > 0 ? 0 : EAI_AGAIN);
+        return;
+    }
+    release_ids(q);
+    q->ns = (q->ns + 1) % nservers;
+    send_try(q, pending, t);
+}
+
+static int skip_name(const unsigned char *buf, int len, int off) {
+    /* Returns the offset just past the (possibly compressed) name at off, or -1 */
+    while (off < len) {
+        int c = buf[off];
+
+        if (c == 0)
+            return off + 1;
+        if ((c & 0xc0) == 0xc0)
+            return off + 2 <= len ? off + 2 : -1;
+        if (c & 0xc0)
+            return -1;
+        off += c + 1;
+    }
+    return -1;
+}
+
+static int same_name(const unsigned char *buf, int len, int off, const char *name) {
+    /* Compares the uncompressed question name at off with name */
+    const char *p = name;
+    int c;
+
+    while (off < len && (c = buf[off++]) != 0) {
+        if (c > 63 || off + c > len)
+            return 0;
+        if (p != name && *p++ != '.')
+            return 0;
+        if (strncasecmp((const char *)buf + off, p, c) || (p[c] != '.' && p[c] != '\0'))
+            return 0;
+        p += c;
+        off += c;
+    }
+    return *p == '\0';
+}
+
+static void handle_reply(const unsigned char *buf, int len, long t) {
+    /* Matches a datagram to its query and records the answer */
+    int id, half, rcode, qd, an, off, type, class, rdlen, ttl, i;
+    rquery_t *q;
+
+    if (len < 12 || !(buf[2] & 0x80))
+        return;
+    id = buf[0] << 8 | buf[1];
+    if ((q = byid[id]) == NULL)
+        return;
+    half = q->id[1] == id;
+    qd = buf[4] << 8 | buf[5];
+    an = buf[6] << 8 | buf[7];
+    rcode = buf[3] & 0x0f;
+    // The question must be echoed back: a stray reply with a reused id is not ours
+    if (qd != 1 || !same_name(buf, len, 12, q->name) || (off = skip_name(buf, len, 12)) < 0 ||
+        off + 4 > len || (buf[off] << 8 | buf[off + 1]) != (half ? T_AAAA : T_A))
+        return;
+    off += 4;
+
+    if (rcode != R_NOERROR && rcode != R_NXDOMAIN) {
+        // SERVFAIL, REFUSED and the like: the next server may do better
+        next_try(q, t);
+        return;
+    }
+    for (i = 0; i < an && rcode == R_NOERROR; i++) {
+        if ((off = skip_name(buf, len, off)) < 0 || off + 10 > len)
+            break;
+        type = buf[off] << 8 | buf[off + 1];
+        class = buf[off + 2] << 8 | buf[off + 3];
+        ttl = (int)((unsigned)buf[off + 4] << 24 | buf[off + 5] << 16 | buf[off + 6] << 8 |
+                    buf[off + 7]);
+        rdlen = buf[off + 8] << 8 | buf[off + 9];
+        off += 10;
+        if (off + rdlen > len)
+            break;
+        if (class == C_IN && (type == T_A || type == T_AAAA || type == T_CNAME) &&
+            ttl >= 0 && (q->ttl < 0 || ttl < q->ttl))
+            q->ttl = ttl;
+        if (class == C_IN && q->naddrs[half] < RESOLVER_MAX_ADDRS &&
+            ((type == T_A && rdlen == 4 && !half) || (type == T_AAAA && rdlen == 16 && half))) {
+            struct sockaddr_storage *ss = &q->addrs[half][q->naddrs[half]++];
+
+            memset(ss, 0, sizeof(*ss));
+            if (half) {
+                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = htons(q->port);
+                memcpy(&sin6->sin6_addr, buf + off, 16);
+            } else {
+                struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+                sin->sin_family = AF_INET;
+                sin->sin_port = htons(q->port);
+                memcpy(&sin->sin_addr, buf + off, 4);
+            }
+        }
+        off += rdlen;
+    }
+    byid[id] = NULL;
+    q->id[half] = -1;
+    if (q->id[!half] >= 0)
+        return;
+
+    // Both halves are in: done, or on to the next search domain
+    if (q->naddrs[0] + q->naddrs[1] > 0) {
+        complete(q, 0);
+    } else {
+        q->cand++;
+        if (candidate(q))
+            start_name(q, t);
+        else
+            complete(q, EAI_NONAME);
+    }
+}
+
+static void *resolver_thread(void *vargp) {
+    /* Sends queries, reads replies and enforces timeouts, all on one poll() loop */
+    struct pollfd pfd[RESOLV_MAXNS + 1];
+    unsigned char buf[RESOLV_BUFSIZE];
+    rquery_t *q, *next;
+    long t, wait;
+    int i, n;
+
+    Pthread_detach(pthread_self());
+    pfd[0].fd = wakefd[0];
+    for (i = 0; i < nservers; i++)
+        pfd[i + 1].fd = socks[i];
+    for (i = 0; i <= nservers; i++)
+        pfd[i].events = POLLIN;
+
+    while (1) {
+        t = now_ms();
+        wait = -1;
+        for (q = active; q; q = q->next)
+            if (wait < 0 || q->deadline - t < wait)
+                wait = q->deadline > t ? q->deadline - t : 0;
+        if (poll(pfd, nservers + 1, (int)wait) < 0 && errno != EINTR)
+            unix_error("resolver poll error");
+        t = now_ms();
+
+        // New queries
+        if (pfd[0].revents) {
+            while (read(wakefd[0], buf, sizeof(buf)) > 0)
+                ;
+            pthread_mutex_lock(&submit_lock);
+            q = submitted;
+            submitted = NULL;
+            pthread_mutex_unlock(&submit_lock);
+            for (; q; q = next) {
+                next = q->next;
+                q->id[0] = q->id[1] = -1;
+                q->ttl = -1;
+                q->next = active;
+                active = q;
+                if (candidate(q))
+                    start_name(q, t);
+                else
+                    complete(q, EAI_NONAME);
+            }
+        }
+
+        // Replies
+        for (i = 0; i < nservers; i++) {
+            if (!pfd[i + 1].revents)
+                continue;
+            while ((n = recv(socks[i], buf, sizeof(buf), 0)) >= 0 || errno == ECONNREFUSED) {
+                if (n >= 0) {
+                    handle_reply(buf, n, t);
+                    continue;
+                }
+                // Nobody listens there: move its queries along now
+                for (q = active; q; q = q->next)
+                    if (q->ns == i)
+                        q->deadline = t;
+            }
+        }
+
+        // Timeouts
+        for (q = active; q; q = next) {
+            next = q->next;
+            if (q->deadline <= t)
+                next_try(q, t);
+        }
+    }
+    return NULL;
+}
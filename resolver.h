@@ -0,0 +1,22 @@
+/*
+ * resolver.h - Asynchronous DNS stub resolver
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <sys/socket.h>
+
+#define RESOLVER_MAX_ADDRS 8        /* Addresses reported per answer */
+
+/*
+ * Called once per query, from the resolver thread: err is 0 or an EAI_*
+ * code, ttl the smallest TTL among the answers (-1 if unknown).
+ */
+typedef void (*resolver_cb_t)(void *arg, int err, const struct sockaddr_storage *addrs,
+                              int naddrs, int ttl);
+
+void resolver_init(const char *nameserver);
+int resolver_hosts(const char *host, int port, struct sockaddr_storage *addrs, int max);
+void resolver_query(const char *host, int port, resolver_cb_t cb, void *arg);
+
+#endif /* __RESOLVER_H__ */
@@ -0,0 +1,60 @@
+/*
+ * sbuf.c - Bounded producer/consumer queue of connected descriptors
+ *
+ * This is the CS:APP sbuf package, with sbuf_insert() split into
+ * sbuf_reserve() and sbuf_put() so that a producer can wait for a free
+ * slot *before* it accepts a connection. While every slot is taken,
+ * pending connections stay in the kernel's listen backlog.
+ */
+#include "sbuf.h"
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;                       /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+}
+
+/* Clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+}
+
+/* Insert item onto the rear of shared buffer sp */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    sbuf_reserve(sp);
+    sbuf_put(sp, item);
+}
+
+/* Wait for an available slot; must be followed by exactly one sbuf_put */
+void sbuf_reserve(sbuf_t *sp)
+{
+    P(&sp->slots);
+}
+
+/* Insert item into a slot previously claimed with sbuf_reserve */
+void sbuf_put(sbuf_t *sp, int item)
+{
+    P(&sp->mutex);                          /* Lock the buffer */
+    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+}
+
+/* Remove and return the first item from buffer sp */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+    P(&sp->items);                          /* Wait for available item */
+    P(&sp->mutex);                          /* Lock the buffer */
+    item = sp->buf[(++sp->front)%(sp->n)];  /* Remove the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->slots);                          /* Announce available slot */
+    return item;
+}
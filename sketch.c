@@ -0,0 +1,133 @@
+/*
+ * sketch.c - Approximate access frequencies for cache admission
+ *
+ * A count-min sketch of 4 rows of small saturating counters, fronted
+ * by a "doorkeeper" bloom filter. The first access to a key only sets
+ * its doorkeeper bits, so one-hit wonders never reach the counters.
+ * After a fixed number of recorded accesses every counter is halved and
+ * the doorkeeper cleared, so that popularity fades with time (TinyLFU
+ * aging).
+ *
+ * Accesses are recorded from the cache hit path. To keep hits from
+ * writing shared lines on every request, each thread buffers key
+ * hashes locally and only applies them to the sketch in batches.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sketch.h"
+
+#define ROWS 4
+#define COUNTER_MAX 15          /* Counters saturate like 4-bit ones */
+#define DOOR_PROBES 2
+#define BATCH 16                /* Accesses buffered per thread */
+
+static uint8_t *counters;       /* ROWS x width */
+static uint64_t *door;          /* Doorkeeper bits */
+static size_t width;            /* Power of two */
+static size_t door_bits;        /* Power of two */
+static unsigned long additions, sample_size;
+static int resetting;
+
+static __thread unsigned long pending[BATCH];
+static __thread int npending;
+
+static inline size_t slot(unsigned long h, int i, size_t n) {
+    /* Independent-ish index for probe i out of n (a power of two) */
+    uint64_t x = (h + (uint64_t)i * 0x9E3779B97F4A7C15ULL) * 0xff51afd7ed558ccdULL;
+    return (x ^ (x >> 29)) & (n - 1);
+}
+
+void sketch_init(size_t w) {
+    /* Sizes the sketch to w counters per row, rounded up to a power of two */
+    for (width = 64; width < w; width <<= 1)
+        ;
+    door_bits = width * 4;
+    counters = calloc(ROWS * width, 1);
+    door = calloc(door_bits / 64, sizeof(uint64_t));
+    sample_size = 10 * width;
+}
+
+static int door_test_and_set(unsigned long h) {
+    /* Sets h's doorkeeper bits; returns 1 if they were all set already */
+    int i, seen = 1;
+
+    for (i = 0; i < DOOR_PROBES; i++) {
+        size_t b = slot(h, ROWS + i, door_bits);
+        uint64_t mask = 1ULL << (b & 63);
+        if (!(__atomic_fetch_or(&door[b >> 6], mask, __ATOMIC_RELAXED) & mask))
+            seen = 0;
+    }
+    return seen;
+}
+
+static int door_test(unsigned long h) {
+    int i;
+
+    for (i = 0; i < DOOR_PROBES; i++) {
+        size_t b = slot(h, ROWS + i, door_bits);
+        if (!(__atomic_load_n(&door[b >> 6], __ATOMIC_RELAXED) & (1ULL << (b & 63))))
+            return 0;
+    }
+    return 1;
+}
+
+static void reset(void) {
+    /* Halves every counter and clears the doorkeeper */
+    size_t i;
+
+    for (i = 0; i < ROWS * width; i++)
+        __atomic_store_n(&counters[i], __atomic_load_n(&counters[i], __ATOMIC_RELAXED) >> 1,
+                         __ATOMIC_RELAXED);
+    for (i = 0; i < door_bits / 64; i++)
+        __atomic_store_n(&door[i], 0, __ATOMIC_RELAXED);
+}
+
+static void increment(unsigned long h) {
+    /* Applies one access to the doorkeeper and the counters */
+    int i;
+
+    if (door_test_and_set(h)) {
+        for (i = 0; i < ROWS; i++) {
+            uint8_t *c = &counters[i * width + slot(h, i, width)];
+            if (__atomic_load_n(c, __ATOMIC_RELAXED) < COUNTER_MAX)
+                __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Only one thread ages the sketch; the others keep counting meanwhile
+    if (__atomic_add_fetch(&additions, 1, __ATOMIC_RELAXED) >= sample_size &&
+        !__atomic_exchange_n(&resetting, 1, __ATOMIC_ACQUIRE)) {
+        reset();
+        __atomic_store_n(&additions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&resetting, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void sketch_record(unsigned long h) {
+    /* Notes one access to the key with hash h */
+    pending[npending++] = h;
+    if (npending == BATCH)
+        sketch_flush();
+}
+
+void sketch_flush(void) {
+    /* Applies this thread's buffered accesses */
+    int i;
+
+    for (i = 0; i < npending; i++)
+        increment(pending[i]);
+    npending = 0;
+}
+
+unsigned sketch_estimate(unsigned long h) {
+    /* Returns the estimated recent access count of the key with hash h */
+    unsigned i, c, min = COUNTER_MAX;
+
+    for (i = 0; i < ROWS; i++) {
+        c = __atomic_load_n(&counters[i * width + slot(h, i, width)], __ATOMIC_RELAXED);
+        if (c < min)
+            min = c;
+    }
+    return min + door_test(h);
+}
@@ -0,0 +1,14 @@
+/*
+ * sketch.h - Approximate access frequencies for cache admission
+ */
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include <stddef.h>
+
+void sketch_init(size_t width);
+void sketch_record(unsigned long h);
+void sketch_flush(void);
+unsigned sketch_estimate(unsigned long h);
+
+#endif /* __SKETCH_H__ */
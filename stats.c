@@ -0,0 +1,187 @@
+/*
+ * stats.c - Per-thread counters and the built-in stats endpoint
+ *
+ * Counting requests and bytes must not cost the hot path a shared cache
+ * line. Every thread that counts gets a block of counters of its own,
+ * aligned and padded to whole cache lines, and adds to it without any
+ * atomic read-modify-write: it is the only writer. Blocks are summed
+ * only when someone asks for the totals. Like the access log's rings,
+ * blocks are never freed; a thread that exits hands its block, counts
+ * and all, to the next thread that needs one, so the sums stay right.
+ *
+ * stats_response() renders the counters, together with the ones the
+ * cache, the upstream pool, collapsed forwarding and the access log
+ * keep, as a complete HTTP response for the STATS_HOST endpoint: JSON
+ * by default, Prometheus text with ?format=prometheus.
+ */
+#include "csapp.h"
+#include "stats.h"
+#include "cache.h"
+#include "upstream.h"
+#include "flight.h"
+#include "accesslog.h"
+
+typedef struct stats_block {
+    uint64_t v[STAT_NCOUNTERS];
+    int owned;                      /* A live thread counts into it */
+    struct stats_block *next;       /* All blocks, newest first */
+} __attribute__((aligned(64))) stats_block_t;
+
+/* One line of the endpoint's output */
+typedef struct {
+    const char *name;
+    const char *help;
+    int gauge;                      /* Prometheus type: gauge, else counter */
+    uint64_t value;
+} metric_t;
+
+static stats_block_t *blocks;
+static pthread_key_t block_key;
+static pthread_once_t block_once = PTHREAD_ONCE_INIT;
+static __thread stats_block_t *my_block;
+
+static void release_block(void *vp) {
+    /* Hands an exiting thread's counters to the next thread that counts */
+    stats_block_t *b = vp;
+
+    __atomic_store_n(&b->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void make_block_key(void) {
+    pthread_key_create(&block_key, release_block);
+}
+
+static stats_block_t *claim_block(void) {
+    /* Takes over a block that no live thread owns, or adds a new one */
+    stats_block_t *b;
+    int unowned;
+
+    pthread_once(&block_once, make_block_key);
+    for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        unowned = 0;
+        if (__atomic_compare_exchange_n(&b->owned, &unowned, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (b == NULL) {
+        if (posix_memalign((void **)&b, 64, sizeof(stats_block_t)) != 0)
+            unix_error("posix_memalign error");
+        memset(b, 0, sizeof(stats_block_t));
+        b->owned = 1;
+        b->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&blocks, &b->next, b, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(block_key, b);
+    return b;
+}
+
+void stats_add(stat_counter_t c, uint64_t n) {
+    /* Adds n to this thread's counter c */
+    stats_block_t *b = my_block;
+
+    if (b == NULL)
+        b = my_block = claim_block();
+    // The only writer: a relaxed store keeps readers from seeing a torn value
+    __atomic_store_n(&b->v[c], b->v[c] + n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_sum(stat_counter_t c) {
+    /* Returns counter c summed over every thread's block */
+    stats_block_t *b;
+    uint64_t sum = 0;
+
+    for (b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b; b = b->next)
+        sum += __atomic_load_n(&b->v[c], __ATOMIC_RELAXED);
+    return sum;
+}
+
+static size_t stats_format(char *buf, size_t size, int prometheus) {
+    /*
+     * Writes every metric to buf, as a JSON object or in the Prometheus
+     * text format, and returns the length (cut short at size - 1)
+     */
+    cache_stats_t cs;
+    uint64_t opened, closed;
+    size_t len = 0, n, i;
+    metric_t m[13];
+
+    // Closed is read before opened, so every connection counted closed is counted
+    // opened too; the clamp covers counters summed while they move
+    closed = stats_sum(STAT_CONNS_CLOSED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    opened = stats_sum(STAT_CONNS_OPENED);
+    cache_get_stats(&cs);
+    n = 0;
+    m[n++] = (metric_t){ "connections_active", "Client connections open now", 1,
+                         opened > closed ? opened - closed : 0 };
+    m[n++] = (metric_t){ "connections_total", "Client connections accepted", 0, opened };
+    m[n++] = (metric_t){ "requests_total", "Requests read from clients", 0,
+                         stats_sum(STAT_REQUESTS) };
+    m[n++] = (metric_t){ "bytes_in_total", "Request bytes read from clients", 0,
+                         stats_sum(STAT_BYTES_IN) };
+    m[n++] = (metric_t){ "bytes_out_total", "Response bytes written to clients", 0,
+                         stats_sum(STAT_BYTES_OUT) };
+    m[n++] = (metric_t){ "cache_hits_total", "Cache lookups that found an object", 0, cs.hits };
+    m[n++] = (metric_t){ "cache_misses_total", "Cache lookups that did not", 0, cs.misses };
+    m[n++] = (metric_t){ "cache_evictions_total", "Objects evicted from the memory cache", 0,
+                         cs.evictions };
+    m[n++] = (metric_t){ "cache_bytes", "Bytes of objects in the memory cache", 1,
+                         cs.window_bytes + cs.main_bytes };
+    m[n++] = (metric_t){ "upstream_connect_failures_total",
+                         "Requests whose end server could not be reached", 0,
+                         stats_sum(STAT_CONNECT_FAILURES) };
+    m[n++] = (metric_t){ "upstream_idle_connections", "Idle end server connections pooled", 1,
+                         upstream_idle_count() };
+    m[n++] = (metric_t){ "collapsed_requests_total", "Requests that followed another's fetch",
+                         0, flight_collapsed() };
+    m[n++] = (metric_t){ "accesslog_dropped_total", "Access log records dropped", 0,
+                         accesslog_dropped() };
+
+    buf[0] = '\0';
+    if (!prometheus)
+        len += snprintf(buf + len, size - len, "{");
+    for (i = 0; i < n && len < size; i++) {
+        if (prometheus)
+            len += snprintf(buf + len, size - len,
+                            "# HELP proxy_%s %s\n# TYPE proxy_%s %s\nproxy_%s %llu\n",
+                            m[i].name, m[i].help, m[i].name, m[i].gauge ? "gauge" : "counter",
+                            m[i].name, (unsigned long long)m[i].value);
+        else
+            len += snprintf(buf + len, size - len, "%s\n  \"%s\": %llu", i ? "," : "",
+                            m[i].name, (unsigned long long)m[i].value);
+    }
+    if (!prometheus && len < size)
+        len += snprintf(buf + len, size - len, "\n}\n");
+    return len < size ? len : size - 1;
+}
+
+int stats_is_request(const char *host, const char *path) {
+    /* Returns 1 if a request for host and path asks for the stats endpoint */
+    size_t n = strlen(STATS_PATH);
+
+    return !strcasecmp(host, STATS_HOST) && !strncmp(path, STATS_PATH, n) &&
+           (path[n] == '\0' || path[n] == '?');
+}
+
+size_t stats_response(char *buf, size_t size, const char *path, int keepalive) {
+    /*
+     * Writes the whole response to a stats request for path into buf and
+     * returns its length; the connection is kept open after it if
+     * keepalive is set
+     */
+    int prometheus = strstr(path, "format=prometheus") != NULL;
+    char body[MAXBUF];
+    size_t len = stats_format(body, sizeof(body), prometheus);
+    int n;
+
+    n = snprintf(buf, size, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                 "Content-Length: %zu\r\nCache-Control: no-store\r\nConnection: %s\r\n\r\n",
+                 prometheus ? "text/plain; version=0.0.4" : "application/json", len,
+                 keepalive ? "keep-alive" : "close");
+    if (n < 0 || (size_t)n + len > size)
+        return 0;
+    memcpy(buf + n, body, len);
+    return n + len;
+}
@@ -0,0 +1,28 @@
+/*
+ * stats.h - Per-thread counters and the built-in stats endpoint
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_HOST "proxy.local"    /* Requests for http://STATS_HOST/STATS_PATH */
+#define STATS_PATH "/__stats"       /* are answered by the proxy itself */
+
+typedef enum {
+    STAT_CONNS_OPENED,              /* Client connections accepted */
+    STAT_CONNS_CLOSED,
+    STAT_REQUESTS,
+    STAT_BYTES_IN,                  /* Request bytes read from clients */
+    STAT_BYTES_OUT,                 /* Response bytes written to clients */
+    STAT_CONNECT_FAILURES,          /* Requests that could not reach their end server */
+    STAT_NCOUNTERS
+} stat_counter_t;
+
+void stats_add(stat_counter_t c, uint64_t n);
+uint64_t stats_sum(stat_counter_t c);
+int stats_is_request(const char *host, const char *path);
+size_t stats_response(char *buf, size_t size, const char *path, int keepalive);
+
+#endif /* __STATS_H__ */
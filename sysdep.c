@@ -0,0 +1,176 @@
+/*
+ * sysdep.c - Linux-specific helpers for the proxy
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sysdep.h"
+
+#define SPLICE_CHUNK (256 * 1024)   /* Bytes moved per splice() call */
+
+/* Per-thread pipe for splice_relay, closed when its thread exits */
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_once = PTHREAD_ONCE_INIT;
+
+/* Return the number of CPUs this process may run on (at least 1) */
+int ncpus(void)
+{
+    cpu_set_t set;
+    long n;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+        return CPU_COUNT(&set);
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/*
+ * pin_thread - Bind the calling thread to the idx'th CPU the process is
+ *     allowed to use (modulo their number). Threads it creates afterwards
+ *     inherit the same affinity. Returns 0 or an errno value.
+ */
+int pin_thread(int idx)
+{
+    cpu_set_t allowed, set;
+    int cpu, seen = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return errno;
+    if (CPU_COUNT(&allowed) == 0)
+        return EINVAL;
+    idx %= CPU_COUNT(&allowed);
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        if (seen++ == idx)
+            break;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void pipe_destroy(void *vp)
+{
+    int *fds = vp;
+
+    close(fds[0]);
+    close(fds[1]);
+    free(fds);
+}
+
+static void pipe_key_init(void)
+{
+    pthread_key_create(&pipe_key, pipe_destroy);
+}
+
+/* Return the calling thread's relay pipe, creating it on first use */
+static int *thread_pipe(void)
+{
+    int *fds;
+
+    pthread_once(&pipe_once, pipe_key_init);
+    if ((fds = pthread_getspecific(pipe_key)) != NULL)
+        return fds;
+    if ((fds = malloc(2 * sizeof(int))) == NULL)
+        return NULL;
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        free(fds);
+        return NULL;
+    }
+    // A bigger pipe means fewer round trips; the default 64 KiB still works
+    fcntl(fds[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+    pthread_setspecific(pipe_key, fds);
+    return fds;
+}
+
+/*
+ * splice_relay - Move len bytes (or everything up to EOF if len < 0)
+ *     from infd to outfd through the calling thread's pipe, without
+ *     copying them to user space. Returns the number of bytes delivered
+ *     to outfd, which is short if either side fails or infd hits EOF,
+ *     or -1 if splice() is not usable for these descriptors and nothing
+ *     was moved, in which case the caller should copy instead.
+ */
+long splice_relay(int infd, int outfd, long len)
+{
+    int *fds, more;
+    long total = 0;
+    ssize_t n, m;
+
+    if ((fds = thread_pipe()) == NULL)
+        return -1;
+
+    while (len != 0) {
+        n = splice(infd, NULL, fds[1], NULL,
+                   len < 0 || len > SPLICE_CHUNK ? SPLICE_CHUNK : (size_t)len,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS))
+            return -1;
+        if (n <= 0)
+            break;
+        if (len > 0)
+            len -= n;
+
+        // Only hint that more follows when it does: the socket would hold
+        // back the response's last partial segment until a timer fires
+        more = len > 0 ? SPLICE_F_MORE : 0;
+
+        // Drain the pipe completely so the next relay starts empty
+        while (n > 0) {
+            m = splice(fds[0], NULL, outfd, NULL, n, SPLICE_F_MOVE | more);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0) {
+                // Bytes are stuck in the pipe; replace it
+                pthread_setspecific(pipe_key, NULL);
+                pipe_destroy(fds);
+                return total;
+            }
+            n -= m;
+            total += m;
+        }
+    }
+    return total;
+}
+
+/*
+ * open_pipe - Create a pipe and try to give it room for size bytes (the
+ *     kernel caps what unprivileged processes get). Returns 0 or -1.
+ */
+int open_pipe(int fds[2], int size)
+{
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    fcntl(fds[1], F_SETPIPE_SZ, size);
+    return 0;
+}
+
+/*
+ * splice_drain - Move everything written to pipe pipefd, up to its EOF,
+ *     on to outfd without copying it to user space. Returns the number
+ *     of bytes moved, or -1 on error; errno is EINVAL if splice() cannot
+ *     write to outfd, and then nothing was moved and the caller should
+ *     copy instead.
+ */
+long splice_drain(int pipefd, int outfd)
+{
+    long total = 0;
+    ssize_t n;
+
+    while ((n = splice(pipefd, NULL, outfd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        total += n;
+    }
+    return total;
+}
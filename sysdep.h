@@ -0,0 +1,17 @@
+/*
+ * sysdep.h - Linux-specific helpers for the proxy
+ *
+ * These need _GNU_SOURCE, whose <netdb.h> declares a gai_error() that
+ * clashes with the one in csapp.h, so they live in their own unit that
+ * does not include csapp.h.
+ */
+#ifndef __SYSDEP_H__
+#define __SYSDEP_H__
+
+int ncpus(void);
+int pin_thread(int idx);
+long splice_relay(int infd, int outfd, long len);
+int open_pipe(int fds[2], int size);
+long splice_drain(int pipefd, int outfd);
+
+#endif /* __SYSDEP_H__ */
@@ -0,0 +1,214 @@
+/*
+ * upstream.c - Pool of idle keep-alive connections to end servers
+ *
+ * With pooling on, the blocking engines talk HTTP/1.1 to end servers
+ * and, once a response has been read to its exact end, hand the
+ * connection back here instead of closing it. The next request for the
+ * same (host, port) checks it out and skips the DNS lookup and the TCP
+ * handshake.
+ *
+ * Each origin keeps at most max_idle connections, most recently used
+ * on top: the top one is the least likely to have been closed by the
+ * server. A connection that has sat idle for idle_timeout seconds is
+ * closed, either when it is found on checkout or by a reaper thread
+ * that sweeps the pools once a second. On checkout, a non-blocking
+ * MSG_PEEK tells whether the server has closed the socket (or sent
+ * something unasked) while it was idle; such connections are dropped.
+ *
+ * Origins hash into a fixed array of buckets, each with its own mutex.
+ */
+#include "csapp.h"
+#include "upstream.h"
+
+#define UPSTREAM_BUCKETS 256
+
+typedef struct {
+    int fd;
+    time_t since;               /* When it went idle (CLOCK_MONOTONIC) */
+} idle_conn_t;
+
+typedef struct origin {
+    char *host;                 /* Lower case */
+    int port;
+    int nidle;
+    idle_conn_t *idle;          /* max_idle slots, oldest first */
+    struct origin *next;
+} origin_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    origin_t *origins;
+} __attribute__((aligned(64))) bucket_t;
+
+static int max_idle, idle_timeout;
+static bucket_t *buckets;
+static int idle_total;
+
+static void *reaper_thread(void *vargp);
+
+static time_t now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+void upstream_init(int idle_per_origin, int timeout) {
+    /* Sets the pool limits and starts the reaper; 0 idle connections disables pooling */
+    pthread_t tid;
+    int i;
+
+    max_idle = idle_per_origin;
+    idle_timeout = timeout;
+    if (max_idle <= 0)
+        return;
+    buckets = Calloc(UPSTREAM_BUCKETS, sizeof(bucket_t));
+    for (i = 0; i < UPSTREAM_BUCKETS; i++)
+        pthread_mutex_init(&buckets[i].lock, NULL);
+    Pthread_create(&tid, NULL, reaper_thread, NULL);
+}
+
+int upstream_enabled(void) {
+    return max_idle > 0;
+}
+
+int upstream_idle_count(void) {
+    return __atomic_load_n(&idle_total, __ATOMIC_RELAXED);
+}
+
+static bucket_t *bucket_of(const char *host, int port) {
+    /* FNV-1a over the host name, case-folded, mixed with the port */
+    unsigned long h = 14695981039346656037UL;
+
+    while (*host)
+        h = (h ^ (unsigned char)tolower((unsigned char)*host++)) * 1099511628211UL;
+    h = (h ^ port) * 1099511628211UL;
+    return &buckets[(h >> 24) % UPSTREAM_BUCKETS];
+}
+
+static origin_t *find_origin(bucket_t *bp, const char *host, int port, int create) {
+    /* Looks up (or adds) an origin; caller holds the bucket lock */
+    origin_t *op;
+    char *p;
+
+    for (op = bp->origins; op; op = op->next)
+        if (op->port == port && !strcasecmp(op->host, host))
+            return op;
+    if (!create)
+        return NULL;
+    op = Calloc(1, sizeof(origin_t));
+    op->host = strdup(host);
+    for (p = op->host; *p; p++)
+        *p = tolower((unsigned char)*p);
+    op->port = port;
+    op->idle = Calloc(max_idle, sizeof(idle_conn_t));
+    op->next = bp->origins;
+    bp->origins = op;
+    return op;
+}
+
+static int still_usable(int fd) {
+    /* Returns 1 if nothing, not even EOF, has arrived on an idle connection */
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_checkout(const char *host, int port) {
+    /* Returns a healthy idle connection to host:port, or -1 if there is none */
+    bucket_t *bp;
+    origin_t *op;
+    idle_conn_t ic;
+    time_t t = now();
+    int fd = -1;
+
+    if (!upstream_enabled())
+        return -1;
+    bp = bucket_of(host, port);
+    pthread_mutex_lock(&bp->lock);
+    if ((op = find_origin(bp, host, port, 0)) != NULL) {
+        // Newest first; anything that fails the checks is closed on the way
+        while (fd < 0 && op->nidle > 0) {
+            ic = op->idle[--op->nidle];
+            __atomic_sub_fetch(&idle_total, 1, __ATOMIC_RELAXED);
+            if (t - ic.since < idle_timeout && still_usable(ic.fd))
+                fd = ic.fd;
+            else
+                close(ic.fd);
+        }
+    }
+    pthread_mutex_unlock(&bp->lock);
+    return fd;
+}
+
+void upstream_checkin(const char *host, int port, int fd) {
+    /* Parks a connection whose last response was read to its end */
+    bucket_t *bp;
+    origin_t *op;
+    int victim = -1;
+
+    // Servers may keep the connection open even when asked to close it
+    if (!upstream_enabled()) {
+        close(fd);
+        return;
+    }
+    bp = bucket_of(host, port);
+    pthread_mutex_lock(&bp->lock);
+    op = find_origin(bp, host, port, 1);
+    if (op->nidle == max_idle) {
+        // Full: the oldest one makes room
+        victim = op->idle[0].fd;
+        memmove(op->idle, op->idle + 1, (max_idle - 1) * sizeof(idle_conn_t));
+        op->nidle--;
+        __atomic_sub_fetch(&idle_total, 1, __ATOMIC_RELAXED);
+    }
+    op->idle[op->nidle].fd = fd;
+    op->idle[op->nidle].since = now();
+    op->nidle++;
+    __atomic_add_fetch(&idle_total, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&bp->lock);
+
+    if (victim >= 0)
+        close(victim);
+}
+
+static void *reaper_thread(void *vargp) {
+    /* Closes connections that have been idle too long, and forgets empty origins */
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        int i, j, k;
+        time_t t;
+
+        sleep(1);
+        t = now();
+        for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+            bucket_t *bp = &buckets[i];
+            origin_t **pp, *op;
+
+            pthread_mutex_lock(&bp->lock);
+            for (pp = &bp->origins; (op = *pp) != NULL; ) {
+                // Idle lists are oldest first, so the expired ones lead
+                for (j = 0; j < op->nidle && t - op->idle[j].since >= idle_timeout; j++)
+                    close(op->idle[j].fd);
+                if (j > 0) {
+                    for (k = j; k < op->nidle; k++)
+                        op->idle[k - j] = op->idle[k];
+                    op->nidle -= j;
+                    __atomic_sub_fetch(&idle_total, j, __ATOMIC_RELAXED);
+                }
+                if (op->nidle == 0) {
+                    *pp = op->next;
+                    free(op->host);
+                    free(op->idle);
+                    free(op);
+                } else {
+                    pp = &op->next;
+                }
+            }
+            pthread_mutex_unlock(&bp->lock);
+        }
+    }
+    return NULL;
+}
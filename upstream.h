@@ -0,0 +1,16 @@
+/*
+ * upstream.h - Pool of idle keep-alive connections to end servers
+ */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPSTREAM_MAX_IDLE 8         /* Default -k: idle connections per origin */
+#define UPSTREAM_IDLE_TIMEOUT 30    /* Default -K: seconds before an idle one is closed */
+
+void upstream_init(int max_idle, int idle_timeout);
+int upstream_enabled(void);
+int upstream_checkout(const char *host, int port);
+void upstream_checkin(const char *host, int port, int fd);
+int upstream_idle_count(void);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,786 @@
+/*
+ * uring.c - io_uring engine for the proxy
+ *
+ * The epoll engine still pays one read() or write() system call per
+ * buffer it moves. This engine queues accept, socket, connect, read
+ * and write requests for all of its connections in a submission ring
+ * and hands the whole batch to the kernel with a single
+ * io_uring_enter(), which also reaps the completions of earlier ones.
+ *
+ * Every socket is a registered ("direct") descriptor: accept and socket
+ * requests install the new socket straight into the ring's file table,
+ * so the kernel never has to look up an fd. Each connection slot owns
+ * two registered buffers, its rio_t request buffer and its relay
+ * buffer, which are read and written with READ_FIXED and WRITE_FIXED.
+ *
+ * The connection state machine mirrors event.c, including the reuse
+ * of read_request() on the buffered request. uring_run() returns -1
+ * without serving anything when the kernel lacks io_uring or one of the
+ * operations above, and the caller falls back to the blocking engine.
+ *
+ * DNS cache misses complete on the resolver thread, which lists the
+ * slot with its ring and bumps an eventfd the ring always has a read
+ * queued on.
+ *
+ * Like event.c, this engine does not revalidate expired cache entries
+ * (no conditional requests, 304 merges, stale-while-revalidate or
+ * stale-if-error); a stale object is fetched again in full.
+ *
+ * liburing is not assumed to be installed, so the ring is set up with
+ * the raw system calls.
+ */
+#include "proxy.h"
+#include "cache.h"
+#include "dns.h"
+#include "stats.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_CONNS 256                /* Connection slots per ring */
+#define URING_ENTRIES 1024             /* Submission queue entries */
+#define ACCEPT_SLOT URING_CONNS        /* user_data slot for the accept */
+#define RESOLVED_SLOT (URING_CONNS + 1) /* user_data slot for the resolver's eventfd */
+
+/* Operations a connection slot can have in flight */
+typedef enum {
+    OP_ACCEPT,
+    OP_READ_REQUEST,
+    OP_SOCKET,
+    OP_CONNECT,
+    OP_WRITE_REQUEST,
+    OP_READ_RESPONSE,
+    OP_WRITE_RESPONSE,
+    OP_SEND_CACHED,
+    OP_SEND_STATS,
+    OP_CLOSE,
+    OP_RESOLVED
+} uring_op_t;
+
+struct uloop;
+
+typedef struct uconn {
+    int client, server;            /* Direct descriptor indexes, -1 if none */
+    size_t buf_len, buf_off;
+    char *uri, *hostname;          /* Kept for the log entry */
+    char *key;                     /* Cache key of the request */
+    int port;
+    struct addrinfo *addrs, *next_addr;
+    struct uloop *loop;            /* Owner, for the resolver's callback */
+    int dns_err;                   /* Outcome of a lookup that went to the resolver */
+    struct uconn *next_resolved;
+    size_t total_size;
+    cache_obj_t *obj;              /* Cached response being sent */
+    cache_fill_t fill;             /* Response being collected for the cache */
+    binlog_trace_t trace;          /* What the binary log records about the request */
+    rio_t rio;                     /* Client request bytes (registered buffer 2i) */
+    http_req_t req;                /* Parse of rio's buffer so far */
+    char buf[MAXBUF];              /* Relay buffer (registered buffer 2i+1) */
+} uconn_t;
+
+/* A mapped io_uring instance */
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    char *sq_ptr, *cq_ptr;         /* The mappings, for ring_free() */
+    size_t sq_size, cq_size, sqes_size;
+    unsigned sq_local_tail;        /* Tail including unpublished entries */
+    unsigned pending;              /* Queued but not yet submitted */
+} ring_t;
+
+typedef struct uloop {
+    ring_t ring;
+    int fixed_bufs;                /* Buffers registered (else plain recv/send) */
+    int accept_armed;
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    uconn_t conns[URING_CONNS];
+    int free_slots[URING_CONNS];
+    int nfree;
+    int wakefd;                    /* eventfd the resolver signals */
+    uint64_t wake_count;           /* Read target for it */
+    pthread_mutex_t resolved_lock;
+    uconn_t *resolved;             /* Lookups completed by the resolver */
+    pthread_t tid;
+} uloop_t;
+
+static int ring_setup(ring_t *r, unsigned entries);
+static int ring_unwind(ring_t *r);
+static void ring_free(ring_t *r);
+static int ring_probe(ring_t *r);
+static struct io_uring_sqe *ring_get_sqe(ring_t *r);
+static int ring_submit_and_wait(ring_t *r, unsigned wait_nr);
+static int uloop_init(uloop_t *lp, int listenfd);
+static void *uloop_thread(void *vargp);
+static void handle_cqe(uloop_t *lp, struct io_uring_cqe *cqe);
+static void arm_accept(uloop_t *lp);
+static void queue_read(uloop_t *lp, int slot, int fidx, char *buf, size_t len, int bufidx, uring_op_t op);
+static void queue_write(uloop_t *lp, int slot, int fidx, char *buf, size_t len, int bufidx, uring_op_t op);
+static void queue_socket(uloop_t *lp, int slot);
+static void queue_close(uloop_t *lp, int fidx);
+static void queue_send_cached(uloop_t *lp, int slot);
+static void uconn_request_done(uloop_t *lp, int slot);
+static void dns_done(void *arg, int err, struct addrinfo *res);
+static void arm_resolved(uloop_t *lp);
+static void take_resolved(uloop_t *lp);
+static void uconn_free(uloop_t *lp, int slot);
+
+static inline __u64 udata(int slot, uring_op_t op) { return ((__u64)slot << 8) | op; }
+
+int uring_run(int listenfd, int nrings) {
+    /*
+     * Starts nrings io_uring loops on listenfd and waits on them forever.
+     * Returns -1 right away if io_uring cannot be used on this kernel.
+     */
+    uloop_t **loops = Calloc(nrings, sizeof(uloop_t *));
+    int i;
+
+    for (i = 0; i < nrings; i++) {
+        loops[i] = Calloc(1, sizeof(uloop_t));
+        if (uloop_init(loops[i], listenfd) < 0) {
+            // Nothing has been submitted yet, so the rings can simply go away
+            while (i >= 0) {
+                ring_free(&loops[i]->ring);
+                if (loops[i]->wakefd > 0)
+                    close(loops[i]->wakefd);
+                free(loops[i--]);
+            }
+            free(loops);
+            return -1;
+        }
+    }
+    for (i = 0; i < nrings; i++)
+        Pthread_create(&loops[i]->tid, NULL, uloop_thread, loops[i]);
+    printf("io_uring engine running with %d rings%s\n", nrings,
+           loops[0]->fixed_bufs ? "" : " (unregistered buffers)");
+
+    for (i = 0; i < nrings; i++)
+        Pthread_join(loops[i]->tid, NULL);
+    return 0;
+}
+
+static int uloop_init(uloop_t *lp, int listenfd) {
+    /* Creates the ring and registers its file table and buffers */
+    int fds[1 + 2 * URING_CONNS];
+    struct iovec iov[2 * URING_CONNS];
+    int i;
+
+    if (ring_setup(&lp->ring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "io_uring_setup: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ring_probe(&lp->ring) < 0)
+        return -1;
+
+    // Slot 0 holds the listener, the rest are filled in by accept and socket
+    fds[0] = listenfd;
+    for (i = 1; i < 1 + 2 * URING_CONNS; i++)
+        fds[i] = -1;
+    if (syscall(__NR_io_uring_register, lp->ring.fd, IORING_REGISTER_FILES,
+                fds, 1 + 2 * URING_CONNS) < 0) {
+        fprintf(stderr, "io_uring_register files: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < URING_CONNS; i++) {
+        iov[2 * i].iov_base = lp->conns[i].rio.rio_buf;
+        iov[2 * i].iov_len = RIO_BUFSIZE;
+        iov[2 * i + 1].iov_base = lp->conns[i].buf;
+        iov[2 * i + 1].iov_len = MAXBUF;
+        lp->free_slots[i] = URING_CONNS - 1 - i;
+    }
+    lp->nfree = URING_CONNS;
+
+    // Pinned buffers count against RLIMIT_MEMLOCK; plain recv/send still batch
+    lp->fixed_bufs = syscall(__NR_io_uring_register, lp->ring.fd, IORING_REGISTER_BUFFERS,
+                             iov, 2 * URING_CONNS) == 0;
+
+    if ((lp->wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&lp->resolved_lock, NULL);
+    return 0;
+}
+
+static void *uloop_thread(void *vargp) {
+    /* Body of a ring thread: one io_uring_enter() per batch of completions */
+    uloop_t *lp = vargp;
+    ring_t *r = &lp->ring;
+    unsigned head, tail;
+
+    arm_accept(lp);
+    arm_resolved(lp);
+    while (1) {
+        if (ring_submit_and_wait(r, 1) < 0 && errno != EINTR && errno != EBUSY)
+            unix_error("io_uring_enter error");
+
+        head = *r->cq_head;
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_cqe(lp, &r->cqes[head & *r->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void handle_cqe(uloop_t *lp, struct io_uring_cqe *cqe) {
+    /* Advances the connection that owns a completion by one step */
+    int slot = cqe->user_data >> 8;
+    uring_op_t op = cqe->user_data & 0xff;
+    int res = cqe->res;
+    char hostname[MAXLINE], port[MAXLINE];
+    uconn_t *c;
+
+    if (op == OP_CLOSE)
+        return;
+
+    if (op == OP_RESOLVED) {
+        take_resolved(lp);
+        arm_resolved(lp);
+        return;
+    }
+
+    if (op == OP_ACCEPT) {
+        lp->accept_armed = 0;
+        if (res >= 0) {
+            if (getnameinfo((SA *)&lp->clientaddr, lp->clientlen, hostname, MAXLINE,
+                            port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+                printf("Accepted connection from (%s, %s)\n", hostname, port);
+            stats_add(STAT_CONNS_OPENED, 1);
+            slot = lp->free_slots[--lp->nfree];
+            c = &lp->conns[slot];
+            memset(c, 0, offsetof(uconn_t, rio));
+            c->client = res;
+            c->server = -1;
+            rio_readinitb(&c->rio, -1);
+            http_req_init(&c->req);
+            if (binlog_enabled())
+                binlog_peer(&c->trace, (SA *)&lp->clientaddr);
+            queue_read(lp, slot, c->client, c->rio.rio_buf, RIO_BUFSIZE, 2 * slot, OP_READ_REQUEST);
+        } else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED) {
+            fprintf(stderr, "accept error: %s\n", strerror(-res));
+        }
+        arm_accept(lp);
+        return;
+    }
+
+    c = &lp->conns[slot];
+    switch (op) {
+    case OP_READ_REQUEST:
+        if (res <= 0) {
+            uconn_free(lp, slot);
+            return;
+        }
+        c->rio.rio_cnt += res;
+        switch (http_parse_request(&c->req, c->rio.rio_bufptr, c->rio.rio_cnt)) {
+        case HTTP_AGAIN:
+            if (c->rio.rio_cnt == RIO_BUFSIZE) {
+                fprintf(stderr, "Error: request header too large\n");
+                uconn_free(lp, slot);
+                return;
+            }
+            queue_read(lp, slot, c->client, c->rio.rio_buf + c->rio.rio_cnt,
+                       RIO_BUFSIZE - c->rio.rio_cnt, 2 * slot, OP_READ_REQUEST);
+            return;
+        case HTTP_ERROR:
+            fprintf(stderr, "Error: malformed request\n");
+            uconn_free(lp, slot);
+            return;
+        case HTTP_DONE:
+            break;
+        }
+        uconn_request_done(lp, slot);
+        break;
+
+    case OP_SOCKET:
+        if (res < 0) {
+            c->next_addr = c->next_addr->ai_next;
+            queue_socket(lp, slot);
+            return;
+        }
+        c->server = res;
+        {
+            struct io_uring_sqe *sqe = ring_get_sqe(&lp->ring);
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = c->server;
+            sqe->addr = (__u64)(uintptr_t)c->next_addr->ai_addr;
+            sqe->off = c->next_addr->ai_addrlen;
+            sqe->user_data = udata(slot, OP_CONNECT);
+        }
+        break;
+
+    case OP_CONNECT:
+        if (res < 0) {
+            // This address failed, move on to the next candidate
+            queue_close(lp, c->server);
+            c->server = -1;
+            c->next_addr = c->next_addr->ai_next;
+            queue_socket(lp, slot);
+            return;
+        }
+        dns_prefer(c->hostname, c->port, c->next_addr->ai_family);
+        dns_freeaddrinfo(c->addrs);
+        c->addrs = c->next_addr = NULL;
+        binlog_mark(&c->trace, BINLOG_CONNECTED);
+        queue_write(lp, slot, c->server, c->buf, c->buf_len, 2 * slot + 1, OP_WRITE_REQUEST);
+        break;
+
+    case OP_WRITE_REQUEST:
+    case OP_WRITE_RESPONSE:
+        if (res <= 0) {
+            fprintf(stderr, "Rio_writen error: %s\n", strerror(res < 0 ? -res : EPIPE));
+            uconn_free(lp, slot);
+            return;
+        }
+        c->buf_off += res;
+        if (op == OP_WRITE_RESPONSE)
+            c->total_size += res;
+        if (c->buf_off < c->buf_len) {
+            queue_write(lp, slot, op == OP_WRITE_REQUEST ? c->server : c->client,
+                        c->buf + c->buf_off, c->buf_len - c->buf_off, 2 * slot + 1, op);
+            return;
+        }
+        queue_read(lp, slot, c->server, c->buf, MAXBUF, 2 * slot + 1, OP_READ_RESPONSE);
+        break;
+
+    case OP_READ_RESPONSE:
+        if (res < 0) {
+            fprintf(stderr, "Error: Failed to read response from server\n");
+            cache_fill_abort(&c->fill);
+            res = 0;
+        }
+        if (res == 0) {  // End server is done: log and tear down
+            // An early close leaves a body short of its Content-Length or last chunk
+            if (!cache_fill_complete(&c->fill))
+                cache_fill_abort(&c->fill);
+            cache_fill_commit(&c->fill, c->key);
+            if (c->total_size > 0)
+                format_log_entry(c->hostname, c->uri, c->total_size, &c->trace);
+            uconn_free(lp, slot);
+            return;
+        }
+        // Bytes are relayed as they come; the status line starts the first read
+        if (c->total_size == 0) {
+            c->trace.status = http_response_status(c->buf, res);
+            binlog_mark(&c->trace, BINLOG_HEADER);
+        }
+        cache_fill_append(&c->fill, c->buf, res);
+        c->buf_len = res;
+        c->buf_off = 0;
+        queue_write(lp, slot, c->client, c->buf, c->buf_len, 2 * slot + 1, OP_WRITE_RESPONSE);
+        break;
+
+    case OP_SEND_CACHED:
+        if (res <= 0) {
+            fprintf(stderr, "Rio_writen error: %s\n", strerror(res < 0 ? -res : EPIPE));
+            uconn_free(lp, slot);
+            return;
+        }
+        c->total_size += res;
+        if (c->total_size < c->obj->size) {
+            queue_send_cached(lp, slot);
+            return;
+        }
+        format_log_entry(c->hostname, c->uri, c->total_size, &c->trace);
+        uconn_free(lp, slot);
+        break;
+
+    case OP_SEND_STATS:
+        if (res > 0 && (c->buf_off += res) < c->buf_len) {
+            queue_write(lp, slot, c->client, c->buf + c->buf_off, c->buf_len - c->buf_off,
+                        2 * slot + 1, OP_SEND_STATS);
+            return;
+        }
+        uconn_free(lp, slot);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void uconn_request_done(uloop_t *lp, int slot) {
+    /* Parses the buffered request and starts connecting to the end server */
+    uconn_t *c = &lp->conns[slot];
+    char uri[MAXLINE], hostname[MAXLINE], path[MAXLINE];
+    char key[MAXLINE];
+    http_hdr_t http_header;
+    ssize_t len;
+    int rc;
+
+    if (read_request(&c->rio, &c->req, uri, hostname, path, &c->port) < 0) {
+        uconn_free(lp, slot);
+        return;
+    }
+    c->uri = strdup(uri);
+    c->hostname = strdup(hostname);
+    stats_add(STAT_REQUESTS, 1);
+    stats_add(STAT_BYTES_IN, c->req.len);
+    binlog_start(&c->trace);
+
+    // The proxy's own stats are answered from the relay buffer
+    if (stats_is_request(hostname, path)) {
+        c->buf_len = stats_response(c->buf, sizeof(c->buf), path, 0);
+        c->buf_off = 0;
+        if (c->buf_len == 0) {
+            uconn_free(lp, slot);
+            return;
+        }
+        queue_write(lp, slot, c->client, c->buf, c->buf_len, 2 * slot + 1, OP_SEND_STATS);
+        return;
+    }
+
+    // A fresh cache hit is sent from the object itself, which is not a registered
+    // buffer; a stale one is fetched again in full
+    cache_key(key, hostname, c->port, path);
+    if (request_cacheable(&c->req) && (c->obj = cache_lookup(key)) != NULL) {
+        if (cache_freshness(c->obj) == CACHE_FRESH) {
+            c->trace.cache = BINLOG_HIT;
+            c->trace.status = http_response_status(c->obj->data, c->obj->size);
+            queue_send_cached(lp, slot);
+            return;
+        }
+        cache_release(c->obj);
+        c->obj = NULL;
+    }
+    c->key = strdup(key);
+    cache_fill_init(&c->fill);
+    if (!request_cacheable(&c->req))
+        cache_fill_abort(&c->fill);
+    c->trace.cache = cache_enabled() && request_cacheable(&c->req) ? BINLOG_MISS : BINLOG_BYPASS;
+
+    // The relay buffer is idle until the response arrives, so stage the header
+    // there; this engine reads every response to EOF, so the server closes
+    if (build_http_header(&http_header, &c->req, hostname, path, 0) < 0 ||
+        (len = http_hdr_copy(&http_header, c->buf, sizeof(c->buf))) < 0) {
+        fprintf(stderr, "Error: request header too large\n");
+        uconn_free(lp, slot);
+        return;
+    }
+    c->buf_len = len;
+    c->buf_off = 0;
+
+    // A miss parks the slot, with nothing in flight, until dns_done()
+    c->loop = lp;
+    if ((rc = dns_lookup(c->hostname, c->port, &c->addrs, dns_done, c)) == DNS_PENDING)
+        return;
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%d): %s\n", c->hostname, c->port, gai_strerror(rc));
+        c->addrs = NULL;
+        fprintf(stderr, "Error: Failed to connect to server %s\n", c->hostname);
+        stats_add(STAT_CONNECT_FAILURES, 1);
+        uconn_free(lp, slot);
+        return;
+    }
+    c->next_addr = c->addrs;
+    queue_socket(lp, slot);
+}
+
+static void dns_done(void *arg, int err, struct addrinfo *res) {
+    /* Resolver callback: queues the slot for its ring thread */
+    uconn_t *c = arg;
+    uloop_t *lp = c->loop;
+    uint64_t one = 1;
+
+    c->dns_err = err;
+    c->addrs = res;
+    pthread_mutex_lock(&lp->resolved_lock);
+    c->next_resolved = lp->resolved;
+    lp->resolved = c;
+    pthread_mutex_unlock(&lp->resolved_lock);
+    if (write(lp->wakefd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "eventfd write error: %s\n", strerror(errno));
+}
+
+static void take_resolved(uloop_t *lp) {
+    /* Starts connecting every slot whose lookup finished */
+    uconn_t *c, *next;
+    int slot, rc;
+
+    pthread_mutex_lock(&lp->resolved_lock);
+    c = lp->resolved;
+    lp->resolved = NULL;
+    pthread_mutex_unlock(&lp->resolved_lock);
+
+    for (; c; c = next) {
+        next = c->next_resolved;
+        slot = c - lp->conns;
+        if ((rc = c->dns_err) != 0) {
+            fprintf(stderr, "getaddrinfo failed (%s:%d): %s\n", c->hostname, c->port, gai_strerror(rc));
+            c->addrs = NULL;
+            fprintf(stderr, "Error: Failed to connect to server %s\n", c->hostname);
+            stats_add(STAT_CONNECT_FAILURES, 1);
+            uconn_free(lp, slot);
+            continue;
+        }
+        c->next_addr = c->addrs;
+        queue_socket(lp, slot);
+    }
+}
+
+static void arm_resolved(uloop_t *lp) {
+    /* Keeps a read queued on the resolver's eventfd (a plain, unregistered fd) */
+    struct io_uring_sqe *sqe = ring_get_sqe(&lp->ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = lp->wakefd;
+    sqe->addr = (__u64)(uintptr_t)&lp->wake_count;
+    sqe->len = sizeof(lp->wake_count);
+    sqe->off = (__u64)-1;
+    sqe->user_data = udata(RESOLVED_SLOT, OP_RESOLVED);
+}
+
+static void queue_socket(uloop_t *lp, int slot) {
+    /* Creates a direct socket for the next candidate address, if any */
+    uconn_t *c = &lp->conns[slot];
+    struct io_uring_sqe *sqe;
+
+    if (c->next_addr == NULL) {
+        fprintf(stderr, "Error: Failed to connect to server %s\n", c->hostname);
+        stats_add(STAT_CONNECT_FAILURES, 1);
+        uconn_free(lp, slot);
+        return;
+    }
+    sqe = ring_get_sqe(&lp->ring);
+    sqe->opcode = IORING_OP_SOCKET;
+    sqe->fd = c->next_addr->ai_family;
+    sqe->off = c->next_addr->ai_socktype;
+    sqe->len = c->next_addr->ai_protocol;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = udata(slot, OP_SOCKET);
+}
+
+static void arm_accept(uloop_t *lp) {
+    /* Keeps one accept in flight while there are free connection slots */
+    struct io_uring_sqe *sqe;
+
+    if (lp->accept_armed || lp->nfree == 0)
+        return;
+    lp->clientlen = sizeof(lp->clientaddr);
+    sqe = ring_get_sqe(&lp->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->addr = (__u64)(uintptr_t)&lp->clientaddr;
+    sqe->addr2 = (__u64)(uintptr_t)&lp->clientlen;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = udata(ACCEPT_SLOT, OP_ACCEPT);
+    lp->accept_armed = 1;
+}
+
+static void queue_read(uloop_t *lp, int slot, int fidx, char *buf, size_t len, int bufidx, uring_op_t op) {
+    /* Queues a read from a direct descriptor into one of the slot's buffers */
+    struct io_uring_sqe *sqe = ring_get_sqe(&lp->ring);
+
+    sqe->opcode = lp->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = fidx;
+    sqe->addr = (__u64)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = lp->fixed_bufs ? (__u64)-1 : 0;
+    sqe->buf_index = lp->fixed_bufs ? bufidx : 0;
+    sqe->user_data = udata(slot, op);
+}
+
+static void queue_write(uloop_t *lp, int slot, int fidx, char *buf, size_t len, int bufidx, uring_op_t op) {
+    /* Queues a write to a direct descriptor from one of the slot's buffers */
+    struct io_uring_sqe *sqe = ring_get_sqe(&lp->ring);
+
+    sqe->opcode = lp->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = fidx;
+    sqe->addr = (__u64)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = lp->fixed_bufs ? (__u64)-1 : 0;
+    sqe->msg_flags = lp->fixed_bufs ? 0 : MSG_NOSIGNAL;
+    sqe->buf_index = lp->fixed_bufs ? bufidx : 0;
+    sqe->user_data = udata(slot, op);
+}
+
+static void queue_send_cached(uloop_t *lp, int slot) {
+    /* Queues the next part of a cached response to the client */
+    uconn_t *c = &lp->conns[slot];
+    struct io_uring_sqe *sqe = ring_get_sqe(&lp->ring);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = c->client;
+    sqe->addr = (__u64)(uintptr_t)(c->obj->data + c->total_size);
+    sqe->len = c->obj->size - c->total_size;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = udata(slot, OP_SEND_CACHED);
+}
+
+static void queue_close(uloop_t *lp, int fidx) {
+    /* Queues the release of a direct descriptor; the completion is ignored */
+    struct io_uring_sqe *sqe = ring_get_sqe(&lp->ring);
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = fidx + 1;
+    sqe->user_data = udata(ACCEPT_SLOT, OP_CLOSE);
+}
+
+static void uconn_free(uloop_t *lp, int slot) {
+    /* Closes both sides of a connection and returns its slot */
+    uconn_t *c = &lp->conns[slot];
+
+    if (c->client >= 0)
+        queue_close(lp, c->client);
+    if (c->server >= 0)
+        queue_close(lp, c->server);
+    if (c->addrs)
+        dns_freeaddrinfo(c->addrs);
+    free(c->uri);
+    free(c->hostname);
+    free(c->key);
+    if (c->obj)
+        cache_release(c->obj);
+    cache_fill_abort(&c->fill);
+    stats_add(STAT_CONNS_CLOSED, 1);
+    lp->free_slots[lp->nfree++] = slot;
+    arm_accept(lp);
+}
+
+/*********************************
+ * Minimal io_uring ring handling
+ *********************************/
+
+static int ring_setup(ring_t *r, unsigned entries) {
+    /*
+     * Creates an io_uring and maps its submission and completion rings.
+     * On failure nothing is left mapped or open, and errno says why.
+     */
+    struct io_uring_params p;
+    char *sq_ptr, *cq_ptr;
+    void *sqes;
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_size = r->cq_size = r->sq_size > r->cq_size ? r->sq_size : r->cq_size;
+
+    // Each mapping is recorded as soon as it exists, for ring_unwind()
+    if ((sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+        return ring_unwind(r);
+    r->sq_ptr = sq_ptr;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else if ((cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        return ring_unwind(r);
+    r->cq_ptr = cq_ptr;
+
+    if ((sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQES)) == MAP_FAILED)
+        return ring_unwind(r);
+    r->sqes = sqes;
+
+    r->sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    r->sq_entries = (unsigned *)(sq_ptr + p.sq_off.ring_entries);
+    r->sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+    r->sq_local_tail = *r->sq_tail;
+    r->pending = 0;
+    return 0;
+}
+
+static int ring_unwind(ring_t *r) {
+    /* Undoes a ring_setup() that failed partway, keeping its errno */
+    int err = errno;
+
+    ring_free(r);
+    errno = err;
+    return -1;
+}
+
+static void ring_free(ring_t *r) {
+    /* Unmaps whatever ring_setup() mapped and closes the ring */
+    if (r->sqes != NULL)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr != NULL)
+        munmap(r->sq_ptr, r->sq_size);
+    if (r->fd > 0)
+        close(r->fd);
+    r->sqes = NULL;
+    r->sq_ptr = r->cq_ptr = NULL;
+    r->fd = -1;
+}
+
+static int ring_probe(ring_t *r) {
+    /* Checks that the kernel implements every operation the engine issues */
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_SOCKET, IORING_OP_CONNECT, IORING_OP_READ_FIXED,
+        IORING_OP_WRITE_FIXED, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_CLOSE,
+        IORING_OP_READ
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = Calloc(1, len);
+    int i, rc = 0;
+
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        fprintf(stderr, "io_uring_register probe: %s\n", strerror(errno));
+        rc = -1;
+    }
+    for (i = 0; rc == 0 && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            fprintf(stderr, "io_uring: kernel lacks opcode %d\n", needed[i]);
+            rc = -1;
+        }
+    }
+    free(probe);
+    return rc;
+}
+
+static struct io_uring_sqe *ring_get_sqe(ring_t *r) {
+    /* Returns a zeroed submission entry, flushing the queue if it is full */
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= *r->sq_entries) {
+        if (ring_submit_and_wait(r, 0) < 0 && errno != EINTR && errno != EBUSY)
+            unix_error("io_uring_enter error");
+    }
+    idx = r->sq_local_tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    r->pending++;
+    return sqe;
+}
+
+static int ring_submit_and_wait(ring_t *r, unsigned wait_nr) {
+    /* Publishes queued entries and submits them, optionally waiting for completions */
+    int n;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    n = syscall(__NR_io_uring_enter, r->fd, r->pending, wait_nr,
+                wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0)
+        return -1;
+    r->pending -= n;
+    return n;
+}